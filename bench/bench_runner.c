@@ -0,0 +1,318 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs Lox scripts under each interpreter mode and reports the median and
+// spread of wall time and peak RSS over several runs.
+//
+//   bench_runner [--runs N] [--timeout SECONDS] [--json FILE] LOX SCRIPT...
+//
+// A script restricts the modes it runs in with a comment line such as
+// `// bench-modes: --tree-walk`. A run that exits with a non-zero status,
+// dies from a signal or exceeds the CPU time limit marks its script and
+// mode as failed; failures are reported rather than aborting the suite.
+
+#define RUNS_DEFAULT 5
+#define RUNS_MAX 100
+#define TIMEOUT_DEFAULT 30
+#define LINE_MAX_LENGTH 256
+#define MODES_DIRECTIVE "// bench-modes:"
+
+typedef struct bench_mode {
+    const char* flag;
+    const char* name;
+    const char* extra;
+} BenchMode;
+
+typedef struct bench_stats {
+    double median;
+    double min;
+    double max;
+} BenchStats;
+
+typedef struct bench_result {
+    const char* script;
+    const char* mode;
+    int ok;
+    int exitStatus;
+    int signal;
+    BenchStats wall;
+    BenchStats rss;
+} BenchResult;
+
+// Bytecode runs bypass the .loxc cache so that every run compiles the
+// script and the bench directory is left untouched.
+static const BenchMode modes[] = {
+    { "--vm", "vm", "--no-cache" },
+    { "--register", "register", "--no-cache" },
+    { "--tree-walk", "tree-walk", NULL },
+};
+
+#define MODE_COUNT ((int)(sizeof(modes) / sizeof(modes[0])))
+
+static int runs = RUNS_DEFAULT;
+static int timeout = TIMEOUT_DEFAULT;
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [--runs N] [--timeout SECONDS] [--json FILE] LOX SCRIPT...\n", name);
+}
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static const char* script_name(const char* path)
+{
+    const char* name = strrchr(path, '/');
+    return name == NULL ? path : name + 1;
+}
+
+// Without a directive a script runs in every mode.
+static int script_runs_in(const char* path, const BenchMode* mode)
+{
+    char line[LINE_MAX_LENGTH];
+    FILE* fp = fopen(path, "r");
+    int found = 0, selected = 0;
+
+    if (fp == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, MODES_DIRECTIVE, strlen(MODES_DIRECTIVE)) == 0) {
+            found = 1;
+            selected = selected || strstr(line, mode->flag) != NULL;
+        }
+    }
+
+    fclose(fp);
+    return !found || selected;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static BenchStats stats(double* samples, int count)
+{
+    BenchStats result;
+
+    qsort(samples, count, sizeof(double), compare_doubles);
+    result.min = samples[0];
+    result.max = samples[count - 1];
+    result.median = count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    return result;
+}
+
+static void child_exec(const char* lox, const char* script, const BenchMode* mode)
+{
+    const char* argv[5];
+    struct rlimit limit;
+    int argc = 0;
+    int devnull = open("/dev/null", O_RDWR);
+
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+    }
+
+    limit.rlim_cur = timeout;
+    limit.rlim_max = timeout + 1;
+    setrlimit(RLIMIT_CPU, &limit);
+
+    argv[argc++] = lox;
+    argv[argc++] = mode->flag;
+    if (mode->extra != NULL) {
+        argv[argc++] = mode->extra;
+    }
+    argv[argc++] = script;
+    argv[argc] = NULL;
+
+    execv(lox, (char* const*)argv);
+    _exit(127);
+}
+
+// Returns 1 when the run succeeded, filling in its wall time in seconds and
+// peak RSS in KiB.
+static int run_once(const char* lox, const char* script, const BenchMode* mode, double* wall, double* rss, BenchResult* result)
+{
+    struct rusage usage;
+    double start = now();
+    int status = 0;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0) {
+        child_exec(lox, script, mode);
+    }
+
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+
+    *wall = now() - start;
+#ifdef __APPLE__
+    *rss = usage.ru_maxrss / 1024.0;
+#else
+    *rss = usage.ru_maxrss;
+#endif
+
+    if (WIFSIGNALED(status)) {
+        result->signal = WTERMSIG(status);
+        return 0;
+    }
+
+    result->exitStatus = WEXITSTATUS(status);
+    return result->exitStatus == 0;
+}
+
+static BenchResult bench(const char* lox, const char* script, const BenchMode* mode)
+{
+    double wall[RUNS_MAX], rss[RUNS_MAX];
+    BenchResult result;
+    int i;
+
+    memset(&result, 0, sizeof(result));
+    result.script = script_name(script);
+    result.mode = mode->name;
+
+    for (i = 0; i < runs; i++) {
+        if (!run_once(lox, script, mode, &wall[i], &rss[i], &result)) {
+            return result;
+        }
+    }
+
+    result.ok = 1;
+    result.wall = stats(wall, runs);
+    result.rss = stats(rss, runs);
+    return result;
+}
+
+static void report(const BenchResult* result)
+{
+    if (!result->ok) {
+        if (result->signal) {
+            printf("%-16s %-10s failed: signal %d\n", result->script, result->mode, result->signal);
+        } else {
+            printf("%-16s %-10s failed: exit status %d\n", result->script, result->mode, result->exitStatus);
+        }
+        return;
+    }
+
+    printf("%-16s %-10s %9.4f s  [%.4f, %.4f]  %9.0f KiB  [%.0f, %.0f]\n", result->script, result->mode,
+        result->wall.median, result->wall.min, result->wall.max,
+        result->rss.median, result->rss.min, result->rss.max);
+}
+
+static void json_stats(FILE* fp, const char* name, const BenchStats* stats, const char* separator)
+{
+    fprintf(fp, "\"%s\": {\"median\": %.6f, \"min\": %.6f, \"max\": %.6f}%s", name, stats->median, stats->min, stats->max, separator);
+}
+
+static int json_write(const char* path, const char* lox, const BenchResult* results, int count)
+{
+    FILE* fp = fopen(path, "w");
+    int i;
+
+    if (fp == NULL) {
+        perror(path);
+        return 0;
+    }
+
+    fprintf(fp, "{\n  \"lox\": \"%s\",\n  \"runs\": %d,\n  \"results\": [\n", lox, runs);
+    for (i = 0; i < count; i++) {
+        fprintf(fp, "    {\"script\": \"%s\", \"mode\": \"%s\", ", results[i].script, results[i].mode);
+        if (results[i].ok) {
+            fprintf(fp, "\"status\": \"ok\", ");
+            json_stats(fp, "wall_seconds", &results[i].wall, ", ");
+            json_stats(fp, "max_rss_kib", &results[i].rss, "");
+        } else {
+            fprintf(fp, "\"status\": \"failed\", \"exit_status\": %d, \"signal\": %d", results[i].exitStatus, results[i].signal);
+        }
+        fprintf(fp, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    return fclose(fp) == 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* json = NULL;
+    const char* lox = NULL;
+    BenchResult* results = NULL;
+    int i = 1, m = 0, count = 0, failed = 0;
+
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (i + 1 >= argc || runs < 1 || runs > RUNS_MAX || timeout < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    lox = argv[i++];
+    results = (BenchResult*)calloc((size_t)(argc - i) * MODE_COUNT, sizeof(BenchResult));
+    if (results == NULL) {
+        fprintf(stderr, "Not enough memory for %d scripts\n", argc - i);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s, median [min, max] of %d runs\n", lox, runs);
+    for (; i < argc; i++) {
+        for (m = 0; m < MODE_COUNT; m++) {
+            if (!script_runs_in(argv[i], &modes[m])) {
+                continue;
+            }
+
+            results[count] = bench(lox, argv[i], &modes[m]);
+            report(&results[count]);
+            failed += !results[count].ok;
+            count++;
+            fflush(stdout);
+        }
+    }
+
+    if (failed) {
+        printf("%d of %d benchmarks failed\n", failed, count);
+    }
+
+    if (json != NULL && !json_write(json, lox, results, count)) {
+        free(results);
+        return EXIT_FAILURE;
+    }
+
+    free(results);
+    return EXIT_SUCCESS;
+}
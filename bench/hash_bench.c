@@ -0,0 +1,140 @@
+#include "vm/table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmark of the string hash against the byte-at-a-time FNV-1a it
+// replaced, over the lengths the VM hashes: identifiers, short payloads such
+// as messages and keys, and long payloads such as lines read or built.
+//
+//   hash_bench [strings] [rounds]
+
+#define ARENA_SIZE (1 << 24)
+
+typedef struct sample {
+    const char* name;
+    size_t lengthMin;
+    // Lengths are lengthMin plus the sum of two uniform draws below spread,
+    // which favours the middle of the range as real names do.
+    size_t spread;
+} Sample;
+
+static const Sample samples[] = {
+    { "identifiers", 1, 8 },
+    { "payloads 16-128", 16, 56 },
+    { "payloads 256-4k", 256, 1920 },
+};
+
+static char* arena;
+static size_t* offsets;
+static size_t* lengths;
+static int stringCount;
+static unsigned long long randomState = 88172645463325252ull;
+
+static unsigned int random_next()
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return (unsigned int)randomState;
+}
+
+static Hash hash_fnv1a(const char* chars, size_t length)
+{
+    Hash hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (Byte)chars[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static double now()
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// Fills the arena with strings of the sample's lengths. Returns their total
+// length.
+static size_t strings_make(const Sample* sample)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    size_t used = 0, total = 0, j;
+    int i;
+
+    for (i = 0; i < stringCount; i++) {
+        lengths[i] = sample->lengthMin + random_next() % sample->spread + random_next() % sample->spread;
+        if (used + lengths[i] > ARENA_SIZE) {
+            used = 0;
+        }
+        offsets[i] = used;
+        for (j = 0; j < lengths[i]; j++) {
+            arena[used + j] = alphabet[random_next() % (sizeof(alphabet) - 1)];
+        }
+        used += lengths[i];
+        total += lengths[i];
+    }
+
+    return total;
+}
+
+static double bench_hash(Hash (*hash)(const char*, size_t), Hash* sum)
+{
+    double start = now();
+    int i;
+
+    for (i = 0; i < stringCount; i++) {
+        *sum += hash(arena + offsets[i], lengths[i]);
+    }
+
+    return now() - start;
+}
+
+int main(int argc, const char* argv[])
+{
+    Hash sum = 0;
+    double best[2], elapsed;
+    size_t total;
+    int rounds, round, s, which;
+
+    stringCount = argc > 1 ? atoi(argv[1]) : 200000;
+    rounds = argc > 2 ? atoi(argv[2]) : 5;
+    arena = malloc(ARENA_SIZE);
+    offsets = malloc(sizeof(size_t) * (stringCount > 0 ? stringCount : 1));
+    lengths = malloc(sizeof(size_t) * (stringCount > 0 ? stringCount : 1));
+    if (stringCount <= 0 || rounds <= 0 || arena == NULL || offsets == NULL || lengths == NULL) {
+        fprintf(stderr, "usage: %s [strings] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    table_hash_seed(0);
+    printf("%d strings per sample, best of %d rounds\n", stringCount, rounds);
+    printf("%-18s %10s %10s %10s %10s\n", "", "mean len", "fnv1a", "table_hash", "speedup");
+    for (s = 0; s < (int)(sizeof(samples) / sizeof(samples[0])); s++) {
+        total = strings_make(&samples[s]);
+        for (round = 0; round < rounds; round++) {
+            for (which = 0; which < 2; which++) {
+                elapsed = bench_hash(which == 0 ? hash_fnv1a : table_hash, &sum);
+                if (round == 0 || elapsed < best[which]) {
+                    best[which] = elapsed;
+                }
+            }
+        }
+        printf("%-18s %10.1f %7.1f ns %7.1f ns %9.2fx\n", samples[s].name, (double)total / stringCount,
+            best[0] * 1e9 / stringCount, best[1] * 1e9 / stringCount, best[1] > 0 ? best[0] / best[1] : 0.0);
+    }
+
+    // Keeps the hashing from being optimized away.
+    if (sum == 1) {
+        printf("\n");
+    }
+
+    free(arena);
+    free(offsets);
+    free(lengths);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+#include "vm/compiler.h"
+#include "vm/table.h"
+#include "vm/vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmark of the VM hash table: string interning through vm.strings
+// and a key/value Table the way vm.globals uses it.
+//
+//   table_bench [keys] [rounds]
+
+#define KEY_LENGTH_MAX 32
+
+static char (*names)[KEY_LENGTH_MAX];
+static VmString** keys;
+static int keyCount;
+
+static double now()
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void report(const char* name, double seconds, long operations)
+{
+    printf("%-22s %8.1f ns/op\n", name, seconds * 1e9 / operations);
+}
+
+static double bench_intern_miss_insert()
+{
+    double start = now();
+    int i;
+
+    for (i = 0; i < keyCount; i++) {
+        keys[i] = vmstring_copy(names[i], strlen(names[i]));
+    }
+
+    return now() - start;
+}
+
+static double bench_intern_hit()
+{
+    double start = now();
+    int i;
+
+    for (i = 0; i < keyCount; i++) {
+        if (vmstring_copy(names[i], strlen(names[i])) != keys[i]) {
+            fprintf(stderr, "interning returned a different string for %s\n", names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return now() - start;
+}
+
+static double bench_find_miss()
+{
+    double start = now();
+    int i;
+
+    // The names are in the table, but under other hashes: every lookup
+    // probes a random group and must not match.
+    for (i = 0; i < keyCount; i++) {
+        if (table_find_string(&vm.strings, names[i], strlen(names[i]), keys[i]->hash ^ 0x9e3779b9u) != NULL) {
+            fprintf(stderr, "found %s under a foreign hash\n", names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return now() - start;
+}
+
+static double bench_set_get(Table* table)
+{
+    double start = now();
+    Value value;
+    int i;
+
+    for (i = 0; i < keyCount; i++) {
+        table_set(table, keys[i], number_val(i));
+    }
+
+    for (i = 0; i < keyCount; i++) {
+        if (!table_get(table, keys[i], &value) || AS_NUMBER(value) != i) {
+            fprintf(stderr, "lost key %s\n", keys[i]->chars);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return now() - start;
+}
+
+static double bench_churn(Table* table)
+{
+    double start = now();
+    int i, round;
+
+    for (round = 0; round < 4; round++) {
+        for (i = round % 2; i < keyCount; i += 2) {
+            table_delete(table, keys[i]);
+        }
+        for (i = round % 2; i < keyCount; i += 2) {
+            table_set(table, keys[i], nil_val());
+        }
+    }
+
+    if (table->count != keyCount) {
+        fprintf(stderr, "churn left %d keys instead of %d\n", table->count, keyCount);
+        exit(EXIT_FAILURE);
+    }
+
+    return now() - start;
+}
+
+int main(int argc, const char* argv[])
+{
+    Table table;
+    double best[5] = { 0 }, elapsed;
+    int rounds, round, i, phase;
+
+    keyCount = argc > 1 ? atoi(argv[1]) : 200000;
+    rounds = argc > 2 ? atoi(argv[2]) : 5;
+    names = malloc(sizeof(*names) * keyCount);
+    keys = malloc(sizeof(VmString*) * keyCount);
+    if (keyCount <= 0 || rounds <= 0 || names == NULL || keys == NULL) {
+        fprintf(stderr, "usage: %s [keys] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < keyCount; i++) {
+        sprintf(names[i], "key_%d", i);
+    }
+
+    for (round = 0; round < rounds; round++) {
+        vm_init(NULL);
+        // The keys are only referenced from C, so no collection may run.
+        vm.nextGC = (size_t)-1;
+
+        for (phase = 0; phase < 5; phase++) {
+            switch (phase) {
+            case 0:
+                elapsed = bench_intern_miss_insert();
+                break;
+            case 1:
+                elapsed = bench_intern_hit();
+                break;
+            case 2:
+                elapsed = bench_find_miss();
+                break;
+            case 3:
+                table_init(&table);
+                elapsed = bench_set_get(&table);
+                break;
+            default:
+                elapsed = bench_churn(&table);
+                table_free(&table);
+                break;
+            }
+            if (round == 0 || elapsed < best[phase]) {
+                best[phase] = elapsed;
+            }
+        }
+
+        vm_free();
+    }
+
+    printf("%d keys, best of %d rounds\n", keyCount, rounds);
+    report("intern insert", best[0], keyCount);
+    report("intern hit", best[1], keyCount);
+    report("find miss", best[2], keyCount);
+    report("set + get", best[3], 2L * keyCount);
+    report("delete + reinsert", best[4], 4L * keyCount);
+
+    free(names);
+    free(keys);
+    return EXIT_SUCCESS;
+}
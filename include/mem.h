@@ -6,6 +6,9 @@
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity)*2)
 
+#define ALLOCATE(type, count) \
+    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+
 #define GROW_ARRAY(previous, type, oldCount, count) \
     (type*)reallocate(previous, sizeof(type) * (oldCount), sizeof(type) * (count))
 
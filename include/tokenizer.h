@@ -66,7 +66,7 @@ Tokenization toknzr(const char* code, int verbose);
 void toknzr_destroy(Tokenization toknz);
 
 #define IS_AT_END(x, codeLength) ((x) >= (codeLength))
-#define IS_ALPHA_NUMERIC(x) (isalpha((x)) || isdigit((x) || (x) == '_'))
+#define IS_ALPHA_NUMERIC(x) (isalpha((x)) || isdigit((x)) || (x) == '_')
 
 #define AND_KEY "and"
 #define CLASS_KEY "class"
@@ -0,0 +1,19 @@
+#ifndef CLOX_CACHE
+#define CLOX_CACHE
+
+#include "vm/common.h"
+#include "vm/value.h"
+#include <stddef.h>
+
+// Bump whenever the meaning of existing instructions or the file layout
+// changes. Adding or renaming opcodes invalidates caches on its own through
+// the opcode fingerprint stored next to the version.
+#define CACHE_VERSION 4
+#define CACHE_EXTENSION ".loxc"
+#define CACHE_DEPTH_MAX 128
+
+char* cache_path(const char* sourcePath);
+int cache_write(const char* path, VmFunction* function, const char* source, size_t length);
+VmFunction* cache_load(const char* path, const char* source, size_t length);
+
+#endif
@@ -31,9 +31,72 @@ typedef enum opcode {
     OP_SET_GLOBAL,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
-    OP_CALL
+    // An argument count and a 16-bit index into the function's call caches.
+    OP_CALL,
+    // A call whose result the caller returns. It has the operands of OP_CALL
+    // and is followed by OP_RETURN for callees that cannot reuse the frame.
+    OP_TAIL_CALL,
+    OP_CLOSURE,
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    OP_CLOSE_UPVALUE,
+    OP_CLASS,
+    OP_INHERIT,
+    OP_METHOD,
+    // Property access and invocation take a name constant and, except for
+    // super, a 16-bit index into the function's inline caches.
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_INVOKE,
+    OP_GET_SUPER,
+    OP_SUPER_INVOKE,
+    // Quickened variants. The VM rewrites a generic instruction in place once
+    // it has seen the operand types and rewrites it back when the guard fails.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    // Superinstructions. The compiler fuses the most frequent sequences found
+    // by the opcode profiler (see LOX_PROFILE_OPCODES) into one dispatch.
+    OP_GET_LOCAL2,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    OP_JUMP_IF_NOT_LESS,
+    // Joins the operand count values of a chain of + that has a string
+    // constant in it, see vmstring_concatenate_n().
+    OP_CONCAT_N,
+    // Register instructions, only produced by --register (see vm/register.h).
+    // The first operand is the destination slot, the others are slots, or a
+    // constant index for the _RK forms.
+    OP_MOVE,
+    OP_LOAD_CONSTANT,
+    OP_ADD_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RR,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RR,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RR,
+    OP_DIVIDE_RK,
+    // Two operands and a 16-bit forward offset, taken unless left < right.
+    OP_JUMP_IF_NOT_LESS_RR,
+    OP_JUMP_IF_NOT_LESS_RK
 } OpCode;
 
+// How OP_CLOSURE fills each capture. It is followed by one (mode, index)
+// byte pair per capture of the function in its constant operand.
+typedef enum capture_mode {
+    // Copies capture index of the enclosing closure.
+    CAPTURE_UPVALUE,
+    // Copies the value of local slot index, which is never assigned again.
+    CAPTURE_VALUE,
+    // Shares local slot index through a VmUpvalue.
+    CAPTURE_SHARED
+} CaptureMode;
+
 void chunk_init(Chunk* chunk);
 
 void chunk_write(Chunk* chunk, Byte value, int line);
@@ -42,4 +105,12 @@ void chunk_free(Chunk* chunk);
 
 int chunk_constants_add(Chunk* chunk, Value value);
 
+int chunk_instruction_length(Chunk* chunk, int offset);
+
+int chunk_jump_target(Chunk* chunk, int offset);
+
+int chunk_stack_depths(Chunk* chunk, int base, int* depths);
+
+int chunk_stack_size(Chunk* chunk, int base);
+
 #endif
@@ -16,4 +16,25 @@ typedef unsigned int Hash;
 #define DEBUG_EXECUTION_TRACE
 #endif
 
+#if defined(LOX_COMPUTED_GOTO) && defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef LOX_NAN_BOXING
+#define VALUE_NAN_BOXING
+#endif
+
+#if defined(LOX_TABLE_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TABLE_SSE2
+#endif
+
+#ifdef LOX_PROFILE_OPCODES
+#define VM_PROFILE_OPCODES
+#endif
+
+// The stencils are x86-64 System V code and assume one-word NaN-boxed values.
+#if defined(LOX_JIT) && defined(VALUE_NAN_BOXING) && defined(__x86_64__) && defined(__linux__)
+#define VM_JIT
+#endif
+
 #endif
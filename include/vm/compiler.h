@@ -5,10 +5,23 @@
 #include "vm/value.h"
 
 VmFunction* compile(const char* code);
+void compiler_mark_roots();
 
-VmString* vmstring_take(char* chars, size_t length);
+#define ALLOC_OBJECT(type, objectType) ((type*)new_vmobject(sizeof(type), (objectType)))
+
+VmObject* new_vmobject(size_t size, VmObjectType type);
+VmString* vmstring_alloc(size_t length);
+VmString* vmstring_take(VmString* string);
+VmString* vmstring_loose(VmString* string);
+VmString* vmstring_intern(VmString* string);
 VmString* vmstring_copy(const char* chars, size_t length);
+VmString* vmrope_new(VmString* left, VmString* right);
+VmString* vmstring_flatten(VmString* string);
+int vmstring_equal(VmString* a, VmString* b);
 VmFunction* vmfunction_new();
+void vmfunction_caches_alloc(VmFunction* function, int count, int callCount);
 VmNative* vmnative_new(NativeFn function);
+VmClosure* vmclosure_new(VmFunction* function);
+VmUpvalue* vmupvalue_new(Value* slot);
 
 #endif
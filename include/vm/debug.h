@@ -5,5 +5,6 @@
 
 void chunk_disassemble(Chunk* chunk, const char* name);
 int chunk_disassemble_instruction(Chunk* chunk, int offset);
+const char* opcode_name(Byte instruction);
 
 #endif
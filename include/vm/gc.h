@@ -0,0 +1,27 @@
+#ifndef CLOX_GC
+#define CLOX_GC
+
+#include "vm/common.h"
+#include "vm/value.h"
+#include <stddef.h>
+#include <stdio.h>
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+typedef struct gc_stats {
+    int collections;
+    size_t bytesFreed;
+    size_t peakBytes;
+    double totalPause;
+    double maxPause;
+    double startTime;
+} GcStats;
+
+void gc_account(size_t oldSize, size_t newSize);
+void gc_collect();
+void gc_mark_object(VmObject* object);
+void gc_mark_value(Value value);
+void gc_stats_print(FILE* stream);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CLOX_JIT
+#define CLOX_JIT
+
+#include "vm/common.h"
+#include "vm/value.h"
+#include <stddef.h>
+
+// Calls and loop iterations a function runs in the interpreter before --jit
+// compiles it.
+#define JIT_THRESHOLD 1000
+
+// What a runtime helper returns to generated code, and what generated code
+// returns to vm_run when it gives control back.
+typedef enum jit_status {
+    // Carry on with the next instruction; never returned to vm_run.
+    JIT_NEXT,
+    // The frame on top changed: a call pushed or reused one, or a return
+    // popped one.
+    JIT_FRAME,
+    // The script's frame returned.
+    JIT_DONE,
+    // A runtime error has been reported.
+    JIT_ERROR
+} JitStatus;
+
+struct call_frame;
+
+// Runs an instruction, or the slow path of one, for generated code. ip is the
+// instruction's address in the chunk.
+typedef int (*JitHelper)(struct call_frame* frame, Byte* ip);
+
+// Indexed by opcode, defined by the VM. Generated code calls out to these for
+// everything it does not do inline; a function using an opcode without a
+// helper stays in the interpreter.
+extern const JitHelper jitHelpers[BYTE_COUNT];
+
+int jit_compile(VmFunction* function);
+JitStatus jit_run(struct call_frame* frame);
+void jit_free(VmFunction* function);
+// Returns executable pages holding a copy of code, to be released with
+// munmap, or NULL when memory runs out.
+Byte* jit_install(const Byte* code, size_t size);
+
+#endif
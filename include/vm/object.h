@@ -0,0 +1,62 @@
+#ifndef CLOX_OBJECT
+#define CLOX_OBJECT
+
+#include "vm/table.h"
+#include "vm/value.h"
+
+typedef struct vm_class {
+    VmObject obj;
+    VmString* name;
+    // Methods are copied down from the superclass and never change once the
+    // class declaration has run, which is what lets inline caches keep them.
+    Table methods;
+    Value initializer;
+    // The shape of an instance without fields. Every shape descends from the
+    // root of exactly one class.
+    VmShape* shape;
+} VmClass;
+
+// A hidden class: the ordered field names shared by every instance that got
+// the same fields in the same order. Each shape adds one field to its parent
+// and lists the shapes that extend it.
+struct vm_shape {
+    VmObject obj;
+    VmClass* klass;
+    VmShape* parent;
+    VmString* key;
+    int fieldCount;
+    VmShape* children;
+    VmShape* sibling;
+};
+
+typedef struct vm_instance {
+    VmObject obj;
+    VmShape* shape;
+    // Dense field values, in the order of the shape's keys.
+    Value* fields;
+    int capacity;
+} VmInstance;
+
+typedef struct vm_bound_method {
+    VmObject obj;
+    Value receiver;
+    Value method;
+} VmBoundMethod;
+
+#define AS_CLASS(value) ((VmClass*)AS_OBJECT(value))
+#define AS_INSTANCE(value) ((VmInstance*)AS_OBJECT(value))
+#define AS_BOUND_METHOD(value) ((VmBoundMethod*)AS_OBJECT(value))
+
+#define IS_CLASS(value) (is_object_type(value, OBJECT_CLASS))
+#define IS_INSTANCE(value) (is_object_type(value, OBJECT_INSTANCE))
+#define IS_BOUND_METHOD(value) (is_object_type(value, OBJECT_BOUND_METHOD))
+
+VmClass* vmclass_new(VmString* name);
+VmInstance* vminstance_new(VmClass* klass);
+VmBoundMethod* vmboundmethod_new(Value receiver, Value method);
+
+int shape_field_index(VmShape* shape, VmString* key);
+VmShape* shape_transition(VmShape* shape, VmString* key);
+void instance_fields_reserve(VmInstance* instance, int count);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef CLOX_PEEPHOLE
+#define CLOX_PEEPHOLE
+
+#include "vm/common.h"
+#include "vm/value.h"
+
+// Rewrites a finished chunk: threads jumps through the jumps they land on,
+// drops code no jump or fall-through reaches, and drops values pushed only
+// to be popped. Jump offsets and lines are kept in step with the code.
+void peephole_optimize(Chunk* chunk);
+
+#endif
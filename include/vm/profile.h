@@ -0,0 +1,14 @@
+#ifndef CLOX_PROFILE
+#define CLOX_PROFILE
+
+#include "vm/common.h"
+#include <stdio.h>
+
+#define PROFILE_CAPACITY 16384
+#define PROFILE_SEQUENCE_MAX 3
+#define PROFILE_REPORT_TOP 10
+
+void profile_instruction(Byte instruction);
+int profile_dump(const char* path, FILE* report);
+
+#endif
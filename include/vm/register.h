@@ -0,0 +1,11 @@
+#ifndef CLOX_REGISTER
+#define CLOX_REGISTER
+
+#include "vm/value.h"
+
+// Rewrites the stack instructions of function, and of the functions in its
+// constants, that only move numbers and strings between locals and
+// constants into three-address register instructions on frame slots.
+void register_translate(VmFunction* function);
+
+#endif
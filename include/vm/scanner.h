@@ -0,0 +1,32 @@
+#ifndef CLOX_SCANNER
+#define CLOX_SCANNER
+
+#include "tokenizer.h"
+
+#define SCANNER_LOOKAHEAD 2
+
+// A token of the bytecode compiler. It does not own its text: start points
+// into the source, or at a static message for TOKEN_ERROR.
+typedef struct scan_token {
+    TokenType type;
+    const char* start;
+    int length;
+    int line;
+} ScanToken;
+
+// Scans on demand. Tokens are produced when asked for and at most
+// SCANNER_LOOKAHEAD of them are buffered, so scanning needs no allocation.
+typedef struct scanner {
+    const char* start;
+    const char* current;
+    int line;
+    ScanToken buffered[SCANNER_LOOKAHEAD];
+    int head;
+    int count;
+} Scanner;
+
+void scanner_init(Scanner* scanner, const char* source);
+ScanToken scanner_next(Scanner* scanner);
+ScanToken* scanner_peek(Scanner* scanner, int distance);
+
+#endif
@@ -3,21 +3,38 @@
 
 #include "vm/common.h"
 #include "vm/value.h"
+#include <stdint.h>
 #include <stdio.h>
 
-#define TABLE_MAX_LOAD 0.75
+// Open addressing in the style of Swiss tables: every slot has a control
+// byte that is either EMPTY, DELETED or the low 7 bits of the key's hash.
+// Slots are probed a group of TABLE_GROUP_WIDTH control bytes at a time,
+// so that most misses and hits cost one group compare.
+#define TABLE_GROUP_WIDTH 16
+#define TABLE_MAX_LOAD 0.875
+
+#define TABLE_CONTROL_EMPTY 0x80
+#define TABLE_CONTROL_DELETED 0xfe
 
 typedef struct table_entry {
     VmString* key;
     Value value;
+    Hash hash;
 } Entry;
 
 typedef struct table {
     int count;
+    int tombstones;
+    // Zero or a power of two no smaller than TABLE_GROUP_WIDTH.
     int capacity;
+    Byte* control;
     Entry* entries;
 } Table;
 
+// Sets the seed of table_hash(); strings hashed under another seed must not
+// be looked up again.
+void table_hash_seed(uint64_t seed);
+Hash table_hash(const char* chars, size_t length);
 void table_init(Table* table);
 void table_free(Table* table);
 int table_set(Table* table, VmString* key, Value value);
@@ -25,5 +42,9 @@ void table_add_all(Table* from, Table* to);
 int table_get(Table* table, VmString* key, Value* value);
 int table_delete(Table* table, VmString* key);
 VmString* table_find_string(Table* table, const char* chars, size_t length, Hash hash);
+void table_mark(Table* table);
+void table_remove_white(Table* table);
+// Prints the load of table and how well its hashes spread over its groups.
+void table_stats_print(Table* table, const char* name, FILE* stream);
 
 #endif
@@ -0,0 +1,29 @@
+#ifndef CLOX_TRACE
+#define CLOX_TRACE
+
+#include "vm/common.h"
+#include "vm/value.h"
+#include <stdio.h>
+
+// Back edges to a loop header before --trace records a trace from it.
+#define TRACE_THRESHOLD 50
+
+typedef struct trace_stats {
+    int compiled;
+    // Recordings given up, and traces that could not be compiled.
+    int aborted;
+    // Every return from a trace is through a side exit.
+    long exits;
+    long iterations;
+} TraceStats;
+
+struct call_frame;
+
+// Called by the interpreter on a back edge to the frame's ip. Runs the
+// loop's trace, or records one once the loop is hot, and leaves the frame's
+// ip and vm.stackTop where the interpreter carries on.
+void trace_loop(struct call_frame* frame);
+void trace_free(VmFunction* function);
+void trace_stats_print(FILE* stream);
+
+#endif
@@ -3,32 +3,85 @@
 
 #include "vm/common.h"
 #include <stdio.h>
+#ifdef VALUE_NAN_BOXING
+#include <stdint.h>
+#endif
 
 typedef enum vm_object_type {
+    // The kinds of VmString; IS_STRING relies on them coming first.
     OBJECT_STRING,
+    // A string that is not interned yet, see vmstring_loose().
+    OBJECT_LOOSE_STRING,
+    OBJECT_ROPE,
     OBJECT_FUNCTION,
-    OBJECT_NATIVE
+    OBJECT_NATIVE,
+    OBJECT_CLOSURE,
+    OBJECT_UPVALUE,
+    OBJECT_CLASS,
+    OBJECT_INSTANCE,
+    OBJECT_BOUND_METHOD,
+    OBJECT_SHAPE
 } VmObjectType;
 
 typedef unsigned char VmBoolean;
 typedef double VmNumber;
 typedef struct vm_object {
     VmObjectType type;
+    Byte isMarked;
     struct vm_object* next;
 } VmObject;
 
+// A string and its characters are one allocation. The hash is only set once
+// the string is interned.
 typedef struct vm_string {
     VmObject object;
-    size_t length;
-    char* chars;
+    unsigned int length;
     Hash hash;
+    char chars[];
 } VmString;
 
+#define VMSTRING_SIZE(length) (sizeof(VmString) + (length) + 1)
+
+// The concatenation of left and right, copied into a string only when its
+// characters are needed. Once it is, left is that string and right
+// is NULL. It passes for a VmString until its characters are read.
+typedef struct vm_rope {
+    VmObject object;
+    unsigned int length;
+    Hash hash;
+    VmString* left;
+    VmString* right;
+} VmRope;
+
+// The longest a string or a rope may be.
+#define STRING_LENGTH_MAX UINT_MAX
+
+#ifdef VALUE_NAN_BOXING
+// A Value is one 64-bit word. Numbers are stored as plain doubles; every
+// other value hides in the payload of a quiet NaN. Objects additionally set
+// the sign bit and keep their (48-bit) pointer in the low bits, while nil and
+// the booleans are small tags in the low bits.
+typedef uint64_t Value;
+
+#define VALUE_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define VALUE_QNAN ((uint64_t)0x7ffc000000000000)
+
+#define VALUE_TAG_NIL 1
+#define VALUE_TAG_FALSE 2
+#define VALUE_TAG_TRUE 3
+#define VALUE_TAG_UNDEFINED 4
+
+#define VALUE_NIL ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_NIL))
+#define VALUE_FALSE ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_FALSE))
+#define VALUE_TRUE ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_TRUE))
+#define VALUE_UNDEFINED ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_UNDEFINED))
+#else
 typedef enum value_type {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJECT
+    VAL_OBJECT,
+    VAL_UNDEFINED
 } ValueType;
 
 typedef struct value {
@@ -39,6 +92,7 @@ typedef struct value {
         VmObject* object;
     } as;
 } Value;
+#endif
 
 typedef struct value_array {
     int count;
@@ -54,54 +108,230 @@ typedef struct chunk {
     int* lines;
 } Chunk;
 
+typedef struct vm_shape VmShape;
+
+#define INLINE_CACHE_ENTRIES 4
+
+// What a property instruction found for instances of one shape: the field
+// at index, or the method when index is -1. For a store, transition is the
+// shape after the field is added, or shape itself when it already exists.
+typedef struct inline_cache_entry {
+    VmShape* shape;
+    VmShape* transition;
+    int index;
+    Value method;
+} InlineCacheEntry;
+
+// Up to INLINE_CACHE_ENTRIES shapes per instruction. A full cache is
+// megamorphic and further shapes take the lookup path every time.
+typedef struct inline_cache {
+    int count;
+    InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
+typedef Value (*NativeFn)(int argCount, Value* args);
+
+// The callee an OP_CALL site saw last, with what calling it takes: the
+// function and closure of a frame, or native when function is NULL. A site
+// always passes the same number of arguments, so a callee that passed the
+// arity check once passes it every time.
+typedef struct call_cache {
+    VmObject* callee;
+    struct vm_function* function;
+    struct vm_closure* closure;
+    NativeFn native;
+} CallCache;
+
+// Machine code for a function, see jit.c.
+typedef struct jit_code JitCode;
+// A loop header --trace has seen, see trace.c.
+typedef struct trace_loop TraceLoop;
+
 typedef struct vm_function {
     VmObject obj;
     int arity;
+    int upvalueCount;
+    // The most values a frame of the function holds, see chunk_stack_size.
+    int maxStack;
     Chunk chunk;
     VmString* name;
+    // One cache per property access or invocation in the chunk, indexed by
+    // the instruction's cache operand.
+    InlineCache* caches;
+    int cacheCount;
+    // One cache per OP_CALL in the chunk.
+    CallCache* callCaches;
+    int callCacheCount;
+    // Calls and loop iterations left before the function is compiled, 0 once
+    // it has been or when it never will be.
+    int jitCountdown;
+    JitCode* jit;
+    TraceLoop* loops;
+    // Loops --trace has not given up on, -1 until it first sees one.
+    int traceableLoops;
 } VmFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// A captured variable that is assigned after its capture. It points at the
+// stack slot while the variable is in scope and at closed once it is not.
+typedef struct vm_upvalue {
+    VmObject obj;
+    Value* location;
+    Value closed;
+    struct vm_upvalue* next;
+} VmUpvalue;
+
+// Closures are flat: every capture is copied into the closure when it is
+// created. A capture holds the variable's value, or its VmUpvalue when the
+// variable is shared with the enclosing function or other closures.
+typedef struct vm_closure {
+    VmObject obj;
+    VmFunction* function;
+    Value* captures;
+    int captureCount;
+} VmClosure;
 
 typedef struct vm_native {
     VmObject obj;
     NativeFn function;
 } VmNative;
 
+#ifdef VALUE_NAN_BOXING
+#define AS_BOOL(value) ((value) == VALUE_TRUE)
+#define AS_NUMBER(value) value_as_number(value)
+#define AS_OBJECT(value) ((VmObject*)(uintptr_t)((value) & ~(VALUE_SIGN_BIT | VALUE_QNAN)))
+#else
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJECT(value) ((value).as.object)
+#endif
 #define AS_STRING(value) ((VmString*)AS_OBJECT(value))
 #define AS_CSTRING(value) (AS_STRING(value)->chars)
 #define AS_FUNCTION(value) ((VmFunction*)AS_OBJECT(value))
 #define AS_NATIVE(value) (((VmNative*)AS_OBJECT(value))->function)
+#define AS_CLOSURE(value) ((VmClosure*)AS_OBJECT(value))
+#define AS_UPVALUE(value) ((VmUpvalue*)AS_OBJECT(value))
 
+#ifdef VALUE_NAN_BOXING
+#define IS_BOOL(value) (((value) | 1) == VALUE_TRUE)
+#define IS_NIL(value) ((value) == VALUE_NIL)
+#define IS_NUMBER(value) (((value)&VALUE_QNAN) != VALUE_QNAN)
+#define IS_OBJECT(value) (((value) & (VALUE_QNAN | VALUE_SIGN_BIT)) == (VALUE_QNAN | VALUE_SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == VALUE_UNDEFINED)
+#else
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#endif
 
 #define OBJECT_TYPE(value) (AS_OBJECT(value)->type)
-#define IS_STRING(value) (is_object_type(value, OBJECT_STRING))
+#define IS_STRING(value) (IS_OBJECT(value) && AS_OBJECT(value)->type <= OBJECT_ROPE)
 #define IS_FUNCTION(value) (is_object_type(value, OBJECT_FUNCTION))
-#define IS_NATIVE(value) (is_object_type(value, OBJ_NATIVE))
+#define IS_NATIVE(value) (is_object_type(value, OBJECT_NATIVE))
+#define IS_CLOSURE(value) (is_object_type(value, OBJECT_CLOSURE))
+#define IS_UPVALUE(value) (is_object_type(value, OBJECT_UPVALUE))
 
-static int is_object_type(Value value, VmObjectType type)
+static inline int is_object_type(Value value, VmObjectType type)
 {
     return IS_OBJECT(value) && (AS_OBJECT(value))->type == type;
 }
 
+// The constructors live here rather than in value.c so that the hot paths in
+// the VM get them inlined in either representation.
+#ifdef VALUE_NAN_BOXING
+static inline VmNumber value_as_number(Value value)
+{
+    union {
+        Value bits;
+        VmNumber number;
+    } pun;
+    pun.bits = value;
+    return pun.number;
+}
+
+static inline Value bool_val(VmBoolean boolean)
+{
+    return boolean ? VALUE_TRUE : VALUE_FALSE;
+}
+
+static inline Value nil_val()
+{
+    return VALUE_NIL;
+}
+
+// Marks a global slot that has been named by the compiler but not defined.
+// It never escapes into user-visible values.
+static inline Value undefined_val()
+{
+    return VALUE_UNDEFINED;
+}
+
+static inline Value number_val(VmNumber number)
+{
+    union {
+        Value bits;
+        VmNumber number;
+    } pun;
+    pun.number = number;
+    return pun.bits;
+}
+
+static inline Value object_val(VmObject* object)
+{
+    return (Value)(VALUE_SIGN_BIT | VALUE_QNAN | (uint64_t)(uintptr_t)object);
+}
+#else
+static inline Value bool_val(VmBoolean boolean)
+{
+    Value v;
+    v.type = VAL_BOOL;
+    v.as.boolean = boolean;
+    return v;
+}
+
+static inline Value nil_val()
+{
+    Value v;
+    v.type = VAL_NIL;
+    v.as.number = 0;
+    return v;
+}
+
+// Marks a global slot that has been named by the compiler but not defined.
+// It never escapes into user-visible values.
+static inline Value undefined_val()
+{
+    Value v;
+    v.type = VAL_UNDEFINED;
+    v.as.number = 0;
+    return v;
+}
+
+static inline Value number_val(VmNumber number)
+{
+    Value v;
+    v.type = VAL_NUMBER;
+    v.as.number = number;
+    return v;
+}
+
+static inline Value object_val(VmObject* object)
+{
+    Value v;
+    v.type = VAL_OBJECT;
+    v.as.object = object;
+    return v;
+}
+#endif
+
 void value_array_init(ValueArray* array);
 void value_array_write(ValueArray* array, Value value);
 void value_array_free(ValueArray* array);
 void value_print(Value value);
 int values_equal(Value a, Value b);
 
-Value bool_val(VmBoolean boolean);
-Value nil_val();
-Value number_val(VmNumber number);
-Value object_val(VmObject* object);
-
+void object_free(VmObject* object);
 void objects_free();
 
 #endif
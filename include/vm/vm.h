@@ -2,28 +2,96 @@
 #define CLOX_VM
 
 #include "vm/chunk.h"
+#include "vm/gc.h"
 #include "vm/table.h"
+#include "vm/trace.h"
 #include "vm/value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * BYTE_COUNT)
+#define GLOBALS_MAX (SHORT_MAX + 1)
+// The stack and the frame array start small and double on calls that need
+// more, up to limits that --max-stack and --max-frames change.
+#define FRAMES_INITIAL 64
+#define FRAMES_MAX_DEFAULT 100000
+#define STACK_INITIAL 1024
+#define STACK_MAX_DEFAULT 1000000
+// Room above a frame's values for what the runtime pushes to keep objects
+// rooted while it allocates.
+#define STACK_SLACK 8
 
 typedef struct call_frame {
     VmFunction* function;
+    // NULL when the function captures nothing and is called directly.
+    VmClosure* closure;
     Byte* ip;
     Value* slots;
 } CallFrame;
 
 typedef struct vm {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    int maxFrames;
+    Value* stack;
     Value* stackTop;
+    // In values. The capacities never exceed the limits, even when more was
+    // allocated up front.
+    int stackCapacity;
+    int maxStack;
     Table strings;
+    // Globals live in slots assigned by the compiler. The table maps a name to
+    // its slot index, the arrays hold each slot's value and name.
     Table globals;
+    ValueArray globalValues;
+    ValueArray globalNames;
+    // Upvalues still pointing into the stack, sorted by slot, highest first.
+    VmUpvalue* openUpvalues;
+    // Interned "init", the name that makes a method a class initializer.
+    VmString* initString;
     VmObject* objects;
+    size_t bytesAllocated;
+    size_t nextGC;
+    size_t maxHeap;
+    int grayCount;
+    int grayCapacity;
+    VmObject** grayStack;
+    GcStats gcStats;
+    int printGcStats;
+    const char* opcodeProfile;
+    int bytecodeCache;
+    // What new functions' jitCountdown starts at, 0 without --jit.
+    int jitThreshold;
+    // Back edges before a loop is traced, 0 without --trace.
+    int traceThreshold;
+    TraceStats traceStats;
+    int printTraceStats;
+    int registerMode;
+    int dumpPeephole;
+    int printStringStats;
 } VM;
 
+typedef struct vm_config {
+    size_t maxHeap;
+    size_t maxStack;
+    size_t maxFrames;
+    int gcStats;
+    const char* opcodeProfile;
+    int noBytecodeCache;
+    // Compiles functions to machine code after this many calls and loop
+    // iterations; 0 keeps everything in the interpreter.
+    int jitThreshold;
+    // Records and compiles a trace of a loop after this many back edges to
+    // its header; 0 never does.
+    int traceThreshold;
+    int traceStats;
+    // Translates functions to register instructions before they first run.
+    int registerMode;
+    // Disassembles every function before and after the peephole pass.
+    int dumpPeephole;
+    // Seeds the string hash differently on every run instead of with 0.
+    int randomHashSeed;
+    int stringStats;
+} VmConfig;
+
 extern VM vm;
 
 typedef enum vm_interpret_result {
@@ -32,8 +100,13 @@ typedef enum vm_interpret_result {
     INTERPRET_RUNTIME_ERROR
 } VmInterpretResult;
 
-void vm_init();
+void vm_init(const VmConfig* config);
 void vm_free();
 VmInterpretResult vm_interpret(const char* code);
+VmInterpretResult vm_interpret_file(const char* path, const char* code);
+VmInterpretResult vm_compile_file(const char* path, const char* code);
+int vm_global_slot(VmString* name);
+void vm_stack_push(Value value);
+Value vm_stack_pop();
 
 #endif
@@ -4,11 +4,17 @@
 #include "mem.h"
 #include "vm/chunk.h"
 #include "vm/debug.h"
+#include "vm/jit.h"
+#include "vm/trace.h"
 #include "vm/vm.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef VM_JIT
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 typedef struct argvalues {
     int treewalk;
@@ -16,6 +22,21 @@ typedef struct argvalues {
     char* filename;
     int help;
     int error;
+    int gcStats;
+    size_t maxHeap;
+    size_t maxStack;
+    size_t maxFrames;
+    const char* opcodeProfile;
+    int compile;
+    int noCache;
+    int jit;
+    int jitDiff;
+    int trace;
+    int traceStats;
+    int registers;
+    int dumpPeephole;
+    int randomHashSeed;
+    int stringStats;
 } ArgValues;
 
 typedef enum {
@@ -37,43 +58,99 @@ void run_treewalk_chunk(const char* code);
 void run_treewalk_file(const char* code);
 void run_vm_chunk(const char* code);
 void run_vm_file(const char* code);
+void compile_vm_file(const char* code);
+void diff_vm_file(const char* code);
 void vm_chunk_test();
 
+static VmConfig vmConfig;
+static const char* scriptPath;
+
+static int size_parse(const char* text, size_t* size)
+{
+    char* end = NULL;
+    unsigned long value = strtoul(text, &end, 10);
+
+    if (end == text) {
+        return 0;
+    }
+
+    switch (*end) {
+    case 'k':
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        value *= 1024 * 1024;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        value *= 1024 * 1024 * 1024;
+        end++;
+        break;
+    }
+
+    *size = (size_t)value;
+    return *end == 0;
+}
+
 ArgValues argparse(int argc, const char* argv[])
 {
     ArgValues values;
+    int i;
     memset(&values, 0, sizeof(struct argvalues));
     values.treewalk = 0;
-    if (argc > 3) {
-        values.error = 1;
-    } else if (argc == 3) {
-        values.repl = 0;
-        values.filename = (char*)argv[2];
-        if (strncmp(argv[1], "--tree-walk", 12) == 0) {
+    values.repl = 1;
+    for (i = 1; i < argc && !values.error; i++) {
+        if (strncmp(argv[i], "--tree-walk", 12) == 0) {
             values.treewalk = 1;
-        } else if (strncmp(argv[1], "--vm", 5) == 0) {
+        } else if (strncmp(argv[i], "--vm", 5) == 0) {
             values.treewalk = 0;
-        } else if (strncmp(argv[1], "--help", 7) == 0) {
+        } else if (strncmp(argv[i], "--help", 7) == 0) {
             values.help = 1;
-        } else {
+        } else if (strncmp(argv[i], "--gc-stats", 11) == 0) {
+            values.gcStats = 1;
+        } else if (strncmp(argv[i], "--max-heap", 11) == 0) {
+            values.error = i + 1 == argc || !size_parse(argv[++i], &values.maxHeap);
+        } else if (strncmp(argv[i], "--max-stack", 12) == 0) {
+            values.error = i + 1 == argc || !size_parse(argv[++i], &values.maxStack) || values.maxStack == 0;
+        } else if (strncmp(argv[i], "--max-frames", 13) == 0) {
+            values.error = i + 1 == argc || !size_parse(argv[++i], &values.maxFrames) || values.maxFrames == 0;
+        } else if (strncmp(argv[i], "--compile", 10) == 0) {
+            values.compile = 1;
+        } else if (strncmp(argv[i], "--no-cache", 11) == 0) {
+            values.noCache = 1;
+        } else if (strncmp(argv[i], "--jit", 6) == 0) {
+            values.jit = 1;
+        } else if (strncmp(argv[i], "--jit-diff", 11) == 0) {
+            values.jitDiff = 1;
+        } else if (strncmp(argv[i], "--trace", 8) == 0) {
+            values.trace = 1;
+        } else if (strncmp(argv[i], "--trace-stats", 14) == 0) {
+            values.traceStats = 1;
+        } else if (strncmp(argv[i], "--register", 11) == 0) {
+            values.registers = 1;
+        } else if (strncmp(argv[i], "--dump-peephole", 16) == 0) {
+            values.dumpPeephole = 1;
+        } else if (strncmp(argv[i], "--random-hash-seed", 19) == 0) {
+            values.randomHashSeed = 1;
+        } else if (strncmp(argv[i], "--string-stats", 15) == 0) {
+            values.stringStats = 1;
+        } else if (strncmp(argv[i], "--profile-opcodes", 18) == 0) {
+            values.error = i + 1 == argc;
+            values.opcodeProfile = values.error ? NULL : argv[++i];
+        } else if (strncmp(argv[i], "--", 2) == 0 || values.filename != NULL) {
             values.error = 1;
-        }
-    } else {
-        values.repl = 1;
-        if (argc == 2) {
-            if (strncmp(argv[1], "--tree-walk", 12) == 0) {
-                values.treewalk = 1;
-            } else if (strncmp(argv[1], "--vm", 5) == 0) {
-                values.treewalk = 0;
-            } else if (strncmp(argv[1], "--help", 7) == 0) {
-                values.help = 1;
-            } else {
-                values.repl = 0;
-                values.filename = (char*)argv[1];
-            }
+        } else {
+            values.repl = 0;
+            values.filename = (char*)argv[i];
         }
     }
 
+    values.error = values.error || ((values.compile || values.jitDiff) && (values.treewalk || values.filename == NULL));
+    values.error = values.error || (values.compile && values.jitDiff);
     return values;
 }
 
@@ -102,6 +179,20 @@ int main(int argc, const char* argv[])
     }
 
     header(name);
+    vmConfig.maxHeap = values.maxHeap;
+    vmConfig.maxStack = values.maxStack;
+    vmConfig.maxFrames = values.maxFrames;
+    vmConfig.gcStats = values.gcStats;
+    vmConfig.opcodeProfile = values.opcodeProfile;
+    vmConfig.noBytecodeCache = values.noCache || values.dumpPeephole;
+    vmConfig.jitThreshold = values.jit ? JIT_THRESHOLD : 0;
+    vmConfig.traceThreshold = values.trace ? TRACE_THRESHOLD : 0;
+    vmConfig.traceStats = values.traceStats;
+    vmConfig.registerMode = values.registers;
+    vmConfig.dumpPeephole = values.dumpPeephole;
+    vmConfig.randomHashSeed = values.randomHashSeed;
+    vmConfig.stringStats = values.stringStats;
+    scriptPath = values.filename;
     mode.mode = values.treewalk ? MODE_TREEWALK : MODE_VM;
     if (values.repl) {
         mode.codeRunner = values.treewalk ? run_treewalk_chunk : run_vm_chunk;
@@ -110,7 +201,7 @@ int main(int argc, const char* argv[])
         case MODE_TREEWALK:
             break;
         case MODE_VM:
-            vm_init();
+            vm_init(&vmConfig);
         }
 
         printf("Type 'exit()' to exit\n");
@@ -132,7 +223,10 @@ int main(int argc, const char* argv[])
             fprintf(stderr, "%s\n", strerror(errno));
             exit(74);
         } else {
-            mode.codeRunner = values.treewalk ? run_treewalk_file : run_vm_file;
+            mode.codeRunner = values.treewalk ? run_treewalk_file
+                : values.compile              ? compile_vm_file
+                : values.jitDiff              ? diff_vm_file
+                                              : run_vm_file;
             mode.codeRunner(buf);
         }
         fr(buf);
@@ -147,6 +241,30 @@ void usage(char* name)
     printf("    --tree-walk    runs clox in tree walk mode\n");
     printf("    --vm           runs clox in bytecode mode (default)\n");
     printf("    --help         shows this help text\n");
+    printf("    --gc-stats     prints garbage collector statistics on exit (bytecode mode)\n");
+    printf("    --max-heap N   caps the VM heap at N bytes, accepts k/m/g suffixes (bytecode mode)\n");
+    printf("    --max-stack N  caps the VM value stack at N values, accepts k/m suffixes (bytecode mode)\n");
+    printf("    --max-frames N caps the VM call depth at N frames, accepts k/m suffixes (bytecode mode)\n");
+    printf("    --compile      compiles <filename> to a .loxc bytecode cache next to it without running it\n");
+    printf("    --no-cache     neither reads nor writes the .loxc bytecode cache (bytecode mode)\n");
+    printf("    --jit          compiles functions that run often to x86-64 machine code (bytecode mode)\n");
+    printf("    --jit-diff     runs <filename> in the interpreter, under the JIT and with traces, compiling as\n");
+    printf("                   early as possible, and reports where their output first differs\n");
+    printf("    --trace        records and compiles traces of hot numeric loops to x86-64 machine code\n");
+    printf("                   (bytecode mode)\n");
+    printf("    --trace-stats  prints how many traces were compiled, aborted and exited (bytecode mode)\n");
+    printf("    --register     runs register instructions on frame slots in place of the stack instructions\n");
+    printf("                   for arithmetic over locals and constants (bytecode mode)\n");
+    printf("    --dump-peephole\n");
+    printf("                   prints the bytecode of every function compiled before and after the peephole\n");
+    printf("                   pass (bytecode mode, skips the .loxc cache)\n");
+    printf("    --random-hash-seed\n");
+    printf("                   seeds the string hash differently on every run (bytecode mode)\n");
+    printf("    --string-stats prints the size and hash collisions of the string intern table on exit\n");
+    printf("                   (bytecode mode)\n");
+    printf("    --profile-opcodes FILE\n");
+    printf("                   merges executed opcode sequence counts into FILE and prints the most frequent\n");
+    printf("                   (bytecode mode, needs a LOX_PROFILE_OPCODES build)\n");
 }
 
 void header(char* name)
@@ -228,8 +346,8 @@ void run_vm_file(const char* code)
 {
     VmInterpretResult result;
 
-    vm_init();
-    result = vm_interpret(code);
+    vm_init(&vmConfig);
+    result = vm_interpret_file(scriptPath, code);
     vm_free();
 
     if (result == INTERPRET_COMPILE_ERROR) {
@@ -242,3 +360,144 @@ void run_vm_file(const char* code)
 
     getchar();
 }
+
+void compile_vm_file(const char* code)
+{
+    VmInterpretResult result;
+
+    vm_init(&vmConfig);
+    result = vm_compile_file(scriptPath, code);
+    vm_free();
+
+    if (result == INTERPRET_COMPILE_ERROR) {
+        exit(65);
+    }
+
+    if (result == INTERPRET_RUNTIME_ERROR) {
+        exit(74);
+    }
+}
+
+#ifdef VM_JIT
+// Runs the script in a child process with its output and errors sent to a
+// temporary file, which is returned rewound.
+static FILE* run_vm_child(const char* code, int jitThreshold, int traceThreshold, int* status)
+{
+    FILE* output = tmpfile();
+    VmInterpretResult result;
+    pid_t pid;
+
+    if (output == NULL) {
+        return NULL;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        dup2(fileno(output), STDOUT_FILENO);
+        dup2(fileno(output), STDERR_FILENO);
+        vmConfig.jitThreshold = jitThreshold;
+        vmConfig.traceThreshold = traceThreshold;
+        vmConfig.traceStats = 0;
+        vmConfig.stringStats = 0;
+        vm_init(&vmConfig);
+        result = vm_interpret_file(scriptPath, code);
+        vm_free();
+        fflush(stdout);
+        _exit(result == INTERPRET_COMPILE_ERROR ? 65 : result == INTERPRET_RUNTIME_ERROR ? 70 : 0);
+    }
+
+    if (pid < 0 || waitpid(pid, status, 0) != pid) {
+        fclose(output);
+        return NULL;
+    }
+
+    rewind(output);
+    return output;
+}
+
+static void diff_line_print(const char* label, const char* line)
+{
+    if (line == NULL) {
+        printf("    %s<end of output>\n", label);
+    } else {
+        printf("    %s%s%s", label, line, strchr(line, '\n') != NULL ? "" : "\n");
+    }
+}
+
+static void diff_status_print(const char* label, int status)
+{
+    if (WIFSIGNALED(status)) {
+        printf("    %skilled by signal %d\n", label, WTERMSIG(status));
+    } else {
+        printf("    %sexit code %d\n", label, WEXITSTATUS(status));
+    }
+}
+
+// Compares what a compiler tier printed, errors included, and how it exited
+// with what the interpreter did. Closes output.
+static int diff_outputs(const char* tier, const char* label, FILE* interpreter, int interpreterStatus, FILE* output, int status)
+{
+    char expected[LINEBUFSIZE], actual[LINEBUFSIZE];
+    char *expectedLine = NULL, *actualLine = NULL;
+    int line = 1;
+
+    rewind(interpreter);
+    for (;;) {
+        expectedLine = fgets(expected, LINEBUFSIZE, interpreter);
+        actualLine = fgets(actual, LINEBUFSIZE, output);
+        if (expectedLine == NULL || actualLine == NULL || strcmp(expected, actual) != 0) {
+            break;
+        }
+        line += strchr(expected, '\n') != NULL;
+    }
+
+    fclose(output);
+    if (expectedLine != NULL || actualLine != NULL) {
+        printf("%s output differs from the interpreter at line %d:\n", tier, line);
+        diff_line_print("interpreter: ", expectedLine);
+        diff_line_print(label, actualLine);
+        return 0;
+    }
+
+    if (interpreterStatus != status) {
+        printf("%s exits differently from the interpreter:\n", tier);
+        diff_status_print("interpreter: ", interpreterStatus);
+        diff_status_print(label, status);
+        return 0;
+    }
+
+    printf("%s matches the interpreter over %d lines of output\n", tier, line - 1);
+    return 1;
+}
+
+// Runs the script in the interpreter, again with every function compiled on
+// its first call or loop iteration, and again with every loop traced on its
+// first back edge.
+void diff_vm_file(const char* code)
+{
+    int interpreterStatus = 0, jitStatus = 0, traceStatus = 0, same;
+    FILE* interpreter = run_vm_child(code, 0, 0, &interpreterStatus);
+    FILE* jit = interpreter != NULL ? run_vm_child(code, 1, 0, &jitStatus) : NULL;
+    FILE* trace = jit != NULL ? run_vm_child(code, 0, 1, &traceStatus) : NULL;
+
+    if (trace == NULL) {
+        fprintf(stderr, "Cannot run %s three times to compare\n", scriptPath);
+        exit(74);
+    }
+
+    same = diff_outputs("JIT", "jit:         ", interpreter, interpreterStatus, jit, jitStatus);
+    same = diff_outputs("Tracing", "tracing:     ", interpreter, interpreterStatus, trace, traceStatus) && same;
+    fclose(interpreter);
+    if (!same) {
+        exit(EXIT_FAILURE);
+    }
+}
+#else
+void diff_vm_file(const char* code)
+{
+    fprintf(stderr, "No JIT to compare: built without LOX_JIT, or not for x86-64 Linux with LOX_NAN_BOXING.\n");
+    exit(EXIT_FAILURE);
+}
+#endif
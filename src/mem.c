@@ -1,3 +1,4 @@
+#include "vm/gc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +26,8 @@ void* clone(void* src, size_t size)
 
 void* reallocate(void* previous, size_t oldSize, size_t newSize)
 {
+    gc_account(oldSize, newSize);
+
     if (newSize == 0) {
         free(previous);
         return NULL;
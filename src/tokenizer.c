@@ -203,7 +203,7 @@ Tokenization toknzr(const char* code, int verbose)
             if (isdigit(c)) {
                 literal = read_number(code, length, &current);
                 tokn = token(TOKEN_NUMBER, literal, line, current, literal);
-            } else if (isalpha(c)) {
+            } else if (isalpha(c) || c == '_') {
                 literal = read_other(code, length, &current);
                 if (strcmp(literal, AND_KEY) == 0) {
                     tokn = token_simple(TOKEN_AND, line, current, (char*)AND_KEY);
@@ -0,0 +1,600 @@
+#include "vm/cache.h"
+#include "mem.h"
+#include "vm/compiler.h"
+#include "vm/debug.h"
+#include "vm/vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A .loxc file is a header followed by a payload:
+//
+//   "LOXC" version:u32 opcodes:u32 sourceLength:u64 sourceHash:u64 payloadHash:u64
+//   globalCount:u32 string*                  names of the global slots
+//   function                                 the script
+//
+// where a function is
+//
+//   arity:u32 upvalueCount:u32 cacheCount:u32 callCacheCount:u32 hasName:u8 [string]
+//   codeCount:u32 code
+//   lineRuns:u32 (line:u32 count:u32)* constantCount:u32 constant*
+//
+// and a constant is a tag byte followed by a double, a string or a nested
+// function. Integers are little-endian and strings are a u32 length plus
+// their bytes. Nothing refers to addresses, and global slot operands are
+// rewritten on load against the slots of the loading VM.
+
+#define CACHE_MAGIC "LOXC"
+#define CACHE_MAGIC_LENGTH 4
+#define CACHE_HEADER_LENGTH (CACHE_MAGIC_LENGTH + 4 + 4 + 8 + 8 + 8)
+
+typedef enum cache_tag {
+    CACHE_NIL,
+    CACHE_FALSE,
+    CACHE_TRUE,
+    CACHE_NUMBER,
+    CACHE_STRING,
+    CACHE_FUNCTION
+} CacheTag;
+
+typedef struct cache_buffer {
+    Byte* bytes;
+    size_t count;
+    size_t capacity;
+    int error;
+} CacheBuffer;
+
+typedef struct cache_reader {
+    const Byte* current;
+    const Byte* end;
+    int* slots;
+    int slotCount;
+    int depth;
+    int error;
+} CacheReader;
+
+static uint64_t hash_bytes(const Byte* bytes, size_t length)
+{
+    uint64_t hash = 14695981039346656037u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
+
+static uint32_t opcode_fingerprint()
+{
+    uint32_t fingerprint = 2166136261u;
+    const char* name;
+    int i;
+
+    for (i = 0; i < BYTE_COUNT; i++) {
+        name = opcode_name((Byte)i);
+        for (; name != NULL && *name != 0; name++) {
+            fingerprint ^= (Byte)*name;
+            fingerprint *= 16777619;
+        }
+        fingerprint ^= (uint32_t)i;
+        fingerprint *= 16777619;
+    }
+
+    return fingerprint;
+}
+
+char* cache_path(const char* sourcePath)
+{
+    size_t length = strlen(sourcePath);
+    size_t extension = strlen(CACHE_EXTENSION) - 1;
+    char* path = (char*)malloc(length + extension + 2);
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    memcpy(path, sourcePath, length + 1);
+    // script.lox gets script.loxc, anything else gets the extension appended.
+    if (length >= extension && memcmp(sourcePath + length - extension, CACHE_EXTENSION, extension) == 0) {
+        strcat(path, "c");
+    } else {
+        strcat(path, CACHE_EXTENSION);
+    }
+
+    return path;
+}
+
+static void buffer_write(CacheBuffer* buffer, const void* bytes, size_t count)
+{
+    size_t capacity = buffer->capacity;
+    Byte* grown = NULL;
+
+    if (buffer->error) {
+        return;
+    }
+
+    while (capacity < buffer->count + count) {
+        capacity = capacity < 256 ? 256 : capacity * 2;
+    }
+
+    if (capacity != buffer->capacity) {
+        // The buffer is plain I/O memory, kept off the VM heap so that
+        // serializing never triggers a collection.
+        grown = (Byte*)realloc(buffer->bytes, capacity);
+        if (grown == NULL) {
+            buffer->error = 1;
+            return;
+        }
+        buffer->bytes = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static void buffer_write_u8(CacheBuffer* buffer, Byte value)
+{
+    buffer_write(buffer, &value, 1);
+}
+
+static void buffer_write_u32(CacheBuffer* buffer, uint32_t value)
+{
+    Byte bytes[4];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        bytes[i] = (Byte)(value >> (8 * i));
+    }
+    buffer_write(buffer, bytes, 4);
+}
+
+static void buffer_write_u64(CacheBuffer* buffer, uint64_t value)
+{
+    buffer_write_u32(buffer, (uint32_t)value);
+    buffer_write_u32(buffer, (uint32_t)(value >> 32));
+}
+
+static void buffer_write_string(CacheBuffer* buffer, VmString* string)
+{
+    buffer_write_u32(buffer, (uint32_t)string->length);
+    buffer_write(buffer, string->chars, string->length);
+}
+
+static void buffer_write_function(CacheBuffer* buffer, VmFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Value constant;
+    uint64_t bits;
+    double number;
+    int i, runs, run;
+
+    buffer_write_u32(buffer, (uint32_t)function->arity);
+    buffer_write_u32(buffer, (uint32_t)function->upvalueCount);
+    buffer_write_u32(buffer, (uint32_t)function->cacheCount);
+    buffer_write_u32(buffer, (uint32_t)function->callCacheCount);
+    buffer_write_u8(buffer, function->name != NULL);
+    if (function->name != NULL) {
+        buffer_write_string(buffer, function->name);
+    }
+
+    buffer_write_u32(buffer, (uint32_t)chunk->count);
+    buffer_write(buffer, chunk->code, chunk->count);
+
+    for (i = 0, runs = 0; i < chunk->count; i++) {
+        runs += i == 0 || chunk->lines[i] != chunk->lines[i - 1];
+    }
+    buffer_write_u32(buffer, (uint32_t)runs);
+    for (i = 0; i < chunk->count; i += run) {
+        for (run = 1; i + run < chunk->count && chunk->lines[i + run] == chunk->lines[i]; run++) {
+        }
+        buffer_write_u32(buffer, (uint32_t)chunk->lines[i]);
+        buffer_write_u32(buffer, (uint32_t)run);
+    }
+
+    buffer_write_u32(buffer, (uint32_t)chunk->constants.count);
+    for (i = 0; i < chunk->constants.count; i++) {
+        constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant)) {
+            number = AS_NUMBER(constant);
+            memcpy(&bits, &number, sizeof(bits));
+            buffer_write_u8(buffer, CACHE_NUMBER);
+            buffer_write_u64(buffer, bits);
+        } else if (IS_STRING(constant)) {
+            buffer_write_u8(buffer, CACHE_STRING);
+            buffer_write_string(buffer, AS_STRING(constant));
+        } else if (IS_FUNCTION(constant)) {
+            buffer_write_u8(buffer, CACHE_FUNCTION);
+            buffer_write_function(buffer, AS_FUNCTION(constant));
+        } else if (IS_NIL(constant)) {
+            buffer_write_u8(buffer, CACHE_NIL);
+        } else if (IS_BOOL(constant)) {
+            buffer_write_u8(buffer, AS_BOOL(constant) ? CACHE_TRUE : CACHE_FALSE);
+        } else {
+            buffer->error = 1;
+        }
+    }
+}
+
+static int file_replace(const char* path, const Byte* bytes, size_t count)
+{
+    size_t length = strlen(path);
+    char* temporary = (char*)malloc(length + 5);
+    FILE* fp = NULL;
+    int written = 0;
+
+    if (temporary == NULL) {
+        return 0;
+    }
+
+    // Write a sibling file and rename it over the cache, so that concurrent
+    // runs of the same script never map a half-written file.
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", 5);
+    fp = fopen(temporary, "wb");
+    if (fp != NULL) {
+        written = fwrite(bytes, 1, count, fp) == count;
+        written = fclose(fp) == 0 && written;
+    }
+
+#ifdef _WIN32
+    if (written) {
+        remove(path);
+    }
+#endif
+    if (!written || rename(temporary, path) != 0) {
+        remove(temporary);
+        written = 0;
+    }
+
+    free(temporary);
+    return written;
+}
+
+int cache_write(const char* path, VmFunction* function, const char* source, size_t length)
+{
+    CacheBuffer buffer;
+    Byte header[CACHE_HEADER_LENGTH] = { 0 };
+    uint64_t payloadHash;
+    size_t end;
+    int i, written = 0;
+
+    memset(&buffer, 0, sizeof(CacheBuffer));
+    // Room for the header, filled in once the payload hash is known.
+    buffer_write(&buffer, header, CACHE_HEADER_LENGTH);
+
+    buffer_write_u32(&buffer, (uint32_t)vm.globalNames.count);
+    for (i = 0; i < vm.globalNames.count; i++) {
+        buffer_write_string(&buffer, AS_STRING(vm.globalNames.values[i]));
+    }
+    buffer_write_function(&buffer, function);
+
+    if (!buffer.error) {
+        payloadHash = hash_bytes(buffer.bytes + CACHE_HEADER_LENGTH, buffer.count - CACHE_HEADER_LENGTH);
+        end = buffer.count;
+        buffer.count = 0;
+        buffer_write(&buffer, CACHE_MAGIC, CACHE_MAGIC_LENGTH);
+        buffer_write_u32(&buffer, CACHE_VERSION);
+        buffer_write_u32(&buffer, opcode_fingerprint());
+        buffer_write_u64(&buffer, (uint64_t)length);
+        buffer_write_u64(&buffer, hash_bytes((const Byte*)source, length));
+        buffer_write_u64(&buffer, payloadHash);
+        buffer.count = end;
+        written = file_replace(path, buffer.bytes, buffer.count);
+    }
+
+    free(buffer.bytes);
+    return written;
+}
+
+static const Byte* reader_take(CacheReader* reader, size_t count)
+{
+    const Byte* bytes = reader->current;
+
+    if (reader->error || (size_t)(reader->end - reader->current) < count) {
+        reader->error = 1;
+        return NULL;
+    }
+
+    reader->current += count;
+    return bytes;
+}
+
+static Byte reader_u8(CacheReader* reader)
+{
+    const Byte* bytes = reader_take(reader, 1);
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+static uint32_t reader_u32(CacheReader* reader)
+{
+    const Byte* bytes = reader_take(reader, 4);
+    uint32_t value = 0;
+    int i;
+
+    for (i = 3; bytes != NULL && i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+
+    return value;
+}
+
+static uint64_t reader_u64(CacheReader* reader)
+{
+    uint64_t low = reader_u32(reader);
+    uint64_t high = reader_u32(reader);
+    return low | (high << 32);
+}
+
+static VmString* reader_string(CacheReader* reader)
+{
+    uint32_t length = reader_u32(reader);
+    const Byte* chars = reader_take(reader, length);
+
+    return chars != NULL ? vmstring_copy((const char*)chars, length) : NULL;
+}
+
+// Points global operands at the slots the loading VM assigned to their names.
+static void reader_relocate(CacheReader* reader, VmFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Byte instruction;
+    int offset, length, slot;
+
+    for (offset = 0; offset < chunk->count; offset += length) {
+        instruction = chunk->code[offset];
+        length = chunk_instruction_length(chunk, offset);
+        // Register instructions are only made from loaded code.
+        if (offset + length > chunk->count || instruction >= OP_MOVE) {
+            reader->error = 1;
+            return;
+        }
+
+        if (instruction == OP_CLOSURE
+            && (chunk->code[offset + 1] >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]))) {
+            reader->error = 1;
+            return;
+        }
+
+        if ((instruction == OP_GET_PROPERTY || instruction == OP_SET_PROPERTY || instruction == OP_INVOKE)
+            && ((chunk->code[offset + length - 2] << 8) | chunk->code[offset + length - 1]) >= function->cacheCount) {
+            reader->error = 1;
+            return;
+        }
+
+        if ((instruction == OP_CALL || instruction == OP_TAIL_CALL) && ((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]) >= function->callCacheCount) {
+            reader->error = 1;
+            return;
+        }
+
+        if (instruction != OP_DEFINE_GLOBAL && instruction != OP_GET_GLOBAL && instruction != OP_SET_GLOBAL) {
+            continue;
+        }
+
+        slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        if (slot >= reader->slotCount) {
+            reader->error = 1;
+            return;
+        }
+
+        slot = reader->slots[slot];
+        chunk->code[offset + 1] = (slot >> 8) & 0xff;
+        chunk->code[offset + 2] = slot & 0xff;
+    }
+}
+
+static VmFunction* reader_function(CacheReader* reader);
+
+static void reader_constant(CacheReader* reader, Chunk* chunk)
+{
+    VmFunction* function = NULL;
+    VmString* string = NULL;
+    uint64_t bits;
+    double number;
+
+    switch (reader_u8(reader)) {
+    case CACHE_NIL:
+        chunk_constants_add(chunk, nil_val());
+        break;
+    case CACHE_FALSE:
+        chunk_constants_add(chunk, bool_val(0));
+        break;
+    case CACHE_TRUE:
+        chunk_constants_add(chunk, bool_val(1));
+        break;
+    case CACHE_NUMBER:
+        bits = reader_u64(reader);
+        memcpy(&number, &bits, sizeof(number));
+        chunk_constants_add(chunk, number_val(number));
+        break;
+    case CACHE_STRING:
+        string = reader_string(reader);
+        if (string != NULL) {
+            chunk_constants_add(chunk, object_val((VmObject*)string));
+        }
+        break;
+    case CACHE_FUNCTION:
+        function = reader_function(reader);
+        if (function != NULL) {
+            chunk_constants_add(chunk, object_val((VmObject*)function));
+            vm_stack_pop();
+        }
+        break;
+    default:
+        reader->error = 1;
+    }
+}
+
+// Returns the function still pushed on the VM stack, where it stays rooted
+// while its caller allocates; the caller pops it.
+static VmFunction* reader_function(CacheReader* reader)
+{
+    VmFunction* function = NULL;
+    Chunk* chunk = NULL;
+    const Byte* code = NULL;
+    uint32_t count, callCount, runs, line, run, i, j, offset;
+
+    if (++reader->depth > CACHE_DEPTH_MAX) {
+        reader->error = 1;
+        return NULL;
+    }
+
+    function = vmfunction_new();
+    vm_stack_push(object_val((VmObject*)function));
+    chunk = &function->chunk;
+
+    function->arity = (int)reader_u32(reader);
+    function->upvalueCount = (int)reader_u32(reader);
+    count = reader_u32(reader);
+    callCount = reader_u32(reader);
+    if (function->upvalueCount > BYTE_COUNT || count > SHORT_MAX + 1 || callCount > SHORT_MAX + 1) {
+        reader->error = 1;
+    } else {
+        vmfunction_caches_alloc(function, (int)count, (int)callCount);
+    }
+    if (reader_u8(reader)) {
+        function->name = reader_string(reader);
+    }
+
+    count = reader_u32(reader);
+    code = reader_take(reader, count);
+    if (code != NULL && count > 0) {
+        chunk->code = ALLOCATE(Byte, count);
+        chunk->lines = ALLOCATE(int, count);
+        chunk->capacity = (int)count;
+        memcpy(chunk->code, code, count);
+        chunk->count = (int)count;
+    }
+
+    runs = reader_u32(reader);
+    for (i = 0, offset = 0; i < runs && !reader->error; i++) {
+        line = reader_u32(reader);
+        run = reader_u32(reader);
+        if (run > count - offset) {
+            reader->error = 1;
+            break;
+        }
+        for (j = 0; j < run; j++) {
+            chunk->lines[offset++] = (int)line;
+        }
+    }
+    reader->error |= offset != count;
+
+    count = reader_u32(reader);
+    for (i = 0; i < count && !reader->error; i++) {
+        reader_constant(reader, chunk);
+    }
+
+    if (!reader->error) {
+        reader_relocate(reader, function);
+    }
+
+    // Derived from the code rather than stored, so a cache cannot make the
+    // VM under-allocate a frame.
+    if (!reader->error) {
+        function->maxStack = chunk_stack_size(chunk, function->arity + 1);
+    }
+
+    reader->depth--;
+    return function;
+}
+
+static VmFunction* cache_parse(const Byte* bytes, size_t count, const char* source, size_t length)
+{
+    CacheReader reader;
+    VmFunction* function = NULL;
+    VmString* name = NULL;
+    uint64_t payloadHash;
+    uint32_t i;
+    Value* stackTop = vm.stackTop;
+
+    memset(&reader, 0, sizeof(CacheReader));
+    reader.current = bytes;
+    reader.end = bytes + count;
+
+    if (count < CACHE_HEADER_LENGTH || memcmp(reader_take(&reader, CACHE_MAGIC_LENGTH), CACHE_MAGIC, CACHE_MAGIC_LENGTH) != 0
+        || reader_u32(&reader) != CACHE_VERSION
+        || reader_u32(&reader) != opcode_fingerprint()
+        || reader_u64(&reader) != (uint64_t)length
+        || reader_u64(&reader) != hash_bytes((const Byte*)source, length)) {
+        return NULL;
+    }
+
+    payloadHash = reader_u64(&reader);
+    if (payloadHash != hash_bytes(reader.current, reader.end - reader.current)) {
+        return NULL;
+    }
+
+    reader.slotCount = (int)reader_u32(&reader);
+    if (reader.slotCount > GLOBALS_MAX) {
+        return NULL;
+    }
+
+    reader.slots = (int*)malloc(sizeof(int) * (reader.slotCount + 1));
+    for (i = 0; reader.slots != NULL && i < (uint32_t)reader.slotCount && !reader.error; i++) {
+        name = reader_string(&reader);
+        reader.slots[i] = name != NULL ? vm_global_slot(name) : -1;
+        reader.error |= reader.slots[i] == -1;
+    }
+
+    if (reader.slots != NULL && !reader.error) {
+        function = reader_function(&reader);
+    }
+
+    free(reader.slots);
+    vm.stackTop = stackTop;
+    return reader.error || reader.current != reader.end ? NULL : function;
+}
+
+VmFunction* cache_load(const char* path, const char* source, size_t length)
+{
+    VmFunction* function = NULL;
+#ifdef _WIN32
+    Byte* bytes = NULL;
+    long size = 0;
+    FILE* fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        bytes = (Byte*)malloc(size);
+        if (bytes != NULL && fread(bytes, 1, size, fp) == (size_t)size) {
+            function = cache_parse(bytes, size, source, length);
+        }
+        free(bytes);
+    }
+    fclose(fp);
+#else
+    struct stat status;
+    void* bytes = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+        bytes = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes != MAP_FAILED) {
+            function = cache_parse((const Byte*)bytes, status.st_size, source, length);
+            munmap(bytes, status.st_size);
+        }
+    }
+    close(fd);
+#endif
+
+    return function;
+}
@@ -1,5 +1,6 @@
 #include "vm/chunk.h"
 #include "vm/value.h"
+#include "vm/vm.h"
 
 void chunk_init(Chunk* chunk)
 {
@@ -33,6 +34,202 @@ void chunk_free(Chunk* chunk)
 
 int chunk_constants_add(Chunk* chunk, Value value)
 {
+    // Keep the value reachable while the constant array grows.
+    vm_stack_push(value);
     value_array_write(&chunk->constants, value);
+    vm_stack_pop();
     return chunk->constants.count - 1;
 }
+
+// Size in bytes of the instruction at offset including its operands.
+int chunk_instruction_length(Chunk* chunk, int offset)
+{
+    Value function;
+
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_CONCAT_N:
+        return 2;
+    case OP_CLOSURE:
+        if (offset + 1 >= chunk->count || chunk->code[offset + 1] >= chunk->constants.count) {
+            return 2;
+        }
+        function = chunk->constants.values[chunk->code[offset + 1]];
+        return IS_FUNCTION(function) ? 2 + 2 * AS_FUNCTION(function)->upvalueCount : 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_LOOP:
+    case OP_GET_LOCAL2:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_SUPER_INVOKE:
+    case OP_MOVE:
+    case OP_LOAD_CONSTANT:
+        return 3;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+        return 4;
+    case OP_INVOKE:
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+        return 5;
+    default:
+        return 1;
+    }
+}
+
+// Where the jump at offset lands, or -1 when the instruction is not a jump.
+int chunk_jump_target(Chunk* chunk, int offset)
+{
+    int length = chunk_instruction_length(chunk, offset);
+    int sign = 1;
+
+    switch (chunk->code[offset]) {
+    case OP_LOOP:
+        sign = -1;
+        break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+        break;
+    default:
+        return -1;
+    }
+
+    return offset + length + sign * ((chunk->code[offset + length - 2] << 8) | chunk->code[offset + length - 1]);
+}
+
+// Net number of values the instruction at offset pushes, negative when it
+// pops more than it pushes.
+static int chunk_stack_effect(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_CLOSURE:
+    case OP_GET_UPVALUE:
+    case OP_CLASS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return 1;
+    case OP_GET_LOCAL2:
+        return 2;
+    case OP_RETURN:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+        return -1;
+    case OP_JUMP_IF_NOT_LESS:
+        return -2;
+    case OP_CONCAT_N:
+        return 1 - chunk->code[offset + 1];
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return -chunk->code[offset + 1];
+    case OP_INVOKE:
+        return -chunk->code[offset + 2];
+    case OP_SUPER_INVOKE:
+        return -chunk->code[offset + 2] - 1;
+    default:
+        return 0;
+    }
+}
+
+// Fills depths[offset] with the number of values on the stack, counting the
+// base slots for the callee and its arguments, before the instruction at
+// offset runs, and -1 inside instructions. Returns the most values a frame
+// running chunk holds at once. Every path to an instruction reaches it with
+// the same depth, so one pass in code order that carries depths across
+// forward jumps finds them.
+int chunk_stack_depths(Chunk* chunk, int base, int* depths)
+{
+    int offset, length, target, depth = base, size = base;
+
+    for (offset = 0; offset < chunk->count; offset++) {
+        depths[offset] = -1;
+    }
+
+    for (offset = 0; offset < chunk->count; offset += length) {
+        length = chunk_instruction_length(chunk, offset);
+        // Code after an unconditional jump or a return is reached through
+        // the jumps to it.
+        if (depths[offset] > depth) {
+            depth = depths[offset];
+        }
+        depths[offset] = depth;
+
+        depth += chunk_stack_effect(chunk, offset);
+        if (depth > size) {
+            size = depth;
+        }
+
+        target = chunk->code[offset] != OP_LOOP ? chunk_jump_target(chunk, offset) : -1;
+        if (target >= 0 && target < chunk->count && depths[target] < depth) {
+            depths[target] = depth;
+        }
+    }
+
+    return size;
+}
+
+// The most values a frame running chunk holds at once.
+int chunk_stack_size(Chunk* chunk, int base)
+{
+    int* depths = NULL;
+    int size;
+
+    if (chunk->count == 0) {
+        return base;
+    }
+
+    depths = ALLOCATE(int, chunk->count);
+    size = chunk_stack_depths(chunk, base, depths);
+    FREE_ARRAY(int, depths, chunk->count);
+    return size;
+}
@@ -1,18 +1,20 @@
 #include "vm/compiler.h"
-#include "ds/list.h"
-#include "tokenizer.h"
 #include "vm/common.h"
+#include "vm/debug.h"
+#include "vm/gc.h"
+#include "vm/peephole.h"
+#include "vm/scanner.h"
 #include "vm/table.h"
 #include "vm/value.h"
 #include "vm/vm.h"
-#ifdef DEBUG_PRINT_CODE
-#include "vm/debug.h"
-#endif
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 typedef enum {
     TYPE_FUNCTION,
+    TYPE_METHOD,
+    TYPE_INITIALIZER,
     TYPE_SCRIPT
 } FunctionType;
 
@@ -26,6 +28,9 @@ static void grouping(int canAssign);
 static void _and(int canAssign);
 static void _or(int canAssign);
 static void call(int canAssign);
+static void dot(int canAssign);
+static void this_(int canAssign);
+static void super_(int canAssign);
 static void expression();
 
 static void var_declaration();
@@ -40,18 +45,19 @@ static int check(TokenType type);
 static int match(TokenType type);
 static void advance();
 static void error(const char* message);
-static void error_at(Node* node, const char* message);
+static void error_at(ScanToken* token, const char* message);
 
-static int identifier_equal(Token* a, Token* b);
-static Byte identifier_constant(Node* node);
-static Byte variable_parse(const char* message);
-static void variable_define(Byte id);
-static void named_variable(Node* node, int canAssign);
+static int identifier_equal(ScanToken* a, ScanToken* b);
+static int identifier_global(ScanToken* token);
+static int variable_parse(const char* message);
+static void variable_define(int id);
+static void named_variable(ScanToken* name, int canAssign);
+static void variable_local_add(ScanToken name);
 
 typedef struct vm_parser {
-    Node* current;
-    Node* previous;
-    Node* last;
+    Scanner scanner;
+    ScanToken current;
+    ScanToken previous;
     int panicMode;
     int hadError;
 } VmParser;
@@ -79,20 +85,60 @@ typedef struct parse_rule {
 } ParseRule;
 
 typedef struct {
-    Token name;
+    ScanToken name;
     int depth;
+    // Whether the slot holds the variable's value yet; a local function is
+    // in scope inside its own body before it is stored.
+    int stored;
+    // Set when a closure captures the local and when it is assigned after
+    // its declaration. Only locals that are both live in a VmUpvalue.
+    int captured;
+    int assigned;
 } Local;
 
+typedef struct {
+    Byte index;
+    Byte isLocal;
+} Upvalue;
+
+// The capture mode byte of an OP_CLOSURE that captures a local, patched once
+// the local goes out of scope and is known to be assigned or not.
+typedef struct {
+    int offset;
+    int local;
+} CaptureSite;
+
+#define FUSE_WINDOW 3
+#define NUMBER_BUFFER_SIZE 64
+
 typedef struct vm_compiler {
     struct vm_compiler* enclosing;
     VmFunction* function;
     FunctionType type;
     Local locals[BYTE_COUNT];
     int localCount;
+    Upvalue upvalues[BYTE_COUNT];
+    CaptureSite* captureSites;
+    int captureSiteCount;
+    int captureSiteCapacity;
     int scopeDepth;
+    // Start offsets of the most recent instructions, newest first, or -1.
+    int instructions[FUSE_WINDOW];
+    // The highest offset a jump lands on. Instructions are only fused when
+    // no jump lands inside the fused sequence.
+    int jumpTarget;
+    // Inline caches handed out to property instructions and calls so far.
+    int cacheCount;
+    int callCacheCount;
 } VmCompiler;
 
-static int variable_local_resolve(VmCompiler* compiler, Token* name);
+typedef struct class_compiler {
+    struct class_compiler* enclosing;
+    int hasSuperclass;
+} ClassCompiler;
+
+static int variable_local_resolve(VmCompiler* compiler, ScanToken* name);
+static int variable_upvalue_resolve(VmCompiler* compiler, ScanToken* name, int assign);
 
 ParseRule rules[] = {
     { grouping, call, PREC_CALL }, // TOKEN_LEFT_PAREN
@@ -100,7 +146,7 @@ ParseRule rules[] = {
     { NULL, NULL, PREC_NONE }, // TOKEN_LEFT_BRACE
     { NULL, NULL, PREC_NONE }, // TOKEN_RIGHT_BRACE
     { NULL, NULL, PREC_NONE }, // TOKEN_COMMA
-    { NULL, NULL, PREC_CALL }, // TOKEN_DOT
+    { NULL, dot, PREC_CALL }, // TOKEN_DOT
     { unary, binary, PREC_TERM }, // TOKEN_MINUS
     { NULL, binary, PREC_TERM }, // TOKEN_PLUS
     { NULL, NULL, PREC_NONE }, // TOKEN_SEMICOLON
@@ -128,8 +174,8 @@ ParseRule rules[] = {
     { NULL, _or, PREC_OR }, // TOKEN_OR
     { NULL, NULL, PREC_NONE }, // TOKEN_PRINT
     { NULL, NULL, PREC_NONE }, // TOKEN_RETURN
-    { NULL, NULL, PREC_NONE }, // TOKEN_SUPER
-    { NULL, NULL, PREC_NONE }, // TOKEN_THIS
+    { super_, NULL, PREC_NONE }, // TOKEN_SUPER
+    { this_, NULL, PREC_NONE }, // TOKEN_THIS
     { literal, NULL, PREC_NONE }, // TOKEN_TRUE
     { NULL, NULL, PREC_NONE }, // TOKEN_VAR
     { NULL, NULL, PREC_NONE }, // TOKEN_WHILE
@@ -141,6 +187,8 @@ static VmParser parser;
 
 static VmCompiler* currentCompiler = NULL;
 
+static ClassCompiler* currentClass = NULL;
+
 static ParseRule* parse_rule(TokenType type)
 {
     return &rules[type];
@@ -149,12 +197,10 @@ static ParseRule* parse_rule(TokenType type)
 static void prec_parse(Precedence prec)
 {
     ParseFn prefixRule, infixRule;
-    Token* token = NULL;
     int canAssign = 0;
 
     advance();
-    token = (Token*)parser.previous->data;
-    prefixRule = parse_rule(token->type)->prefix;
+    prefixRule = parse_rule(parser.previous.type)->prefix;
 
     if (prefixRule == NULL) {
         error("Expect Expression.");
@@ -165,9 +211,9 @@ static void prec_parse(Precedence prec)
 
     prefixRule(canAssign);
 
-    while (prec <= parse_rule(((Token*)parser.current->data)->type)->precedence) {
+    while (prec <= parse_rule(parser.current.type)->precedence) {
         advance();
-        infixRule = parse_rule(((Token*)parser.previous->data)->type)->infix;
+        infixRule = parse_rule(parser.previous.type)->infix;
         infixRule(canAssign);
     }
 
@@ -179,15 +225,13 @@ static void prec_parse(Precedence prec)
 
 static void synchronize()
 {
-    TokenType currentType = ((Token*)parser.current->data)->type;
-    TokenType prevType = ((Token*)parser.previous->data)->type;
     parser.panicMode = 0;
 
-    while (currentType != TOKEN_ENDOFFILE) {
-        if (prevType == TOKEN_SEMICOLON)
+    while (parser.current.type != TOKEN_ENDOFFILE) {
+        if (parser.previous.type == TOKEN_SEMICOLON)
             return;
 
-        switch (currentType) {
+        switch (parser.current.type) {
         case TOKEN_CLASS:
         case TOKEN_FUN:
         case TOKEN_VAR:
@@ -209,8 +253,7 @@ static void synchronize()
 
 static int check(TokenType type)
 {
-    Token* token = (Token*)parser.current->data;
-    return token->type == type;
+    return parser.current.type == type;
 }
 
 static int match(TokenType type)
@@ -223,9 +266,8 @@ static int match(TokenType type)
     return 1;
 }
 
-static void error_at(Node* node, const char* message)
+static void error_at(ScanToken* token, const char* message)
 {
-    Token* token = (Token*)node->data;
     if (parser.panicMode) {
         return;
     }
@@ -239,7 +281,7 @@ static void error_at(Node* node, const char* message)
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%s'", token->lexeme);
+        fprintf(stderr, " at '%.*s'", token->length, token->start);
     }
 
     fprintf(stderr, ": %s\n", message);
@@ -248,35 +290,40 @@ static void error_at(Node* node, const char* message)
 
 static void error(const char* message)
 {
-    error_at(parser.previous, message);
+    error_at(&parser.previous, message);
 }
 
 static void error_at_current(const char* message)
 {
-    error_at(parser.current, message);
+    error_at(&parser.current, message);
 }
 
-static void advance()
+#ifdef DEBUG_PRINT_CODE
+static void token_print(ScanToken* token)
 {
-    Node* node = NULL;
-    Token* token = NULL;
+    printf("%4d %2d '%.*s'\n", token->line, token->type, token->length, token->start);
+}
+#endif
 
+static void advance()
+{
     parser.previous = parser.current;
 
-    for (node = parser.current; node != parser.last;) {
-        parser.current = node = node->next;
-        token = (Token*)node->data;
-        if (token->type != TOKEN_ERROR)
+    for (;;) {
+        parser.current = scanner_next(&parser.scanner);
+#ifdef DEBUG_PRINT_CODE
+        token_print(&parser.current);
+#endif
+        if (parser.current.type != TOKEN_ERROR)
             break;
 
-        error_at_current(token->lexeme);
+        error_at_current(parser.current.start);
     }
 }
 
 static void consume(TokenType type, const char* message)
 {
-    Token* token = (Token*)parser.current->data;
-    if (token->type == type) {
+    if (parser.current.type == type) {
         advance();
         return;
     }
@@ -289,19 +336,6 @@ static Chunk* current_chunk()
     return &currentCompiler->function->chunk;
 }
 
-static void foreach_token(List* toknz, void* toknObj)
-{
-    int line = -1;
-    Token* token = (Token*)toknObj;
-
-    if (token->line != line) {
-        printf("%4d ", token->line);
-        line = token->line;
-    } else {
-        printf("   | ");
-    }
-    printf("%2d '%s'\n", token->type, token->lexeme);
-}
 
 static Byte make_constant(Value value)
 {
@@ -315,14 +349,100 @@ static Byte make_constant(Value value)
 
 static void emit_byte(Byte byte)
 {
-    Token* token = (Token*)parser.previous->data;
-    chunk_write(current_chunk(), byte, token->line);
+    chunk_write(current_chunk(), byte, parser.previous.line);
 }
 
-static void emit_bytes(Byte byte1, Byte byte2)
+// Emits the first byte of an instruction and remembers where it starts so
+// that the tail of the chunk can be inspected and fused.
+static void emit_op(Byte instruction)
 {
-    emit_byte(byte1);
-    emit_byte(byte2);
+    int* instructions = currentCompiler->instructions;
+    int i;
+
+    for (i = FUSE_WINDOW - 1; i > 0; i--) {
+        instructions[i] = instructions[i - 1];
+    }
+    instructions[0] = current_chunk()->count;
+    emit_byte(instruction);
+}
+
+static void emit_bytes(Byte instruction, Byte operand)
+{
+    emit_op(instruction);
+    emit_byte(operand);
+}
+
+static void emit_short(Byte instruction, int operand)
+{
+    emit_op(instruction);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
+}
+
+static int instruction_last(int distance)
+{
+    int offset = currentCompiler->instructions[distance];
+    return offset == -1 ? -1 : current_chunk()->code[offset];
+}
+
+// Whether the last count instructions may be replaced by one: they exist and
+// no jump lands after the first of them.
+static int instructions_fusable(int count)
+{
+    int first = currentCompiler->instructions[count - 1];
+    return first != -1 && currentCompiler->jumpTarget <= first;
+}
+
+// Drops the last count instructions so that a fused one can be emitted in
+// their place. Older instructions are forgotten; they are not fused further.
+static void instructions_drop(int count)
+{
+    int i;
+
+    current_chunk()->count = currentCompiler->instructions[count - 1];
+    for (i = 0; i < FUSE_WINDOW; i++) {
+        currentCompiler->instructions[i] = -1;
+    }
+}
+
+static void jump_target(int offset)
+{
+    if (offset > currentCompiler->jumpTarget) {
+        currentCompiler->jumpTarget = offset;
+    }
+}
+
+static void emit_get_local(Byte slot)
+{
+    Byte previous;
+
+    if (instruction_last(0) == OP_GET_LOCAL && instructions_fusable(1)) {
+        previous = current_chunk()->code[currentCompiler->instructions[0] + 1];
+        instructions_drop(1);
+        emit_bytes(OP_GET_LOCAL2, previous);
+        emit_byte(slot);
+        return;
+    }
+
+    emit_bytes(OP_GET_LOCAL, slot);
+}
+
+// Emits a binary instruction, fused with its operands when they are a local
+// and a constant.
+static void emit_binary(Byte instruction, Byte fused)
+{
+    Byte slot, constant;
+
+    if (instruction_last(0) == OP_CONSTANT && instruction_last(1) == OP_GET_LOCAL && instructions_fusable(2)) {
+        slot = current_chunk()->code[currentCompiler->instructions[1] + 1];
+        constant = current_chunk()->code[currentCompiler->instructions[0] + 1];
+        instructions_drop(2);
+        emit_bytes(fused, slot);
+        emit_byte(constant);
+        return;
+    }
+
+    emit_op(instruction);
 }
 
 static void emit_constant(Value value)
@@ -330,25 +450,380 @@ static void emit_constant(Value value)
     emit_bytes(OP_CONSTANT, make_constant(value));
 }
 
+// Drops the last count instructions and forgets them, keeping the older ones
+// for fusing and folding.
+static void instructions_remove(int count)
+{
+    int* instructions = currentCompiler->instructions;
+    int i;
+
+    current_chunk()->count = instructions[count - 1];
+    for (i = 0; i < FUSE_WINDOW; i++) {
+        instructions[i] = i + count < FUSE_WINDOW ? instructions[i + count] : -1;
+    }
+}
+
+// The value the instruction distance back pushes, when it is a constant.
+static int instruction_value(int distance, Value* value)
+{
+    Chunk* chunk = current_chunk();
+    int offset = currentCompiler->instructions[distance];
+
+    switch (offset == -1 ? -1 : chunk->code[offset]) {
+    case OP_CONSTANT:
+        *value = chunk->constants.values[chunk->code[offset + 1]];
+        return 1;
+    case OP_NIL:
+        *value = nil_val();
+        return 1;
+    case OP_TRUE:
+        *value = bool_val(1);
+        return 1;
+    case OP_FALSE:
+        *value = bool_val(0);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Replaces the last count instructions, which push constants, with one that
+// pushes value. Their constants are dropped from the end of the pool, so
+// value must be rooted by the caller.
+static void constants_fold(int count, Value value)
+{
+    Chunk* chunk = current_chunk();
+    int i, offset;
+
+    for (i = 0; i < count; i++) {
+        offset = currentCompiler->instructions[i];
+        if (chunk->code[offset] == OP_CONSTANT && chunk->code[offset + 1] == chunk->constants.count - 1) {
+            chunk->constants.count--;
+        }
+    }
+    instructions_remove(count);
+
+    if (IS_NIL(value)) {
+        emit_op(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emit_op(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(value);
+    }
+}
+
+// Computes a unary operator on a constant at compile time, unless it would
+// be a runtime error.
+static int fold_unary(Byte instruction)
+{
+    Value value;
+
+    if (!instructions_fusable(1) || !instruction_value(0, &value)) {
+        return 0;
+    }
+
+    if (instruction == OP_NOT) {
+        value = bool_val(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+    } else if (IS_NUMBER(value)) {
+        value = number_val(-AS_NUMBER(value));
+    } else {
+        return 0;
+    }
+
+    constants_fold(1, value);
+    return 1;
+}
+
+// Computes a binary operator on two constants at compile time, unless it
+// would be a runtime error. Concatenated literals are interned like any
+// other string constant.
+static int fold_binary(Byte instruction)
+{
+    Value left, right, result;
+    VmString *a = NULL, *b = NULL, *string = NULL;
+
+    if (!instructions_fusable(2) || !instruction_value(1, &left) || !instruction_value(0, &right)) {
+        return 0;
+    }
+
+    if (instruction == OP_EQUAL) {
+        result = bool_val(values_equal(left, right));
+    } else if (IS_NUMBER(left) && IS_NUMBER(right)) {
+        switch (instruction) {
+        case OP_ADD:
+            result = number_val(AS_NUMBER(left) + AS_NUMBER(right));
+            break;
+        case OP_SUBTRACT:
+            result = number_val(AS_NUMBER(left) - AS_NUMBER(right));
+            break;
+        case OP_MULTIPLY:
+            result = number_val(AS_NUMBER(left) * AS_NUMBER(right));
+            break;
+        case OP_DIVIDE:
+            result = number_val(AS_NUMBER(left) / AS_NUMBER(right));
+            break;
+        case OP_GREATER:
+            result = bool_val(AS_NUMBER(left) > AS_NUMBER(right));
+            break;
+        default:
+            result = bool_val(AS_NUMBER(left) < AS_NUMBER(right));
+            break;
+        }
+    } else if (instruction == OP_ADD && IS_STRING(left) && IS_STRING(right)) {
+        // The operands stay in the pool, and reachable, until the result
+        // replaces them.
+        a = AS_STRING(left);
+        b = AS_STRING(right);
+        string = vmstring_alloc((size_t)a->length + b->length);
+        memcpy(string->chars, a->chars, a->length);
+        memcpy(string->chars + a->length, b->chars, b->length);
+        result = object_val((VmObject*)vmstring_take(string));
+    } else {
+        return 0;
+    }
+
+    vm_stack_push(result);
+    constants_fold(2, result);
+    vm_stack_pop();
+    return 1;
+}
+
+// Whether the instruction distance back always pushes a boolean.
+static int instruction_boolean(int distance)
+{
+    switch (instruction_last(distance)) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Whether the instruction distance back pushes a number when it succeeds.
+static int instruction_number(int distance)
+{
+    switch (instruction_last(distance)) {
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NEGATE:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Emits an operator, folded when its operands are constants. The identities
+// applied keep every runtime type check: !!x and -(-x) cancel only when x
+// is already a boolean or a number, and x / 2^n becomes the exact x * 2^-n.
+static void emit_operator(Byte instruction)
+{
+    Chunk* chunk = current_chunk();
+    Value* divisor = NULL;
+    double mantissa;
+    int exponent;
+
+    if (instruction == OP_NOT || instruction == OP_NEGATE) {
+        if (fold_unary(instruction)) {
+            return;
+        }
+        if (instruction_last(0) == instruction && instructions_fusable(2)
+            && (instruction == OP_NOT ? instruction_boolean(1) : instruction_number(1))) {
+            instructions_remove(1);
+            return;
+        }
+        emit_op(instruction);
+        return;
+    }
+
+    if (fold_binary(instruction)) {
+        return;
+    }
+
+    if (instruction == OP_DIVIDE && instruction_last(0) == OP_CONSTANT && instructions_fusable(1)) {
+        divisor = &chunk->constants.values[chunk->code[currentCompiler->instructions[0] + 1]];
+        mantissa = IS_NUMBER(*divisor) ? frexp(AS_NUMBER(*divisor), &exponent) : 0;
+        // Both the divisor and its reciprocal are normal numbers.
+        if ((mantissa == 0.5 || mantissa == -0.5) && exponent >= -1020 && exponent <= 1022) {
+            *divisor = number_val(ldexp(mantissa * 4, -exponent));
+            instruction = OP_MULTIPLY;
+        }
+    }
+
+    switch (instruction) {
+    case OP_ADD:
+        emit_binary(OP_ADD, OP_ADD_LOCAL_CONSTANT);
+        break;
+    case OP_SUBTRACT:
+        emit_binary(OP_SUBTRACT, OP_SUBTRACT_LOCAL_CONSTANT);
+        break;
+    default:
+        emit_op(instruction);
+    }
+}
+
+// Whether the instruction distance back pushes a string constant.
+static int instruction_string(int distance)
+{
+    Value value;
+    return instruction_value(distance, &value) && IS_STRING(value);
+}
+
+// Reopens the chain of + that ends with the instruction just emitted, when a
+// string constant is in it, so that the next operand joins one OP_CONCAT_N.
+// Chains without one stay OP_ADD, which quickens for numbers. Returns how
+// many operands the chain leaves on the stack, or 0.
+// OP_CONCAT_N checks its operands only once all are pushed, so the caller
+// reopens a chain only for an operand whose push cannot fail or be observed.
+static int concat_reopen()
+{
+    Chunk* chunk = current_chunk();
+    int offset = currentCompiler->instructions[0];
+    Byte slot, constant, count;
+
+    if (!instructions_fusable(1)) {
+        return 0;
+    }
+
+    switch (chunk->code[offset]) {
+    case OP_CONCAT_N:
+        count = chunk->code[offset + 1];
+        if (count == BYTE_MAX) {
+            return 0;
+        }
+        instructions_remove(1);
+        return count;
+    case OP_ADD_LOCAL_CONSTANT:
+        slot = chunk->code[offset + 1];
+        constant = chunk->code[offset + 2];
+        if (!IS_STRING(chunk->constants.values[constant])) {
+            return 0;
+        }
+        instructions_remove(1);
+        emit_bytes(OP_GET_LOCAL, slot);
+        emit_bytes(OP_CONSTANT, constant);
+        return 2;
+    case OP_ADD:
+        if ((instructions_fusable(2) && instruction_string(1)) || (instructions_fusable(3) && instruction_string(2))) {
+            instructions_remove(1);
+            return 2;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+// Emits the OP_CONCAT_N of a reopened chain, first folding its last two
+// operands when both are string constants.
+static void emit_concat(int count)
+{
+    if (instruction_string(0) && instruction_string(1) && fold_binary(OP_ADD)) {
+        count--;
+    }
+
+    if (count == 2) {
+        emit_operator(OP_ADD);
+        return;
+    }
+    emit_bytes(OP_CONCAT_N, count);
+}
+
 static void emit_return()
 {
-    emit_byte(OP_NIL);
-    emit_byte(OP_RETURN);
+    if (currentCompiler->type == TYPE_INITIALIZER) {
+        emit_bytes(OP_GET_LOCAL, 0);
+    } else {
+        emit_op(OP_NIL);
+    }
+    emit_op(OP_RETURN);
+}
+
+static Byte identifier_constant(ScanToken* name)
+{
+    VmString* string = vmstring_copy(name->start, name->length);
+    ValueArray* constants = &current_chunk()->constants;
+    int i;
+
+    // Property names repeat a lot; strings are interned, so reuse the
+    // constant when the same string is already there.
+    for (i = 0; i < constants->count; i++) {
+        if (IS_STRING(constants->values[i]) && AS_STRING(constants->values[i]) == string) {
+            return (Byte)i;
+        }
+    }
+
+    return make_constant(object_val((VmObject*)string));
+}
+
+static int cache_new()
+{
+    if (currentCompiler->cacheCount > SHORT_MAX) {
+        error("Too many property accesses in one function.");
+        return 0;
+    }
+
+    return currentCompiler->cacheCount++;
+}
+
+static int call_cache_new()
+{
+    if (currentCompiler->callCacheCount > SHORT_MAX) {
+        error("Too many calls in one function.");
+        return 0;
+    }
+
+    return currentCompiler->callCacheCount++;
+}
+
+// Emits a property instruction: its name constant, any extra operand and
+// its inline cache.
+static void emit_property(Byte instruction, Byte name, int argCount)
+{
+    int cache = cache_new();
+
+    emit_bytes(instruction, name);
+    if (argCount != -1) {
+        emit_byte((Byte)argCount);
+    }
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
 }
 
 static int emit_jump(Byte instruction)
 {
-    emit_byte(instruction);
+    emit_op(instruction);
     emit_byte(0xff);
     emit_byte(0xff);
     return current_chunk()->count - 2;
 }
 
+// Emits the jump over the body of an if, while or for when the condition is
+// false. A trailing OP_LESS is folded into the jump, which then pops the
+// operands itself: *popped tells the caller not to emit the pops of the
+// condition on either path.
+static int emit_condition_jump(int* popped)
+{
+    *popped = instruction_last(0) == OP_LESS && instructions_fusable(1);
+    if (*popped) {
+        instructions_drop(1);
+        return emit_jump(OP_JUMP_IF_NOT_LESS);
+    }
+
+    return emit_jump(OP_JUMP_IF_FALSE);
+}
+
 static void patch_jump(int offset)
 {
     int jump = current_chunk()->count - offset - 2;
 
-    if (jump > BYTE_MAX) {
+    jump_target(current_chunk()->count);
+
+    if (jump > SHORT_MAX) {
         error("Too much code to jump over.");
     }
 
@@ -359,7 +834,8 @@ static void patch_jump(int offset)
 static void emit_loop(int loopStart)
 {
     int offset = 0;
-    emit_byte(OP_LOOP);
+    jump_target(loopStart);
+    emit_op(OP_LOOP);
 
     offset = current_chunk()->count - loopStart + 2;
 
@@ -371,34 +847,100 @@ static void emit_loop(int loopStart)
     emit_byte(offset & 0xff);
 }
 
+static void capture_site_add(int offset, int local)
+{
+    VmCompiler* compiler = currentCompiler;
+    int oldCapacity = compiler->captureSiteCapacity;
+
+    if (compiler->captureSiteCount == oldCapacity) {
+        compiler->captureSiteCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->captureSites = GROW_ARRAY(compiler->captureSites, CaptureSite, oldCapacity, compiler->captureSiteCapacity);
+    }
+
+    compiler->captureSites[compiler->captureSiteCount].offset = offset;
+    compiler->captureSites[compiler->captureSiteCount].local = local;
+    compiler->captureSiteCount++;
+}
+
+// Settles how the closures created so far capture a local that is going out
+// of scope: by value unless it is assigned after its declaration.
+static void captures_patch(int local)
+{
+    VmCompiler* compiler = currentCompiler;
+    Byte mode = compiler->locals[local].assigned ? CAPTURE_SHARED : CAPTURE_VALUE;
+    int i, kept = 0;
+
+    for (i = 0; i < compiler->captureSiteCount; i++) {
+        if (compiler->captureSites[i].local == local) {
+            current_chunk()->code[compiler->captureSites[i].offset] = mode;
+        } else {
+            compiler->captureSites[kept++] = compiler->captureSites[i];
+        }
+    }
+
+    compiler->captureSiteCount = kept;
+}
+
 static void compiler_init(VmCompiler* compiler, FunctionType type)
 {
-    Token* token = NULL;
     Local* local = NULL;
+    int i;
     memset(compiler, 0, sizeof(VmCompiler));
     compiler->enclosing = currentCompiler;
     compiler->type = type;
     compiler->function = NULL;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    for (i = 0; i < FUSE_WINDOW; i++) {
+        compiler->instructions[i] = -1;
+    }
+    compiler->jumpTarget = 0;
+    // Become the current compiler before allocating anything so that the
+    // function under construction is a GC root.
+    currentCompiler = compiler;
     compiler->function = vmfunction_new();
 
     if (type != TYPE_SCRIPT) {
-        token = (Token*)parser.previous->data;
-        compiler->function->name = vmstring_copy(token->lexeme, strlen(token->lexeme));
+        compiler->function->name = vmstring_copy(parser.previous.start, parser.previous.length);
     }
-    currentCompiler = compiler;
 
+    // Slot 0 holds the function being called, or the receiver in methods.
     local = &currentCompiler->locals[currentCompiler->localCount++];
     local->depth = 0;
-    local->name.lexeme = "";
+    local->stored = 1;
+    if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+        local->name.start = "this";
+        local->name.length = 4;
+    } else {
+        local->name.start = "";
+        local->name.length = 0;
+    }
 }
 
 static VmFunction* compiler_end()
 {
     VmFunction* function = NULL;
+    int i;
+
     emit_return();
     function = currentCompiler->function;
+    for (i = currentCompiler->localCount - 1; i >= 0; i--) {
+        captures_patch(i);
+    }
+    FREE_ARRAY(CaptureSite, currentCompiler->captureSites, currentCompiler->captureSiteCapacity);
+    if (!parser.hadError) {
+        if (vm.dumpPeephole) {
+            printf("-- before peephole --\n");
+            chunk_disassemble(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        }
+        peephole_optimize(current_chunk());
+        if (vm.dumpPeephole) {
+            printf("-- after peephole --\n");
+            chunk_disassemble(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        }
+    }
+    vmfunction_caches_alloc(function, currentCompiler->cacheCount, currentCompiler->callCacheCount);
+    function->maxStack = chunk_stack_size(&function->chunk, function->arity + 1);
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         chunk_disassemble(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -431,7 +973,76 @@ static Byte argument_list()
 static void call(int canAssign)
 {
     Byte argCount = argument_list();
+    int cache = call_cache_new();
+
     emit_bytes(OP_CALL, argCount);
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
+static void dot(int canAssign)
+{
+    Byte name;
+
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    name = identifier_constant(&parser.previous);
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emit_property(OP_SET_PROPERTY, name, -1);
+    } else if (match(TOKEN_LEFT_PAREN)) {
+        emit_property(OP_INVOKE, name, argument_list());
+    } else {
+        emit_property(OP_GET_PROPERTY, name, -1);
+    }
+}
+
+static ScanToken token_synthetic(const char* text)
+{
+    ScanToken token;
+    token.type = TOKEN_IDENTIFIER;
+    token.start = text;
+    token.length = (int)strlen(text);
+    token.line = parser.previous.line;
+    return token;
+}
+
+static void this_(int canAssign)
+{
+    if (currentClass == NULL) {
+        error("Cannot use 'this' outside of a class.");
+        return;
+    }
+
+    variable(0);
+}
+
+static void super_(int canAssign)
+{
+    ScanToken thisToken = token_synthetic("this");
+    ScanToken superToken = token_synthetic("super");
+    Byte name, argCount;
+
+    if (currentClass == NULL) {
+        error("Cannot use 'super' outside of a class.");
+    } else if (!currentClass->hasSuperclass) {
+        error("Cannot use 'super' in a class with no superclass.");
+    }
+
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    name = identifier_constant(&parser.previous);
+
+    named_variable(&thisToken, 0);
+    if (match(TOKEN_LEFT_PAREN)) {
+        argCount = argument_list();
+        named_variable(&superToken, 0);
+        emit_bytes(OP_SUPER_INVOKE, name);
+        emit_byte(argCount);
+    } else {
+        named_variable(&superToken, 0);
+        emit_bytes(OP_GET_SUPER, name);
+    }
 }
 
 static void expression()
@@ -441,42 +1052,72 @@ static void expression()
 
 static void literal(int canAssign)
 {
-    Token* token = (Token*)parser.previous->data;
-    switch (token->type) {
+    switch (parser.previous.type) {
     case TOKEN_FALSE:
-        emit_byte(OP_FALSE);
+        emit_op(OP_FALSE);
         break;
     case TOKEN_TRUE:
-        emit_byte(OP_TRUE);
+        emit_op(OP_TRUE);
         break;
     case TOKEN_NIL:
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
         break;
     default:
         return;
     }
 }
 
-static VmObject* new_vmobject(size_t size, VmObjectType type)
+VmObject* new_vmobject(size_t size, VmObjectType type)
 {
     VmObject* object = (VmObject*)reallocate(NULL, 0, size);
     object->type = type;
+    object->isMarked = 0;
     object->next = vm.objects;
     vm.objects = object;
     return object;
 }
 
-#define ALLOC_OBJECT(type, objectType) ((type*)new_vmobject(sizeof(type), (objectType)))
-
 VmFunction* vmfunction_new()
 {
     VmFunction* function = ALLOC_OBJECT(VmFunction, OBJECT_FUNCTION);
     function->arity = 0;
+    function->upvalueCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
+    function->caches = NULL;
+    function->cacheCount = 0;
+    function->callCaches = NULL;
+    function->callCacheCount = 0;
+    function->jitCountdown = vm.jitThreshold;
+    function->jit = NULL;
+    function->loops = NULL;
+    function->traceableLoops = -1;
     chunk_init(&function->chunk);
     return function;
 }
 
+// The caches start empty. The count is only published once they exist, as
+// the collector walks them.
+void vmfunction_caches_alloc(VmFunction* function, int count, int callCount)
+{
+    InlineCache* caches = NULL;
+    CallCache* callCaches = NULL;
+
+    if (count != 0) {
+        caches = ALLOCATE(InlineCache, count);
+        memset(caches, 0, sizeof(InlineCache) * count);
+        function->caches = caches;
+        function->cacheCount = count;
+    }
+
+    if (callCount != 0) {
+        callCaches = ALLOCATE(CallCache, callCount);
+        memset(callCaches, 0, sizeof(CallCache) * callCount);
+        function->callCaches = callCaches;
+        function->callCacheCount = callCount;
+    }
+}
+
 VmNative* vmnative_new(NativeFn function)
 {
     VmNative* native = ALLOC_OBJECT(VmNative, OBJECT_NATIVE);
@@ -484,79 +1125,264 @@ VmNative* vmnative_new(NativeFn function)
     return native;
 }
 
-static Hash hash_string(const char* string, size_t length)
+VmClosure* vmclosure_new(VmFunction* function)
 {
-    unsigned int hash = 2166136261u;
-    size_t i;
+    Value* captures = NULL;
+    VmClosure* closure = NULL;
+    int i;
 
-    for (i = 0; i < length; i++) {
-        hash ^= string[i];
-        hash *= 16777619;
+    // Allocated first: the closure is not reachable from anywhere yet.
+    captures = ALLOCATE(Value, function->upvalueCount);
+    for (i = 0; i < function->upvalueCount; i++) {
+        captures[i] = nil_val();
     }
 
-    return hash;
+    closure = ALLOC_OBJECT(VmClosure, OBJECT_CLOSURE);
+    closure->function = function;
+    closure->captures = captures;
+    closure->captureCount = function->upvalueCount;
+    return closure;
+}
+
+VmUpvalue* vmupvalue_new(Value* slot)
+{
+    VmUpvalue* upvalue = ALLOC_OBJECT(VmUpvalue, OBJECT_UPVALUE);
+    upvalue->location = slot;
+    upvalue->closed = nil_val();
+    upvalue->next = NULL;
+    return upvalue;
 }
 
-static VmString* new_vmstring(char* chars, size_t length, Hash hash)
+static void vmstring_length_check(size_t length)
 {
-    VmString* string = ALLOC_OBJECT(VmString, OBJECT_STRING);
-    string->chars = chars;
-    string->length = length;
+    if (length > STRING_LENGTH_MAX) {
+        fprintf(stderr, "Out of memory: strings are limited to %u characters.\n", STRING_LENGTH_MAX);
+        exit(70);
+    }
+}
+
+// Makes string, from vmstring_alloc(), an object.
+static VmString* vmstring_link(VmString* string, VmObjectType type)
+{
+    string->object.type = type;
+    string->object.next = vm.objects;
+    vm.objects = (VmObject*)string;
+    return string;
+}
+
+static VmString* vmstring_insert(VmString* string, Hash hash)
+{
+    string->object.type = OBJECT_STRING;
     string->hash = hash;
+    // Growing the intern table may collect, and the table itself is weak.
+    vm_stack_push(object_val((VmObject*)string));
     table_set(&vm.strings, string, nil_val());
+    vm_stack_pop();
+    return string;
+}
+
+// Allocates a string of length characters for the caller to fill and pass to
+// vmstring_take() or vmstring_loose(). Until then it is not an object, so a
+// collection neither sees nor frees it.
+VmString* vmstring_alloc(size_t length)
+{
+    VmString* string = NULL;
+
+    vmstring_length_check(length);
+    string = (VmString*)reallocate(NULL, 0, VMSTRING_SIZE(length));
+    string->object.type = OBJECT_STRING;
+    string->object.isMarked = 0;
+    string->object.next = NULL;
+    string->length = (unsigned int)length;
+    string->hash = 0;
+    string->chars[length] = 0;
     return string;
 }
 
 VmString* vmstring_copy(const char* chars, size_t length)
 {
-    char* heapChars = NULL;
-    Hash hash = hash_string(chars, length);
+    VmString* string = NULL;
+    Hash hash = table_hash(chars, length);
     VmString* interned = table_find_string(&vm.strings, chars, length, hash);
 
     if (interned != NULL) {
         return interned;
     }
 
-    heapChars = (char*)alloc(length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = 0;
-    return new_vmstring(heapChars, length, hash);
+    string = vmstring_alloc(length);
+    memcpy(string->chars, chars, length);
+    return vmstring_insert(vmstring_link(string, OBJECT_STRING), hash);
 }
 
-VmString* vmstring_take(char* chars, size_t length)
+VmString* vmstring_take(VmString* string)
 {
-    Hash hash = hash_string(chars, length);
-    VmString* interned = table_find_string(&vm.strings, chars, length, hash);
+    Hash hash = table_hash(string->chars, string->length);
+    VmString* interned = table_find_string(&vm.strings, string->chars, string->length, hash);
 
     if (interned != NULL) {
+        // The caller handed over string, which is not an object yet.
+        reallocate(string, VMSTRING_SIZE(string->length), 0);
         return interned;
     }
 
-    return new_vmstring(chars, length, hash);
+    return vmstring_insert(vmstring_link(string, OBJECT_STRING), hash);
+}
+
+// Strings made while the program runs are often only printed, so they are
+// neither hashed nor interned until they are first compared.
+VmString* vmstring_loose(VmString* string)
+{
+    return vmstring_link(string, OBJECT_LOOSE_STRING);
+}
+
+// Returns the interned string with the characters of string, interning
+// string itself if there is none yet.
+VmString* vmstring_intern(VmString* string)
+{
+    Hash hash;
+    VmString* interned = NULL;
+
+    if (string->object.type != OBJECT_LOOSE_STRING) {
+        return string;
+    }
+
+    hash = table_hash(string->chars, string->length);
+    interned = table_find_string(&vm.strings, string->chars, string->length, hash);
+    return interned != NULL ? interned : vmstring_insert(string, hash);
+}
+
+// A flattened rope stands for the string it was flattened into.
+static VmString* vmrope_forward(VmString* string)
+{
+    VmRope* rope = (VmRope*)string;
+    return string->object.type == OBJECT_ROPE && rope->right == NULL ? rope->left : string;
+}
+
+// Both halves must be reachable by the collector while the rope is allocated.
+VmString* vmrope_new(VmString* left, VmString* right)
+{
+    VmRope* rope = NULL;
+
+    vmstring_length_check((size_t)left->length + right->length);
+    rope = ALLOC_OBJECT(VmRope, OBJECT_ROPE);
+    rope->length = left->length + right->length;
+    rope->hash = 0;
+    rope->left = vmrope_forward(left);
+    rope->right = vmrope_forward(right);
+    return (VmString*)rope;
+}
+
+// Copies the leaves of a rope, left to right, into one string. A
+// rope built by appending in a loop is as deep as it is long, so the right
+// halves still to copy are kept on an explicit stack instead of recursing.
+// Halves flattened since the rope was made are read through their strings.
+VmString* vmstring_flatten(VmString* string)
+{
+    VmRope* rope = (VmRope*)string;
+    VmString** pending = NULL;
+    VmString* node = vmrope_forward(string);
+    VmString* flat = NULL;
+    int count = 0, capacity = 0;
+    size_t length = 0;
+
+    if (node->object.type != OBJECT_ROPE) {
+        return node;
+    }
+
+    vm_stack_push(object_val((VmObject*)string));
+    flat = vmstring_alloc(string->length);
+    for (;;) {
+        while (node->object.type == OBJECT_ROPE) {
+            if (count == capacity) {
+                pending = GROW_ARRAY(pending, VmString*, capacity, GROW_CAPACITY(capacity));
+                capacity = GROW_CAPACITY(capacity);
+            }
+            pending[count++] = vmrope_forward(((VmRope*)node)->right);
+            node = vmrope_forward(((VmRope*)node)->left);
+        }
+
+        memcpy(flat->chars + length, node->chars, node->length);
+        length += node->length;
+        if (count == 0) {
+            break;
+        }
+        node = pending[--count];
+    }
+    FREE_ARRAY(VmString*, pending, capacity);
+
+    rope->left = vmstring_loose(flat);
+    rope->right = NULL;
+    vm_stack_pop();
+    return rope->left;
+}
+
+// The interned string with the characters of string. A rope forwards to it
+// from then on.
+static VmString* vmstring_canonical(VmString* string)
+{
+    VmString* interned = vmstring_intern(vmstring_flatten(string));
+
+    if (string->object.type == OBJECT_ROPE) {
+        ((VmRope*)string)->left = interned;
+    }
+    return interned;
+}
+
+// Interns both strings, so that comparing either again is comparing pointers.
+int vmstring_equal(VmString* a, VmString* b)
+{
+    int equal;
+
+    if (a->length != b->length) {
+        return 0;
+    }
+
+    vm_stack_push(object_val((VmObject*)a));
+    vm_stack_push(object_val((VmObject*)b));
+    a = vmstring_canonical(a);
+    vm_stack_push(object_val((VmObject*)a));
+    equal = a == vmstring_canonical(b);
+    vm_stack_pop();
+    vm_stack_pop();
+    vm_stack_pop();
+    return equal;
 }
 
 static void variable(int canAssign)
 {
-    named_variable(parser.previous, canAssign);
+    named_variable(&parser.previous, canAssign);
 }
 
-static void named_variable(Node* node, int canAssign)
+static void named_variable(ScanToken* name, int canAssign)
 {
     Byte getOp, setOp;
-    Token* name = (Token*)node->data;
+    int assign = canAssign && check(TOKEN_EQUAL);
     int arg = variable_local_resolve(currentCompiler, name);
 
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        currentCompiler->locals[arg].assigned |= assign;
+    } else if ((arg = variable_upvalue_resolve(currentCompiler, name, assign)) != -1) {
+        getOp = OP_GET_UPVALUE;
+        setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(node);
+        arg = identifier_global(name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
-    if (canAssign && match(TOKEN_EQUAL)) {
+    if (assign) {
+        advance();
         expression();
-        emit_bytes(setOp, (Byte)arg);
+        if (setOp == OP_SET_GLOBAL) {
+            emit_short(setOp, arg);
+        } else {
+            emit_bytes(setOp, (Byte)arg);
+        }
+    } else if (getOp == OP_GET_GLOBAL) {
+        emit_short(getOp, arg);
+    } else if (getOp == OP_GET_LOCAL) {
+        emit_get_local((Byte)arg);
     } else {
         emit_bytes(getOp, (Byte)arg);
     }
@@ -564,17 +1390,28 @@ static void named_variable(Node* node, int canAssign)
 
 static void string(int canAssign)
 {
-    Token* token = (Token*)parser.previous->data;
-    VmString* string = vmstring_copy(token->literal, strlen(token->literal));
+    VmString* string = vmstring_copy(parser.previous.start, parser.previous.length);
     Value stringValue = object_val((VmObject*)string);
     emit_constant(stringValue);
 }
 
 static void number(int canAssign)
 {
-    Token* token = (Token*)parser.previous->data;
-    double value = strtod(token->lexeme, NULL);
-    emit_constant(number_val(value));
+    char buffer[NUMBER_BUFFER_SIZE];
+    char* digits = buffer;
+    int length = parser.previous.length;
+
+    // The token is not terminated and strtod would read on past it, into an
+    // exponent or a hex prefix that Lox scans as separate tokens.
+    if (length >= NUMBER_BUFFER_SIZE) {
+        digits = ALLOCATE(char, length + 1);
+    }
+    memcpy(digits, parser.previous.start, length);
+    digits[length] = 0;
+    emit_constant(number_val(strtod(digits, NULL)));
+    if (digits != buffer) {
+        FREE_ARRAY(char, digits, length + 1);
+    }
 }
 
 static void grouping(int canAssign)
@@ -585,61 +1422,99 @@ static void grouping(int canAssign)
 
 static void unary(int canAssign)
 {
-    Token* token = (Token*)parser.previous->data;
-    TokenType operatorType = token->type;
+    TokenType operatorType = parser.previous.type;
 
     prec_parse(PREC_UNARY);
 
     switch (operatorType) {
     case TOKEN_MINUS:
-        emit_byte(OP_NEGATE);
+        emit_operator(OP_NEGATE);
         break;
     case TOKEN_BANG:
-        emit_byte(OP_NOT);
+        emit_operator(OP_NOT);
         break;
     default:
         return;
     }
 }
 
+// Joins the right operand of + just parsed to the chain before it, when the
+// operand is one constant, local or upvalue. Anything else is left to OP_ADD
+// so that the chain is type checked before its side effects and errors.
+static void concat_emit(int start, const int* window)
+{
+    Chunk* chunk = current_chunk();
+    int offset = currentCompiler->instructions[0];
+    Byte instruction, operand;
+    int count;
+
+    if (offset != start || chunk->count != start + 2) {
+        emit_operator(OP_ADD);
+        return;
+    }
+
+    instruction = chunk->code[offset];
+    operand = chunk->code[offset + 1];
+    if (instruction != OP_CONSTANT && instruction != OP_GET_LOCAL && instruction != OP_GET_UPVALUE) {
+        emit_operator(OP_ADD);
+        return;
+    }
+
+    chunk->count = start;
+    memcpy(currentCompiler->instructions, window, sizeof(currentCompiler->instructions));
+    count = concat_reopen();
+    emit_bytes(instruction, operand);
+    if (count > 0) {
+        emit_concat(count + 1);
+    } else {
+        emit_operator(OP_ADD);
+    }
+}
+
 static void binary(int canAssign)
 {
-    Token* token = (Token*)parser.previous->data;
-    TokenType operatorType = token->type;
+    TokenType operatorType = parser.previous.type;
+    int start = current_chunk()->count;
+    int window[FUSE_WINDOW];
+
+    memcpy(window, currentCompiler->instructions, sizeof(window));
 
     ParseRule* rule = parse_rule(operatorType);
     prec_parse((Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
     case TOKEN_PLUS:
-        emit_byte(OP_ADD);
+        concat_emit(start, window);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_SUBTRACT);
+        emit_operator(OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emit_byte(OP_MULTIPLY);
+        emit_operator(OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emit_byte(OP_DIVIDE);
+        emit_operator(OP_DIVIDE);
         break;
     case TOKEN_BANG_EQUAL:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_operator(OP_EQUAL);
+        emit_operator(OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emit_byte(OP_EQUAL);
+        emit_operator(OP_EQUAL);
         break;
     case TOKEN_GREATER_EQUAL:
-        emit_bytes(OP_LESS, OP_NOT);
+        emit_operator(OP_LESS);
+        emit_operator(OP_NOT);
         break;
     case TOKEN_GREATER:
-        emit_byte(OP_GREATER);
+        emit_operator(OP_GREATER);
         break;
     case TOKEN_LESS:
-        emit_byte(OP_LESS);
+        emit_operator(OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emit_bytes(OP_GREATER, OP_NOT);
+        emit_operator(OP_GREATER);
+        emit_operator(OP_NOT);
         break;
     default:
         return;
@@ -650,7 +1525,7 @@ static void _and(int canAssign)
 {
     int endJump = emit_jump(OP_JUMP_IF_FALSE);
 
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     prec_parse(PREC_AND);
 
     patch_jump(endJump);
@@ -662,7 +1537,7 @@ static void _or(int canAssign)
     int endJump = emit_jump(OP_JUMP);
 
     patch_jump(elseJump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     prec_parse(PREC_OR);
     patch_jump(endJump);
@@ -672,34 +1547,39 @@ static void print_statement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(OP_PRINT);
+    emit_op(OP_PRINT);
 }
 
 static void expression_statement()
 {
     expression();
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
 }
 
 static void while_statement()
 {
     int loopStart = current_chunk()->count;
-    int exitJump = 0;
+    int exitJump = 0, popped = 0;
 
+    jump_target(loopStart);
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    exitJump = emit_jump(OP_JUMP_IF_FALSE);
+    exitJump = emit_condition_jump(&popped);
 
-    emit_byte(OP_POP);
+    if (!popped) {
+        emit_op(OP_POP);
+    }
     statement();
 
     emit_loop(loopStart);
 
     patch_jump(exitJump);
-    emit_byte(OP_POP);
+    if (!popped) {
+        emit_op(OP_POP);
+    }
 }
 
 static void scope_begin()
@@ -709,11 +1589,15 @@ static void scope_begin()
 
 static void scope_end()
 {
+    Local* local = NULL;
+
     currentCompiler->scopeDepth--;
 
     while (currentCompiler->localCount > 0
         && currentCompiler->locals[currentCompiler->localCount - 1].depth > currentCompiler->scopeDepth) {
-        emit_byte(OP_POP);
+        local = &currentCompiler->locals[currentCompiler->localCount - 1];
+        emit_op(local->captured && local->assigned ? OP_CLOSE_UPVALUE : OP_POP);
+        captures_patch(currentCompiler->localCount - 1);
         currentCompiler->localCount--;
     }
 }
@@ -729,17 +1613,21 @@ static void block_statement()
 
 static void if_statement()
 {
-    int thenJump = 0, elseJump = 0;
+    int thenJump = 0, elseJump = 0, popped = 0;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    thenJump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    thenJump = emit_condition_jump(&popped);
+    if (!popped) {
+        emit_op(OP_POP);
+    }
     statement();
     elseJump = emit_jump(OP_JUMP);
     patch_jump(thenJump);
-    emit_byte(OP_POP);
+    if (!popped) {
+        emit_op(OP_POP);
+    }
 
     if (match(TOKEN_ELSE)) {
         statement();
@@ -749,7 +1637,7 @@ static void if_statement()
 
 static void for_statement()
 {
-    int loopStart = 0, exitJump = -1, bodyJump = 0, incrementStart = 0;
+    int loopStart = 0, exitJump = -1, bodyJump = 0, incrementStart = 0, popped = 0;
     scope_begin();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
@@ -762,21 +1650,25 @@ static void for_statement()
     }
 
     loopStart = current_chunk()->count;
+    jump_target(loopStart);
 
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        exitJump = emit_condition_jump(&popped);
+        if (!popped) {
+            emit_op(OP_POP);
+        }
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         bodyJump = emit_jump(OP_JUMP);
 
         incrementStart = current_chunk()->count;
+        jump_target(incrementStart);
         expression();
-        emit_byte(OP_POP);
+        emit_op(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emit_loop(loopStart);
@@ -790,7 +1682,9 @@ static void for_statement()
 
     if (exitJump != -1) {
         patch_jump(exitJump);
-        emit_byte(OP_POP);
+        if (!popped) {
+            emit_op(OP_POP);
+        }
     }
 
     scope_end();
@@ -805,9 +1699,16 @@ static void return_statement()
     if (match(TOKEN_SEMICOLON)) {
         emit_return();
     } else {
+        if (currentCompiler->type == TYPE_INITIALIZER) {
+            error("Cannot return a value from an initializer.");
+        }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte(OP_RETURN);
+        // A returned call can hand the frame over to its callee.
+        if (instruction_last(0) == OP_CALL) {
+            current_chunk()->code[currentCompiler->instructions[0]] = OP_TAIL_CALL;
+        }
+        emit_op(OP_RETURN);
     }
 }
 
@@ -832,11 +1733,17 @@ static void statement()
     }
 }
 
-static Byte identifier_constant(Node* node)
+static int identifier_global(ScanToken* token)
 {
-    Token* token = (Token*)node->data;
-    VmString* identifier = vmstring_copy(token->lexeme, strlen(token->lexeme));
-    return make_constant(object_val((VmObject*)identifier));
+    VmString* identifier = vmstring_copy(token->start, token->length);
+    int slot = vm_global_slot(identifier);
+
+    if (slot == -1) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
 static void variable_initialize()
@@ -848,28 +1755,27 @@ static void variable_initialize()
     currentCompiler->locals[currentCompiler->localCount - 1].depth = currentCompiler->scopeDepth;
 }
 
-static void variable_define(Byte variableId)
+static void variable_define(int variableId)
 {
     if (currentCompiler->scopeDepth > 0) {
         variable_initialize();
+        currentCompiler->locals[currentCompiler->localCount - 1].stored = 1;
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, variableId);
+    emit_short(OP_DEFINE_GLOBAL, variableId);
 }
 
-static int identifier_equal(Token* a, Token* b)
+static int identifier_equal(ScanToken* a, ScanToken* b)
 {
-    size_t aLength = a == NULL || a->lexeme == NULL ? 0 : strlen(a->lexeme),
-           bLength = b == NULL || b->lexeme == NULL ? 0 : strlen(b->lexeme);
-    if (aLength != bLength) {
+    if (a->length != b->length) {
         return 0;
     }
 
-    return memcmp(a->lexeme, b->lexeme, aLength) == 0;
+    return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int variable_local_resolve(VmCompiler* compiler, Token* name)
+static int variable_local_resolve(VmCompiler* compiler, ScanToken* name)
 {
     Local* local = NULL;
     int i = 0;
@@ -886,7 +1792,55 @@ static int variable_local_resolve(VmCompiler* compiler, Token* name)
     return -1;
 }
 
-static void variable_local_add(Token name)
+static int upvalue_add(VmCompiler* compiler, Byte index, Byte isLocal)
+{
+    int i, count = compiler->function->upvalueCount;
+
+    for (i = 0; i < count; i++) {
+        if (compiler->upvalues[i].index == index && compiler->upvalues[i].isLocal == isLocal) {
+            return i;
+        }
+    }
+
+    if (count == BYTE_COUNT) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->upvalues[count].index = index;
+    compiler->upvalues[count].isLocal = isLocal;
+    return compiler->function->upvalueCount++;
+}
+
+// Resolves name to a capture of an enclosing function's local. An assignment
+// marks the local, wherever it lives, as assigned.
+static int variable_upvalue_resolve(VmCompiler* compiler, ScanToken* name, int assign)
+{
+    Local* local = NULL;
+    int index;
+
+    if (compiler->enclosing == NULL) {
+        return -1;
+    }
+
+    index = variable_local_resolve(compiler->enclosing, name);
+    if (index != -1) {
+        local = &compiler->enclosing->locals[index];
+        local->captured = 1;
+        // A closure created before the local is stored must see the store.
+        local->assigned |= assign || !local->stored;
+        return upvalue_add(compiler, (Byte)index, 1);
+    }
+
+    index = variable_upvalue_resolve(compiler->enclosing, name, assign);
+    if (index != -1) {
+        return upvalue_add(compiler, (Byte)index, 0);
+    }
+
+    return -1;
+}
+
+static void variable_local_add(ScanToken name)
 {
     Local* local = NULL;
 
@@ -898,19 +1852,22 @@ static void variable_local_add(Token name)
     local = &currentCompiler->locals[currentCompiler->localCount++];
     local->name = name;
     local->depth = -1;
+    local->stored = 0;
+    local->captured = 0;
+    local->assigned = 0;
 }
 
 static void variable_declare()
 {
     Local* local = NULL;
-    Token* name = NULL;
+    ScanToken* name = NULL;
     int i = 0;
 
     if (currentCompiler->scopeDepth == 0) {
         return;
     }
 
-    name = (Token*)parser.previous->data;
+    name = &parser.previous;
     for (i = currentCompiler->localCount - 1; i >= 0; i--) {
         local = &currentCompiler->locals[i];
 
@@ -925,7 +1882,7 @@ static void variable_declare()
     variable_local_add(*name);
 }
 
-static Byte variable_parse(const char* message)
+static int variable_parse(const char* message)
 {
     consume(TOKEN_IDENTIFIER, message);
 
@@ -934,17 +1891,17 @@ static Byte variable_parse(const char* message)
         return 0;
     }
 
-    return identifier_constant(parser.previous);
+    return identifier_global(&parser.previous);
 }
 
 static void var_declaration()
 {
-    Byte global = variable_parse("Expect variable name.");
+    int global = variable_parse("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
@@ -955,7 +1912,7 @@ static void function_statement(FunctionType type)
 {
     VmCompiler compiler;
     VmFunction* function = NULL;
-    Byte paramConstant;
+    int paramConstant, i;
 
     compiler_init(&compiler, type);
     scope_begin();
@@ -980,22 +1937,104 @@ static void function_statement(FunctionType type)
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block_statement();
 
-    // Create the function object.
+    // Create the function object. Only functions that capture variables
+    // need a closure.
     function = compiler_end();
-    emit_bytes(OP_CONSTANT, make_constant(object_val((VmObject*)function)));
+    if (function->upvalueCount == 0) {
+        emit_bytes(OP_CONSTANT, make_constant(object_val((VmObject*)function)));
+        return;
+    }
+
+    emit_bytes(OP_CLOSURE, make_constant(object_val((VmObject*)function)));
+    for (i = 0; i < function->upvalueCount; i++) {
+        if (compiler.upvalues[i].isLocal) {
+            capture_site_add(current_chunk()->count, compiler.upvalues[i].index);
+            emit_byte(CAPTURE_VALUE);
+        } else {
+            emit_byte(CAPTURE_UPVALUE);
+        }
+        emit_byte(compiler.upvalues[i].index);
+    }
 }
 
 static void func_declaration()
 {
-    Byte global = variable_parse("Expect function name.");
+    int global = variable_parse("Expect function name.");
     variable_initialize();
     function_statement(TYPE_FUNCTION);
     variable_define(global);
 }
 
+static void method()
+{
+    FunctionType type = TYPE_METHOD;
+    Byte name;
+
+    consume(TOKEN_IDENTIFIER, "Expect method name.");
+    name = identifier_constant(&parser.previous);
+    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
+    }
+
+    function_statement(type);
+    emit_bytes(OP_METHOD, name);
+}
+
+static void class_declaration()
+{
+    ClassCompiler classCompiler;
+    ScanToken className, superToken;
+    int global = variable_parse("Expect class name.");
+    Byte name;
+
+    className = parser.previous;
+    name = identifier_constant(&className);
+    emit_bytes(OP_CLASS, name);
+    variable_define(global);
+
+    classCompiler.enclosing = currentClass;
+    classCompiler.hasSuperclass = 0;
+    currentClass = &classCompiler;
+
+    if (match(TOKEN_LESS)) {
+        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(0);
+        if (identifier_equal(&className, &parser.previous)) {
+            error("A class cannot inherit from itself.");
+        }
+
+        // Methods reach the superclass through a local named super in a
+        // scope around the class body.
+        scope_begin();
+        superToken = token_synthetic("super");
+        variable_local_add(superToken);
+        variable_define(0);
+
+        named_variable(&className, 0);
+        emit_op(OP_INHERIT);
+        classCompiler.hasSuperclass = 1;
+    }
+
+    named_variable(&className, 0);
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_ENDOFFILE)) {
+        method();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emit_op(OP_POP);
+
+    if (classCompiler.hasSuperclass) {
+        scope_end();
+    }
+
+    currentClass = currentClass->enclosing;
+}
+
 static void declaration()
 {
-    if (match(TOKEN_VAR)) {
+    if (match(TOKEN_CLASS)) {
+        class_declaration();
+    } else if (match(TOKEN_VAR)) {
         var_declaration();
     } else if (match(TOKEN_FUN)) {
         func_declaration();
@@ -1008,27 +2047,32 @@ static void declaration()
     }
 }
 
+void compiler_mark_roots()
+{
+    VmCompiler* compiler = currentCompiler;
+    while (compiler != NULL) {
+        gc_mark_object((VmObject*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
+
 VmFunction* compile(const char* code)
 {
     VmCompiler compiler;
     VmFunction* function = NULL;
-    Tokenization toknz = toknzr(code, 0);
-#ifdef DEBUG_PRINT_CODE
-    list_foreach(toknz.values, foreach_token);
-#endif
-    compiler_init(&compiler, TYPE_SCRIPT);
 
-    parser.last = toknz.values->last;
-    parser.current = toknz.values->head;
-    parser.previous = NULL;
+    scanner_init(&parser.scanner, code);
+    currentClass = NULL;
     parser.hadError = 0;
     parser.panicMode = 0;
+    compiler_init(&compiler, TYPE_SCRIPT);
+
+    advance();
 
     while (!match(TOKEN_ENDOFFILE)) {
         declaration();
     }
 
     function = compiler_end();
-    toknzr_destroy(toknz);
     return parser.hadError ? NULL : function;
 }
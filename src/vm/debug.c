@@ -1,10 +1,20 @@
 #include "vm/debug.h"
+#include "vm/vm.h"
 #include <stdio.h>
 
 static int instruction_simple(const char* name, int offset);
 static int instruction_constant(const char* name, Chunk* chunk, int offset);
 static int instruction_byte(const char* name, Chunk* chunk, int offset);
 static int instruction_jump(const char* name, int sign, Chunk* chunk, int offset);
+static int instruction_global(const char* name, Chunk* chunk, int offset);
+static int instruction_byte2(const char* name, Chunk* chunk, int offset);
+static int instruction_local_constant(const char* name, Chunk* chunk, int offset);
+static int instruction_closure(const char* name, Chunk* chunk, int offset);
+static int instruction_property(const char* name, Chunk* chunk, int offset);
+static int instruction_invoke(const char* name, Chunk* chunk, int offset);
+static int instruction_call(const char* name, Chunk* chunk, int offset);
+static int instruction_registers(const char* name, int constant, Chunk* chunk, int offset);
+static int instruction_register_jump(const char* name, int constant, Chunk* chunk, int offset);
 
 void chunk_disassemble(Chunk* chunk, const char* name)
 {
@@ -19,6 +29,7 @@ void chunk_disassemble(Chunk* chunk, const char* name)
 int chunk_disassemble_instruction(Chunk* chunk, int offset)
 {
     Byte instruction;
+    const char* name;
     printf("%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
         printf("   | ");
@@ -26,63 +37,141 @@ int chunk_disassemble_instruction(Chunk* chunk, int offset)
         printf("%4d ", chunk->lines[offset]);
     }
     instruction = chunk->code[offset];
+    name = opcode_name(instruction);
     switch (instruction) {
-    case OP_RETURN:
-        return instruction_simple("OP_RETURN", offset);
     case OP_CONSTANT:
-        return instruction_constant("OP_CONSTANT", chunk, offset);
-    case OP_NEGATE:
-        return instruction_simple("OP_NEGATE", offset);
-    case OP_ADD:
-        return instruction_simple("OP_ADD", offset);
-    case OP_SUBTRACT:
-        return instruction_simple("OP_SUBTRACT", offset);
-    case OP_MULTIPLY:
-        return instruction_simple("OP_MULTIPLY", offset);
-    case OP_DIVIDE:
-        return instruction_simple("OP_DIVIDE", offset);
-    case OP_NIL:
-        return instruction_simple("OP_NIL", offset);
-    case OP_TRUE:
-        return instruction_simple("OP_TRUE", offset);
-    case OP_FALSE:
-        return instruction_simple("OP_FALSE", offset);
-    case OP_NOT:
-        return instruction_simple("OP_NOT", offset);
-    case OP_EQUAL:
-        return instruction_simple("OP_EQUAL", offset);
-    case OP_GREATER:
-        return instruction_simple("OP_GREATER", offset);
-    case OP_LESS:
-        return instruction_simple("OP_LESS", offset);
-    case OP_PRINT:
-        return instruction_simple("OP_PRINT", offset);
-    case OP_POP:
-        return instruction_simple("OP_POP", offset);
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return instruction_constant(name, chunk, offset);
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return instruction_property(name, chunk, offset);
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return instruction_invoke(name, chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return instruction_constant("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return instruction_constant("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return instruction_constant("OP_SET_GLOBAL", chunk, offset);
+        return instruction_global(name, chunk, offset);
     case OP_GET_LOCAL:
-        return instruction_byte("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
-        return instruction_byte("OP_SET_LOCAL", chunk, offset);
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CONCAT_N:
+        return instruction_byte(name, chunk, offset);
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return instruction_call(name, chunk, offset);
+    case OP_CLOSURE:
+        return instruction_closure(name, chunk, offset);
     case OP_JUMP:
-        return instruction_jump("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
-        return instruction_jump("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return instruction_jump(name, 1, chunk, offset);
     case OP_LOOP:
-        return instruction_jump("OP_LOOP", -1, chunk, offset);
-    case OP_CALL:
-        return instruction_byte("OP_CALL", chunk, offset);
+        return instruction_jump(name, -1, chunk, offset);
+    case OP_GET_LOCAL2:
+        return instruction_byte2(name, chunk, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_LOAD_CONSTANT:
+        return instruction_local_constant(name, chunk, offset);
+    case OP_MOVE:
+        return instruction_byte2(name, chunk, offset);
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+        return instruction_registers(name, 0, chunk, offset);
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+        return instruction_registers(name, 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_RR:
+        return instruction_register_jump(name, 0, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_RK:
+        return instruction_register_jump(name, 1, chunk, offset);
     default:
-        printf("Unknow opcode %d\n", instruction);
-        return offset + 1;
+        if (name == NULL) {
+            printf("Unknow opcode %d\n", instruction);
+            return offset + 1;
+        }
+        return instruction_simple(name, offset);
     }
 }
 
+const char* opcode_name(Byte instruction)
+{
+    static const char* names[BYTE_COUNT] = {
+        [OP_RETURN] = "OP_RETURN",
+        [OP_CONSTANT] = "OP_CONSTANT",
+        [OP_NIL] = "OP_NIL",
+        [OP_TRUE] = "OP_TRUE",
+        [OP_FALSE] = "OP_FALSE",
+        [OP_NOT] = "OP_NOT",
+        [OP_EQUAL] = "OP_EQUAL",
+        [OP_GREATER] = "OP_GREATER",
+        [OP_LESS] = "OP_LESS",
+        [OP_NEGATE] = "OP_NEGATE",
+        [OP_ADD] = "OP_ADD",
+        [OP_SUBTRACT] = "OP_SUBTRACT",
+        [OP_MULTIPLY] = "OP_MULTIPLY",
+        [OP_DIVIDE] = "OP_DIVIDE",
+        [OP_PRINT] = "OP_PRINT",
+        [OP_JUMP] = "OP_JUMP",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_LOOP] = "OP_LOOP",
+        [OP_POP] = "OP_POP",
+        [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+        [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+        [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_SET_LOCAL] = "OP_SET_LOCAL",
+        [OP_CALL] = "OP_CALL",
+        [OP_TAIL_CALL] = "OP_TAIL_CALL",
+        [OP_CLOSURE] = "OP_CLOSURE",
+        [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+        [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+        [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+        [OP_CLASS] = "OP_CLASS",
+        [OP_INHERIT] = "OP_INHERIT",
+        [OP_METHOD] = "OP_METHOD",
+        [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+        [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+        [OP_INVOKE] = "OP_INVOKE",
+        [OP_GET_SUPER] = "OP_GET_SUPER",
+        [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+        [OP_ADD_NUM] = "OP_ADD_NUM",
+        [OP_ADD_STR] = "OP_ADD_STR",
+        [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+        [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+        [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+        [OP_GREATER_NUM] = "OP_GREATER_NUM",
+        [OP_LESS_NUM] = "OP_LESS_NUM",
+        [OP_GET_LOCAL2] = "OP_GET_LOCAL2",
+        [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+        [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+        [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+        [OP_CONCAT_N] = "OP_CONCAT_N",
+        [OP_MOVE] = "OP_MOVE",
+        [OP_LOAD_CONSTANT] = "OP_LOAD_CONSTANT",
+        [OP_ADD_RR] = "OP_ADD_RR",
+        [OP_ADD_RK] = "OP_ADD_RK",
+        [OP_SUBTRACT_RR] = "OP_SUBTRACT_RR",
+        [OP_SUBTRACT_RK] = "OP_SUBTRACT_RK",
+        [OP_MULTIPLY_RR] = "OP_MULTIPLY_RR",
+        [OP_MULTIPLY_RK] = "OP_MULTIPLY_RK",
+        [OP_DIVIDE_RR] = "OP_DIVIDE_RR",
+        [OP_DIVIDE_RK] = "OP_DIVIDE_RK",
+        [OP_JUMP_IF_NOT_LESS_RR] = "OP_JUMP_IF_NOT_LESS_RR",
+        [OP_JUMP_IF_NOT_LESS_RK] = "OP_JUMP_IF_NOT_LESS_RK",
+    };
+
+    return names[instruction];
+}
+
 static int instruction_simple(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -112,3 +201,105 @@ static int instruction_jump(const char* name, int sign, Chunk* chunk, int offset
     printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
+
+static int instruction_global(const char* name, Chunk* chunk, int offset)
+{
+    Short slot = (Short)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm.globalNames.count) {
+        value_print(vm.globalNames.values[slot]);
+    }
+    printf("'\n");
+    return offset + 3;
+}
+
+static int instruction_byte2(const char* name, Chunk* chunk, int offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static int instruction_local_constant(const char* name, Chunk* chunk, int offset)
+{
+    Byte slot = chunk->code[offset + 1];
+    Byte constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    value_print(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int instruction_closure(const char* name, Chunk* chunk, int offset)
+{
+    static const char* modes[] = { "upvalue", "value", "shared" };
+    int length = chunk_instruction_length(chunk, offset);
+    int i;
+    Byte mode;
+
+    instruction_constant(name, chunk, offset);
+    for (i = offset + 2; i < offset + length; i += 2) {
+        mode = chunk->code[i];
+        printf("%04d    |                     %s %d\n", i, mode <= CAPTURE_SHARED ? modes[mode] : "?", chunk->code[i + 1]);
+    }
+    return offset + length;
+}
+
+static int instruction_property(const char* name, Chunk* chunk, int offset)
+{
+    Byte constant = chunk->code[offset + 1];
+    int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    value_print(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 4;
+}
+
+static int instruction_invoke(const char* name, Chunk* chunk, int offset)
+{
+    Byte constant = chunk->code[offset + 1];
+    Byte argCount = chunk->code[offset + 2];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    value_print(chunk->constants.values[constant]);
+    if (chunk->code[offset] == OP_INVOKE) {
+        printf("' cache %d\n", (chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+        return offset + 5;
+    }
+    printf("'\n");
+    return offset + 3;
+}
+
+static int instruction_call(const char* name, Chunk* chunk, int offset)
+{
+    Byte argCount = chunk->code[offset + 1];
+    int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d cache %d\n", name, argCount, cache);
+    return offset + 4;
+}
+
+static int instruction_registers(const char* name, int constant, Chunk* chunk, int offset)
+{
+    Byte right = chunk->code[offset + 3];
+    printf("%-16s %4d %4d %4d", name, chunk->code[offset + 1], chunk->code[offset + 2], right);
+    if (constant) {
+        printf(" '");
+        value_print(chunk->constants.values[right]);
+        printf("'");
+    }
+    printf("\n");
+    return offset + 4;
+}
+
+static int instruction_register_jump(const char* name, int constant, Chunk* chunk, int offset)
+{
+    Byte right = chunk->code[offset + 2];
+    Short jump = (Short)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %4d %4d", name, chunk->code[offset + 1], right);
+    if (constant) {
+        printf(" '");
+        value_print(chunk->constants.values[right]);
+        printf("'");
+    }
+    printf(" -> %d\n", offset + 5 + jump);
+    return offset + 5;
+}
@@ -0,0 +1,249 @@
+#include "vm/gc.h"
+#include "mem.h"
+#include "vm/compiler.h"
+#include "vm/object.h"
+#include "vm/table.h"
+#include "vm/value.h"
+#include "vm/vm.h"
+#include <stdlib.h>
+#include <time.h>
+
+void gc_account(size_t oldSize, size_t newSize)
+{
+    vm.bytesAllocated += newSize;
+    vm.bytesAllocated -= oldSize;
+
+    if (vm.bytesAllocated > vm.gcStats.peakBytes) {
+        vm.gcStats.peakBytes = vm.bytesAllocated;
+    }
+
+    if (newSize <= oldSize) {
+        return;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    gc_collect();
+#else
+    if (vm.bytesAllocated > vm.nextGC) {
+        gc_collect();
+    }
+#endif
+
+    if (vm.maxHeap != 0 && vm.bytesAllocated > vm.maxHeap) {
+        fprintf(stderr, "Out of memory: heap limit of %zu bytes exceeded.\n", vm.maxHeap);
+        exit(70);
+    }
+}
+
+void gc_mark_object(VmObject* object)
+{
+    if (object == NULL || object->isMarked) {
+        return;
+    }
+
+    object->isMarked = 1;
+
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        // The gray stack is GC bookkeeping, so it must not go through
+        // reallocate() and recursively trigger a collection.
+        vm.grayStack = (VmObject**)realloc(vm.grayStack, sizeof(VmObject*) * vm.grayCapacity);
+        if (vm.grayStack == NULL) {
+            fprintf(stderr, "Out of memory: cannot grow the GC gray stack.\n");
+            exit(70);
+        }
+    }
+
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+void gc_mark_value(Value value)
+{
+    if (IS_OBJECT(value)) {
+        gc_mark_object(AS_OBJECT(value));
+    }
+}
+
+static void value_array_mark(ValueArray* array)
+{
+    int i;
+    for (i = 0; i < array->count; i++) {
+        gc_mark_value(array->values[i]);
+    }
+}
+
+static void object_blacken(VmObject* object)
+{
+    VmFunction* function = NULL;
+    VmClosure* closure = NULL;
+    VmClass* klass = NULL;
+    VmInstance* instance = NULL;
+    VmShape* shape = NULL;
+    InlineCacheEntry* entry = NULL;
+    int i, j;
+
+    switch (object->type) {
+    case OBJECT_FUNCTION:
+        function = (VmFunction*)object;
+        gc_mark_object((VmObject*)function->name);
+        value_array_mark(&function->chunk.constants);
+        for (i = 0; i < function->cacheCount; i++) {
+            for (j = 0; j < function->caches[i].count; j++) {
+                entry = &function->caches[i].entries[j];
+                gc_mark_object((VmObject*)entry->shape);
+                gc_mark_object((VmObject*)entry->transition);
+                gc_mark_value(entry->method);
+            }
+        }
+        for (i = 0; i < function->callCacheCount; i++) {
+            gc_mark_object(function->callCaches[i].callee);
+        }
+        break;
+    case OBJECT_CLOSURE:
+        closure = (VmClosure*)object;
+        gc_mark_object((VmObject*)closure->function);
+        for (i = 0; i < closure->captureCount; i++) {
+            gc_mark_value(closure->captures[i]);
+        }
+        break;
+    case OBJECT_UPVALUE:
+        gc_mark_value(((VmUpvalue*)object)->closed);
+        break;
+    case OBJECT_CLASS:
+        klass = (VmClass*)object;
+        gc_mark_object((VmObject*)klass->name);
+        table_mark(&klass->methods);
+        gc_mark_value(klass->initializer);
+        gc_mark_object((VmObject*)klass->shape);
+        break;
+    case OBJECT_INSTANCE:
+        instance = (VmInstance*)object;
+        gc_mark_object((VmObject*)instance->shape);
+        for (i = 0; i < instance->shape->fieldCount; i++) {
+            gc_mark_value(instance->fields[i]);
+        }
+        break;
+    case OBJECT_BOUND_METHOD:
+        gc_mark_value(((VmBoundMethod*)object)->receiver);
+        gc_mark_value(((VmBoundMethod*)object)->method);
+        break;
+    case OBJECT_SHAPE:
+        shape = (VmShape*)object;
+        gc_mark_object((VmObject*)shape->klass);
+        gc_mark_object((VmObject*)shape->parent);
+        gc_mark_object((VmObject*)shape->key);
+        gc_mark_object((VmObject*)shape->children);
+        gc_mark_object((VmObject*)shape->sibling);
+        break;
+    case OBJECT_ROPE:
+        gc_mark_object((VmObject*)((VmRope*)object)->left);
+        gc_mark_object((VmObject*)((VmRope*)object)->right);
+        break;
+    case OBJECT_STRING:
+    case OBJECT_LOOSE_STRING:
+    case OBJECT_NATIVE:
+        break;
+    }
+}
+
+static void roots_mark()
+{
+    VmUpvalue* upvalue = NULL;
+    Value* slot = NULL;
+    int i;
+
+    for (slot = vm.stack; slot < vm.stackTop; slot++) {
+        gc_mark_value(*slot);
+    }
+
+    for (i = 0; i < vm.frameCount; i++) {
+        gc_mark_object((VmObject*)vm.frames[i].function);
+        gc_mark_object((VmObject*)vm.frames[i].closure);
+    }
+
+    for (upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        gc_mark_object((VmObject*)upvalue);
+    }
+
+    table_mark(&vm.globals);
+    gc_mark_object((VmObject*)vm.initString);
+    value_array_mark(&vm.globalValues);
+    value_array_mark(&vm.globalNames);
+    compiler_mark_roots();
+}
+
+static void references_trace()
+{
+    VmObject* object = NULL;
+    while (vm.grayCount > 0) {
+        object = vm.grayStack[--vm.grayCount];
+        object_blacken(object);
+    }
+}
+
+static void sweep()
+{
+    VmObject *previous = NULL, *object = vm.objects, *unreached = NULL;
+
+    while (object != NULL) {
+        if (object->isMarked) {
+            object->isMarked = 0;
+            previous = object;
+            object = object->next;
+        } else {
+            unreached = object;
+            object = object->next;
+            if (previous != NULL) {
+                previous->next = object;
+            } else {
+                vm.objects = object;
+            }
+
+            object_free(unreached);
+        }
+    }
+}
+
+void gc_collect()
+{
+    size_t before = vm.bytesAllocated;
+    double pause = 0, start = (double)clock() / CLOCKS_PER_SEC;
+
+    roots_mark();
+    references_trace();
+    // Interned strings are weak: drop the ones nothing else refers to before
+    // their memory is released by the sweep.
+    table_remove_white(&vm.strings);
+    sweep();
+
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < GC_INITIAL_THRESHOLD) {
+        vm.nextGC = GC_INITIAL_THRESHOLD;
+    }
+    if (vm.maxHeap != 0 && vm.nextGC > vm.maxHeap) {
+        vm.nextGC = vm.maxHeap;
+    }
+
+    pause = (double)clock() / CLOCKS_PER_SEC - start;
+    vm.gcStats.collections++;
+    vm.gcStats.bytesFreed += before - vm.bytesAllocated;
+    vm.gcStats.totalPause += pause;
+    if (pause > vm.gcStats.maxPause) {
+        vm.gcStats.maxPause = pause;
+    }
+}
+
+void gc_stats_print(FILE* stream)
+{
+    double elapsed = (double)clock() / CLOCKS_PER_SEC - vm.gcStats.startTime;
+    GcStats* stats = &vm.gcStats;
+
+    fprintf(stream, "gc: %d collections, %zu bytes freed, peak heap %zu bytes, live heap %zu bytes\n",
+        stats->collections, stats->bytesFreed, stats->peakBytes, vm.bytesAllocated);
+    fprintf(stream, "gc: pause total %.3f ms, max %.3f ms, mean %.3f ms\n",
+        stats->totalPause * 1000, stats->maxPause * 1000,
+        stats->collections > 0 ? stats->totalPause * 1000 / stats->collections : 0.0);
+    fprintf(stream, "gc: %.1f%% of %.3f s run time spent collecting, %.1f MB/s reclaimed\n",
+        elapsed > 0 ? stats->totalPause * 100 / elapsed : 0.0, elapsed,
+        stats->totalPause > 0 ? stats->bytesFreed / stats->totalPause / (1024 * 1024) : 0.0);
+}
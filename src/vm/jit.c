@@ -0,0 +1,840 @@
+#include "vm/jit.h"
+#include "vm/chunk.h"
+#include "vm/vm.h"
+
+#ifdef VM_JIT
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// A copy-and-patch baseline compiler. Each instruction becomes a copy of a
+// stencil, machine code assembled ahead of time from the instructions in its
+// comments, with the fields the assembler left for undefined symbols (the
+// holes) patched with the instruction's operands. The instructions below
+// that are not worth doing inline are a call to their helper in jitHelpers.
+//
+// Generated code keeps the stack top in rbx, the frame's slots in r12, the
+// frame in r13 and &vm.stackTop in r14. All of them survive calls, so a
+// helper is called directly once rbx is stored; rbx is reloaded after it.
+// Calls and returns leave generated code, as the frames may move, and vm_run
+// enters the code of the frame on top, so the native stack never grows with
+// the Lox one.
+
+typedef enum hole_kind {
+    // 64-bit immediates.
+    HOLE_VALUE,
+    HOLE_IP,
+    HOLE_HELPER,
+    HOLE_GLOBALS,
+    HOLE_QNAN,
+    HOLE_NIL,
+    HOLE_FALSE,
+    HOLE_TRUE,
+    HOLE_UNDEFINED,
+    // A 32-bit displacement in bytes.
+    HOLE_SLOT,
+    // 32-bit displacements to a bytecode jump target and to the exit stencil.
+    HOLE_JUMP,
+    HOLE_EXIT,
+    // The opcode or ModRM byte that picks the operation.
+    HOLE_OPERATOR
+} HoleKind;
+
+typedef struct hole {
+    Short offset;
+    Byte kind;
+} Hole;
+
+#define STENCIL_HOLES_MAX 8
+
+typedef struct stencil {
+    const Byte* code;
+    Short length;
+    Byte holeCount;
+    Hole holes[STENCIL_HOLES_MAX];
+} Stencil;
+
+// Saves the registers it uses and jumps to the instruction it was asked to
+// start from. Five pushes keep the native stack aligned for helper calls.
+static const Byte entryCode[] = {
+    0x53,              // push    rbx
+    0x41, 0x54,        // push    r12
+    0x41, 0x55,        // push    r13
+    0x41, 0x56,        // push    r14
+    0x41, 0x57,        // push    r15
+    0x49, 0x89, 0xfd,  // mov     r13, rdi
+    0x49, 0x89, 0xf4,  // mov     r12, rsi
+    0x49, 0x89, 0xd6,  // mov     r14, rdx
+    0x49, 0x8b, 0x1e,  // mov     rbx, [r14]
+    0xff, 0xe1,        // jmp     rcx
+};
+static const Stencil entryStencil = { entryCode, sizeof(entryCode), 0, { { 0, 0 } } };
+
+// Every exit is through a helper, which leaves its JitStatus in eax and the
+// stack top in vm.stackTop.
+static const Byte exitCode[] = {
+    0x41, 0x5f,  // pop     r15
+    0x41, 0x5e,  // pop     r14
+    0x41, 0x5d,  // pop     r13
+    0x41, 0x5c,  // pop     r12
+    0x5b,        // pop     rbx
+    0xc3,        // ret
+};
+static const Stencil exitStencil = { exitCode, sizeof(exitCode), 0, { { 0, 0 } } };
+
+// Calls the helper of the instruction at IP. Anything but JIT_NEXT leaves.
+static const Byte helperCode[] = {
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+};
+static const Stencil helperStencil = {
+    helperCode, sizeof(helperCode), 3,
+    {
+        { 8, HOLE_IP },
+        { 18, HOLE_HELPER },
+        { 35, HOLE_EXIT }
+    }
+};
+
+// Also nil, true and false.
+static const Byte constantCode[] = {
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, VALUE
+    0x48, 0x89, 0x03,                                            // mov     [rbx], rax
+    0x48, 0x83, 0xc3, 0x08,                                      // add     rbx, 8
+};
+static const Stencil constantStencil = {
+    constantCode, sizeof(constantCode), 1,
+    {
+        { 2, HOLE_VALUE }
+    }
+};
+
+static const Byte popCode[] = {
+    0x48, 0x83, 0xeb, 0x08,  // sub     rbx, 8
+};
+static const Stencil popStencil = { popCode, sizeof(popCode), 0, { { 0, 0 } } };
+
+static const Byte getLocalCode[] = {
+    0x49, 0x8b, 0x84, 0x24, 0x00, 0x00, 0x00, 0x00,  // mov     rax, [r12 + SLOT]
+    0x48, 0x89, 0x03,                                // mov     [rbx], rax
+    0x48, 0x83, 0xc3, 0x08,                          // add     rbx, 8
+};
+static const Stencil getLocalStencil = {
+    getLocalCode, sizeof(getLocalCode), 1,
+    {
+        { 4, HOLE_SLOT }
+    }
+};
+
+static const Byte setLocalCode[] = {
+    0x48, 0x8b, 0x43, 0xf8,                          // mov     rax, [rbx - 8]
+    0x49, 0x89, 0x84, 0x24, 0x00, 0x00, 0x00, 0x00,  // mov     [r12 + SLOT], rax
+};
+static const Stencil setLocalStencil = {
+    setLocalCode, sizeof(setLocalCode), 1,
+    {
+        { 8, HOLE_SLOT }
+    }
+};
+
+// The global arrays move when globals are added, hence the load through
+// &vm.globalValues.values. Undefined globals are the helper's error.
+static const Byte getGlobalCode[] = {
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, GLOBALS
+    0x48, 0x8b, 0x00,                                            // mov     rax, [rax]
+    0x48, 0x8b, 0x80, 0x00, 0x00, 0x00, 0x00,                    // mov     rax, [rax + SLOT]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, UNDEFINED
+    0x48, 0x39, 0xc8,                                            // cmp     rax, rcx
+    0x74, 0x09,                                                  // je      slow
+    0x48, 0x89, 0x03,                                            // mov     [rbx], rax
+    0x48, 0x83, 0xc3, 0x08,                                      // add     rbx, 8
+    0xeb, 0x27,                                                  // jmp     done
+    // slow:
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    // done:
+};
+static const Stencil getGlobalStencil = {
+    getGlobalCode, sizeof(getGlobalCode), 6,
+    {
+        { 2, HOLE_GLOBALS },
+        { 16, HOLE_SLOT },
+        { 22, HOLE_UNDEFINED },
+        { 52, HOLE_IP },
+        { 62, HOLE_HELPER },
+        { 79, HOLE_EXIT }
+    }
+};
+
+static const Byte setGlobalCode[] = {
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, GLOBALS
+    0x48, 0x8b, 0x00,                                            // mov     rax, [rax]
+    0x48, 0x8d, 0x80, 0x00, 0x00, 0x00, 0x00,                    // lea     rax, [rax + SLOT]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, UNDEFINED
+    0x48, 0x39, 0x08,                                            // cmp     [rax], rcx
+    0x74, 0x09,                                                  // je      slow
+    0x48, 0x8b, 0x4b, 0xf8,                                      // mov     rcx, [rbx - 8]
+    0x48, 0x89, 0x08,                                            // mov     [rax], rcx
+    0xeb, 0x27,                                                  // jmp     done
+    // slow:
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    // done:
+};
+static const Stencil setGlobalStencil = {
+    setGlobalCode, sizeof(setGlobalCode), 6,
+    {
+        { 2, HOLE_GLOBALS },
+        { 16, HOLE_SLOT },
+        { 22, HOLE_UNDEFINED },
+        { 52, HOLE_IP },
+        { 62, HOLE_HELPER },
+        { 79, HOLE_EXIT }
+    }
+};
+
+// Two numbers are added, subtracted, multiplied or divided by the SSE2
+// instruction in OPERATOR. Anything else is left to the helper.
+static const Byte arithmeticCode[] = {
+    0x48, 0x8b, 0x43, 0xf0,                                      // mov     rax, [rbx - 16]
+    0x48, 0x8b, 0x53, 0xf8,                                      // mov     rdx, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, QNAN
+    0x48, 0x89, 0xc6,                                            // mov     rsi, rax
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x24,                                                  // je      slow
+    0x48, 0x89, 0xd6,                                            // mov     rsi, rdx
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x19,                                                  // je      slow
+    0x66, 0x48, 0x0f, 0x6e, 0xc0,                                // movq    xmm0, rax
+    0x66, 0x48, 0x0f, 0x6e, 0xca,                                // movq    xmm1, rdx
+    0xf2, 0x0f, 0x58, 0xc1,                                      // addsd   xmm0, xmm1
+    0x66, 0x0f, 0xd6, 0x43, 0xf0,                                // movq    [rbx - 16], xmm0
+    0x48, 0x83, 0xeb, 0x08,                                      // sub     rbx, 8
+    0xeb, 0x27,                                                  // jmp     done
+    // slow:
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    // done:
+};
+static const Stencil arithmeticStencil = {
+    arithmeticCode, sizeof(arithmeticCode), 5,
+    {
+        { 10, HOLE_QNAN },
+        { 52, HOLE_OPERATOR },
+        { 73, HOLE_IP },
+        { 83, HOLE_HELPER },
+        { 100, HOLE_EXIT }
+    }
+};
+
+// ucomisd with the operands in either order, so that cmova answers both >
+// and <. Unordered operands (NaN) give false.
+static const Byte compareCode[] = {
+    0x48, 0x8b, 0x43, 0xf0,                                      // mov     rax, [rbx - 16]
+    0x48, 0x8b, 0x53, 0xf8,                                      // mov     rdx, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, QNAN
+    0x48, 0x89, 0xc6,                                            // mov     rsi, rax
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x3b,                                                  // je      slow
+    0x48, 0x89, 0xd6,                                            // mov     rsi, rdx
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x30,                                                  // je      slow
+    0x66, 0x48, 0x0f, 0x6e, 0xc0,                                // movq    xmm0, rax
+    0x66, 0x48, 0x0f, 0x6e, 0xca,                                // movq    xmm1, rdx
+    0x66, 0x0f, 0x2e, 0xc1,                                      // ucomisd xmm0, xmm1
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, FALSE
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, TRUE
+    0x48, 0x0f, 0x47, 0xc1,                                      // cmova   rax, rcx
+    0x48, 0x89, 0x43, 0xf0,                                      // mov     [rbx - 16], rax
+    0x48, 0x83, 0xeb, 0x08,                                      // sub     rbx, 8
+    0xeb, 0x27,                                                  // jmp     done
+    // slow:
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    // done:
+};
+static const Stencil compareStencil = {
+    compareCode, sizeof(compareCode), 7,
+    {
+        { 10, HOLE_QNAN },
+        { 53, HOLE_OPERATOR },
+        { 56, HOLE_FALSE },
+        { 66, HOLE_TRUE },
+        { 96, HOLE_IP },
+        { 106, HOLE_HELPER },
+        { 123, HOLE_EXIT }
+    }
+};
+
+// Numbers compare as doubles and other values by their bits. Values whose
+// bits differ go to the helper, since a rope equals a different string.
+static const Byte equalCode[] = {
+    0x48, 0x8b, 0x43, 0xf0,                                      // mov     rax, [rbx - 16]
+    0x48, 0x8b, 0x53, 0xf8,                                      // mov     rdx, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, QNAN
+    0x48, 0x89, 0xc6,                                            // mov     rsi, rax
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x36,                                                  // je      slow
+    0x48, 0x89, 0xd6,                                            // mov     rsi, rdx
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x2b,                                                  // je      slow
+    0x66, 0x48, 0x0f, 0x6e, 0xc0,                                // movq    xmm0, rax
+    0x66, 0x48, 0x0f, 0x6e, 0xca,                                // movq    xmm1, rdx
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, FALSE
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, TRUE
+    0x66, 0x0f, 0x2e, 0xc1,                                      // ucomisd xmm0, xmm1
+    0x75, 0x3f,                                                  // jne     store
+    0x7a, 0x3d,                                                  // jp      store
+    0x48, 0x89, 0xc8,                                            // mov     rax, rcx
+    0xeb, 0x38,                                                  // jmp     store
+    // slow:
+    0x48, 0x39, 0xd0,                                            // cmp     rax, rdx
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, TRUE
+    0x74, 0x29,                                                  // je      store
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    0xeb, 0x08,                                                  // jmp     done
+    // store:
+    0x48, 0x89, 0x43, 0xf0,                                      // mov     [rbx - 16], rax
+    0x48, 0x83, 0xeb, 0x08,                                      // sub     rbx, 8
+    // done:
+};
+static const Stencil equalStencil = {
+    equalCode, sizeof(equalCode), 7,
+    {
+        { 10, HOLE_QNAN },
+        { 52, HOLE_FALSE },
+        { 62, HOLE_TRUE },
+        { 88, HOLE_TRUE },
+        { 106, HOLE_IP },
+        { 116, HOLE_HELPER },
+        { 133, HOLE_EXIT }
+    }
+};
+
+static const Byte notCode[] = {
+    0x48, 0x8b, 0x43, 0xf8,                                      // mov     rax, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, NIL
+    0x48, 0x39, 0xc8,                                            // cmp     rax, rcx
+    0x74, 0x1b,                                                  // je      slow
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, FALSE
+    0x48, 0x39, 0xc8,                                            // cmp     rax, rcx
+    0x74, 0x0c,                                                  // je      slow
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, FALSE
+    0xeb, 0x0a,                                                  // jmp     done
+    // slow:
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, TRUE
+    // done:
+    0x48, 0x89, 0x43, 0xf8,                                      // mov     [rbx - 8], rax
+};
+static const Stencil notStencil = {
+    notCode, sizeof(notCode), 4,
+    {
+        { 6, HOLE_NIL },
+        { 21, HOLE_FALSE },
+        { 36, HOLE_FALSE },
+        { 48, HOLE_TRUE }
+    }
+};
+
+static const Byte negateCode[] = {
+    0x48, 0x8b, 0x43, 0xf8,                                      // mov     rax, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, QNAN
+    0x48, 0x89, 0xc6,                                            // mov     rsi, rax
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x0b,                                                  // je      slow
+    0x48, 0x0f, 0xba, 0xf8, 0x3f,                                // btc     rax, 63
+    0x48, 0x89, 0x43, 0xf8,                                      // mov     [rbx - 8], rax
+    0xeb, 0x27,                                                  // jmp     done
+    // slow:
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    // done:
+};
+static const Stencil negateStencil = {
+    negateCode, sizeof(negateCode), 4,
+    {
+        { 6, HOLE_QNAN },
+        { 44, HOLE_IP },
+        { 54, HOLE_HELPER },
+        { 71, HOLE_EXIT }
+    }
+};
+
+// Also OP_LOOP.
+static const Byte jumpCode[] = {
+    0xe9, 0x00, 0x00, 0x00, 0x00,  // jmp     JUMP
+};
+static const Stencil jumpStencil = {
+    jumpCode, sizeof(jumpCode), 1,
+    {
+        { 1, HOLE_JUMP }
+    }
+};
+
+static const Byte jumpIfFalseCode[] = {
+    0x48, 0x8b, 0x43, 0xf8,                                      // mov     rax, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, NIL
+    0x48, 0x39, 0xc8,                                            // cmp     rax, rcx
+    0x0f, 0x84, 0x00, 0x00, 0x00, 0x00,                          // je      JUMP
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, FALSE
+    0x48, 0x39, 0xc8,                                            // cmp     rax, rcx
+    0x0f, 0x84, 0x00, 0x00, 0x00, 0x00,                          // je      JUMP
+};
+static const Stencil jumpIfFalseStencil = {
+    jumpIfFalseCode, sizeof(jumpIfFalseCode), 4,
+    {
+        { 6, HOLE_NIL },
+        { 19, HOLE_JUMP },
+        { 25, HOLE_FALSE },
+        { 38, HOLE_JUMP }
+    }
+};
+
+static const Byte jumpIfNotLessCode[] = {
+    0x48, 0x8b, 0x43, 0xf0,                                      // mov     rax, [rbx - 16]
+    0x48, 0x8b, 0x53, 0xf8,                                      // mov     rdx, [rbx - 8]
+    0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rcx, QNAN
+    0x48, 0x89, 0xc6,                                            // mov     rsi, rax
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x25,                                                  // je      slow
+    0x48, 0x89, 0xd6,                                            // mov     rsi, rdx
+    0x48, 0x21, 0xce,                                            // and     rsi, rcx
+    0x48, 0x39, 0xce,                                            // cmp     rsi, rcx
+    0x74, 0x1a,                                                  // je      slow
+    0x48, 0x83, 0xeb, 0x10,                                      // sub     rbx, 16
+    0x66, 0x48, 0x0f, 0x6e, 0xc0,                                // movq    xmm0, rax
+    0x66, 0x48, 0x0f, 0x6e, 0xca,                                // movq    xmm1, rdx
+    0x66, 0x0f, 0x2e, 0xc8,                                      // ucomisd xmm1, xmm0
+    0x0f, 0x86, 0x00, 0x00, 0x00, 0x00,                          // jbe     JUMP
+    0xeb, 0x27,                                                  // jmp     done
+    // slow:
+    0x49, 0x89, 0x1e,                                            // mov     [r14], rbx
+    0x4c, 0x89, 0xef,                                            // mov     rdi, r13
+    0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rsi, IP
+    0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // movabs  rax, HELPER
+    0xff, 0xd0,                                                  // call    rax
+    0x49, 0x8b, 0x1e,                                            // mov     rbx, [r14]
+    0x85, 0xc0,                                                  // test    eax, eax
+    0x0f, 0x85, 0x00, 0x00, 0x00, 0x00,                          // jnz     EXIT
+    // done:
+};
+static const Stencil jumpIfNotLessStencil = {
+    jumpIfNotLessCode, sizeof(jumpIfNotLessCode), 5,
+    {
+        { 10, HOLE_QNAN },
+        { 60, HOLE_JUMP },
+        { 74, HOLE_IP },
+        { 84, HOLE_HELPER },
+        { 101, HOLE_EXIT }
+    }
+};
+
+// Generated code for one function. entries maps the offset of every
+// instruction in the chunk to its code, and is -1 inside instructions.
+struct jit_code {
+    Byte* code;
+    size_t size;
+    int* entries;
+};
+
+typedef int (*JitEntry)(CallFrame* frame, Value* slots, Value** stackTop, Byte* target);
+
+#define SSE_ADDSD 0x58
+#define SSE_SUBSD 0x5c
+#define SSE_MULSD 0x59
+#define SSE_DIVSD 0x5e
+// ucomisd xmm0, xmm1 and ucomisd xmm1, xmm0, with the left operand in xmm0.
+#define UCOMISD_LEFT_RIGHT 0xc1
+#define UCOMISD_RIGHT_LEFT 0xc8
+
+// What the holes of one stencil copy are patched with.
+typedef struct patch {
+    Value value;
+    int slot;
+    Byte operator;
+    Byte* ip;
+    JitHelper helper;
+    int target;
+} Patch;
+
+typedef struct jump_fixup {
+    size_t position;
+    int target;
+} JumpFixup;
+
+typedef struct jit_buffer {
+    Byte* code;
+    size_t count;
+    size_t capacity;
+    JumpFixup* jumps;
+    int jumpCount;
+    int jumpCapacity;
+} JitBuffer;
+
+static void patch_64(Byte* at, uint64_t value)
+{
+    memcpy(at, &value, sizeof(uint64_t));
+}
+
+static void patch_32(Byte* at, int32_t value)
+{
+    memcpy(at, &value, sizeof(int32_t));
+}
+
+static int jump_add(JitBuffer* buffer, size_t position, int target)
+{
+    JumpFixup* jumps = NULL;
+
+    if (buffer->jumpCount == buffer->jumpCapacity) {
+        buffer->jumpCapacity = GROW_CAPACITY(buffer->jumpCapacity);
+        jumps = (JumpFixup*)realloc(buffer->jumps, sizeof(JumpFixup) * buffer->jumpCapacity);
+        if (jumps == NULL) {
+            return 0;
+        }
+        buffer->jumps = jumps;
+    }
+
+    buffer->jumps[buffer->jumpCount].position = position;
+    buffer->jumps[buffer->jumpCount].target = target;
+    buffer->jumpCount++;
+    return 1;
+}
+
+static int stencil_emit(JitBuffer* buffer, const Stencil* stencil, const Patch* patch)
+{
+    Byte *at = NULL, *code = NULL;
+    size_t position;
+    int i;
+
+    if (buffer->count + stencil->length > buffer->capacity) {
+        buffer->capacity = GROW_CAPACITY(buffer->capacity + stencil->length);
+        code = (Byte*)realloc(buffer->code, buffer->capacity);
+        if (code == NULL) {
+            return 0;
+        }
+        buffer->code = code;
+    }
+
+    at = buffer->code + buffer->count;
+    memcpy(at, stencil->code, stencil->length);
+    for (i = 0; i < stencil->holeCount; i++) {
+        position = buffer->count + stencil->holes[i].offset;
+        switch (stencil->holes[i].kind) {
+        case HOLE_VALUE:
+            patch_64(buffer->code + position, (uint64_t)patch->value);
+            break;
+        case HOLE_IP:
+            patch_64(buffer->code + position, (uint64_t)(uintptr_t)patch->ip);
+            break;
+        case HOLE_HELPER:
+            patch_64(buffer->code + position, (uint64_t)(uintptr_t)patch->helper);
+            break;
+        case HOLE_GLOBALS:
+            patch_64(buffer->code + position, (uint64_t)(uintptr_t)&vm.globalValues.values);
+            break;
+        case HOLE_QNAN:
+            patch_64(buffer->code + position, VALUE_QNAN);
+            break;
+        case HOLE_NIL:
+            patch_64(buffer->code + position, VALUE_NIL);
+            break;
+        case HOLE_FALSE:
+            patch_64(buffer->code + position, VALUE_FALSE);
+            break;
+        case HOLE_TRUE:
+            patch_64(buffer->code + position, VALUE_TRUE);
+            break;
+        case HOLE_UNDEFINED:
+            patch_64(buffer->code + position, VALUE_UNDEFINED);
+            break;
+        case HOLE_SLOT:
+            patch_32(buffer->code + position, patch->slot);
+            break;
+        case HOLE_JUMP:
+            // Targets ahead are not emitted yet; every jump is patched last.
+            if (!jump_add(buffer, position, patch->target)) {
+                return 0;
+            }
+            break;
+        case HOLE_EXIT:
+            patch_32(buffer->code + position, (int32_t)entryStencil.length - (int32_t)(position + 4));
+            break;
+        case HOLE_OPERATOR:
+            buffer->code[position] = patch->operator;
+            break;
+        }
+    }
+
+    buffer->count += stencil->length;
+    return 1;
+}
+
+static int arithmetic_emit(JitBuffer* buffer, Patch* patch, Byte operator, OpCode generic)
+{
+    patch->operator = operator;
+    patch->helper = jitHelpers[generic];
+    return stencil_emit(buffer, &arithmeticStencil, patch);
+}
+
+static int compare_emit(JitBuffer* buffer, Patch* patch, Byte operator, OpCode generic)
+{
+    patch->operator = operator;
+    patch->helper = jitHelpers[generic];
+    return stencil_emit(buffer, &compareStencil, patch);
+}
+
+static int local_emit(JitBuffer* buffer, Patch* patch, const Stencil* stencil, Byte slot)
+{
+    patch->slot = (int)(slot * sizeof(Value));
+    return stencil_emit(buffer, stencil, patch);
+}
+
+static int constant_emit(JitBuffer* buffer, Patch* patch, Value value)
+{
+    patch->value = value;
+    return stencil_emit(buffer, &constantStencil, patch);
+}
+
+#define OPERAND_SHORT(ip) ((Short)(((ip)[1] << 8) | (ip)[2]))
+
+// Quickened instructions compile like their generic forms: the stencils
+// check the operand types themselves.
+static int instruction_emit(JitBuffer* buffer, Chunk* chunk, int offset)
+{
+    Byte* ip = chunk->code + offset;
+    Value* constants = chunk->constants.values;
+    Patch patch;
+
+    memset(&patch, 0, sizeof(Patch));
+    patch.ip = ip;
+    patch.helper = jitHelpers[*ip];
+
+    switch (*ip) {
+    case OP_CONSTANT:
+        return constant_emit(buffer, &patch, constants[ip[1]]);
+    case OP_NIL:
+        return constant_emit(buffer, &patch, nil_val());
+    case OP_TRUE:
+        return constant_emit(buffer, &patch, bool_val(1));
+    case OP_FALSE:
+        return constant_emit(buffer, &patch, bool_val(0));
+    case OP_POP:
+        return stencil_emit(buffer, &popStencil, &patch);
+    case OP_GET_LOCAL:
+        return local_emit(buffer, &patch, &getLocalStencil, ip[1]);
+    case OP_SET_LOCAL:
+        return local_emit(buffer, &patch, &setLocalStencil, ip[1]);
+    case OP_GET_LOCAL2:
+        return local_emit(buffer, &patch, &getLocalStencil, ip[1])
+            && local_emit(buffer, &patch, &getLocalStencil, ip[2]);
+    case OP_GET_GLOBAL:
+        patch.slot = (int)(OPERAND_SHORT(ip) * sizeof(Value));
+        return stencil_emit(buffer, &getGlobalStencil, &patch);
+    case OP_SET_GLOBAL:
+        patch.slot = (int)(OPERAND_SHORT(ip) * sizeof(Value));
+        return stencil_emit(buffer, &setGlobalStencil, &patch);
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        return arithmetic_emit(buffer, &patch, SSE_ADDSD, OP_ADD);
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+        return arithmetic_emit(buffer, &patch, SSE_SUBSD, OP_SUBTRACT);
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+        return arithmetic_emit(buffer, &patch, SSE_MULSD, OP_MULTIPLY);
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        return arithmetic_emit(buffer, &patch, SSE_DIVSD, OP_DIVIDE);
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        return compare_emit(buffer, &patch, UCOMISD_LEFT_RIGHT, OP_GREATER);
+    case OP_LESS:
+    case OP_LESS_NUM:
+        return compare_emit(buffer, &patch, UCOMISD_RIGHT_LEFT, OP_LESS);
+    case OP_EQUAL:
+        return stencil_emit(buffer, &equalStencil, &patch);
+    case OP_NOT:
+        return stencil_emit(buffer, &notStencil, &patch);
+    case OP_NEGATE:
+        return stencil_emit(buffer, &negateStencil, &patch);
+    case OP_JUMP:
+        patch.target = offset + 3 + OPERAND_SHORT(ip);
+        return stencil_emit(buffer, &jumpStencil, &patch);
+    case OP_LOOP:
+        patch.target = offset + 3 - OPERAND_SHORT(ip);
+        return stencil_emit(buffer, &jumpStencil, &patch);
+    case OP_JUMP_IF_FALSE:
+        patch.target = offset + 3 + OPERAND_SHORT(ip);
+        return stencil_emit(buffer, &jumpIfFalseStencil, &patch);
+    case OP_JUMP_IF_NOT_LESS:
+        patch.target = offset + 3 + OPERAND_SHORT(ip);
+        return stencil_emit(buffer, &jumpIfNotLessStencil, &patch);
+    case OP_ADD_LOCAL_CONSTANT:
+        return local_emit(buffer, &patch, &getLocalStencil, ip[1])
+            && constant_emit(buffer, &patch, constants[ip[2]])
+            && arithmetic_emit(buffer, &patch, SSE_ADDSD, OP_ADD);
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return local_emit(buffer, &patch, &getLocalStencil, ip[1])
+            && constant_emit(buffer, &patch, constants[ip[2]])
+            && arithmetic_emit(buffer, &patch, SSE_SUBSD, OP_SUBTRACT);
+    default:
+        return patch.helper != NULL && stencil_emit(buffer, &helperStencil, &patch);
+    }
+}
+
+#undef OPERAND_SHORT
+
+static int jumps_patch(JitBuffer* buffer, const int* entries, int count)
+{
+    int i, target;
+    size_t position;
+
+    for (i = 0; i < buffer->jumpCount; i++) {
+        target = buffer->jumps[i].target;
+        position = buffer->jumps[i].position;
+        if (target < 0 || target >= count || entries[target] == -1) {
+            return 0;
+        }
+        patch_32(buffer->code + position, (int32_t)entries[target] - (int32_t)(position + 4));
+    }
+
+    return 1;
+}
+
+// Copies the code into pages that are made executable once written.
+Byte* jit_install(const Byte* code, size_t size)
+{
+    Byte* pages = (Byte*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (pages == MAP_FAILED) {
+        return NULL;
+    }
+
+    memcpy(pages, code, size);
+    if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(pages, size);
+        return NULL;
+    }
+
+    return pages;
+}
+
+// Returns 0 and leaves the function to the interpreter when it uses an
+// instruction without a stencil or helper, or when memory runs out.
+int jit_compile(VmFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    JitBuffer buffer;
+    JitCode* jit = NULL;
+    int* entries = (int*)malloc(sizeof(int) * chunk->count);
+    Byte* code = NULL;
+    int offset, ok;
+
+    memset(&buffer, 0, sizeof(JitBuffer));
+    ok = entries != NULL
+        && stencil_emit(&buffer, &entryStencil, NULL)
+        && stencil_emit(&buffer, &exitStencil, NULL);
+    for (offset = 0; ok && offset < chunk->count; offset++) {
+        entries[offset] = -1;
+    }
+    for (offset = 0; ok && offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+        entries[offset] = (int)buffer.count;
+        ok = instruction_emit(&buffer, chunk, offset);
+    }
+
+    ok = ok && jumps_patch(&buffer, entries, chunk->count);
+    code = ok ? jit_install(buffer.code, buffer.count) : NULL;
+    jit = code != NULL ? (JitCode*)malloc(sizeof(JitCode)) : NULL;
+    if (jit != NULL) {
+        jit->code = code;
+        jit->size = buffer.count;
+        jit->entries = entries;
+        function->jit = jit;
+    } else {
+        if (code != NULL) {
+            munmap(code, buffer.count);
+        }
+        free(entries);
+    }
+
+    free(buffer.code);
+    free(buffer.jumps);
+    return jit != NULL;
+}
+
+// Runs generated code from the frame's ip until it leaves the frame or
+// fails.
+JitStatus jit_run(CallFrame* frame)
+{
+    JitCode* jit = frame->function->jit;
+    JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+    Byte* target = jit->code + jit->entries[frame->ip - frame->function->chunk.code];
+
+    return (JitStatus)entry(frame, frame->slots, &vm.stackTop, target);
+}
+
+void jit_free(VmFunction* function)
+{
+    if (function->jit == NULL) {
+        return;
+    }
+
+    munmap(function->jit->code, function->jit->size);
+    free(function->jit->entries);
+    free(function->jit);
+    function->jit = NULL;
+}
+#endif
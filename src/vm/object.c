@@ -0,0 +1,98 @@
+#include "vm/object.h"
+#include "mem.h"
+#include "vm/compiler.h"
+#include "vm/vm.h"
+
+static VmShape* vmshape_new(VmClass* klass, VmShape* parent, VmString* key)
+{
+    VmShape* shape = ALLOC_OBJECT(VmShape, OBJECT_SHAPE);
+    shape->klass = klass;
+    shape->parent = parent;
+    shape->key = key;
+    shape->fieldCount = parent != NULL ? parent->fieldCount + 1 : 0;
+    shape->children = NULL;
+    shape->sibling = NULL;
+    return shape;
+}
+
+VmClass* vmclass_new(VmString* name)
+{
+    VmClass* klass = ALLOC_OBJECT(VmClass, OBJECT_CLASS);
+    klass->name = name;
+    table_init(&klass->methods);
+    klass->initializer = nil_val();
+    klass->shape = NULL;
+
+    vm_stack_push(object_val((VmObject*)klass));
+    klass->shape = vmshape_new(klass, NULL, NULL);
+    vm_stack_pop();
+    return klass;
+}
+
+VmInstance* vminstance_new(VmClass* klass)
+{
+    VmInstance* instance = ALLOC_OBJECT(VmInstance, OBJECT_INSTANCE);
+    instance->shape = klass->shape;
+    instance->fields = NULL;
+    instance->capacity = 0;
+    return instance;
+}
+
+VmBoundMethod* vmboundmethod_new(Value receiver, Value method)
+{
+    VmBoundMethod* bound = ALLOC_OBJECT(VmBoundMethod, OBJECT_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
+// Returns the index of key in the fields of shape, or -1.
+int shape_field_index(VmShape* shape, VmString* key)
+{
+    for (; shape->key != NULL; shape = shape->parent) {
+        if (shape->key == key) {
+            return shape->fieldCount - 1;
+        }
+    }
+
+    return -1;
+}
+
+// Returns the shape that adds key to shape, creating it on first use. The
+// caller keeps shape reachable, which keeps the new shape reachable.
+VmShape* shape_transition(VmShape* shape, VmString* key)
+{
+    VmShape* child = NULL;
+
+    for (child = shape->children; child != NULL; child = child->sibling) {
+        if (child->key == key) {
+            return child;
+        }
+    }
+
+    child = vmshape_new(shape->klass, shape, key);
+    child->sibling = shape->children;
+    shape->children = child;
+    return child;
+}
+
+void instance_fields_reserve(VmInstance* instance, int count)
+{
+    int oldCapacity = instance->capacity;
+    int capacity = oldCapacity;
+    int i;
+
+    if (count <= oldCapacity) {
+        return;
+    }
+
+    while (capacity < count) {
+        capacity = capacity < 4 ? 4 : capacity * 2;
+    }
+
+    instance->fields = GROW_ARRAY(instance->fields, Value, oldCapacity, capacity);
+    for (i = oldCapacity; i < capacity; i++) {
+        instance->fields[i] = nil_val();
+    }
+    instance->capacity = capacity;
+}
@@ -0,0 +1,235 @@
+#include "vm/peephole.h"
+#include "mem.h"
+#include "vm/chunk.h"
+#include <string.h>
+
+// A jump is followed through at most this many others, which also ends
+// cycles of jumps.
+#define THREAD_MAX 16
+// Every jump the compiler emits is an opcode and a 16-bit offset.
+#define JUMP_LENGTH 3
+
+typedef struct peephole {
+    Chunk* chunk;
+    // Per offset of the original code, set at instruction starts.
+    Byte* reachable;
+    Byte* targets;
+    Byte* kept;
+} Peephole;
+
+// Whether the instruction only pushes a value and cannot fail.
+static int instruction_pure(Byte instruction)
+{
+    switch (instruction) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Whether control never falls through to the next instruction.
+static int instruction_ends(Byte instruction)
+{
+    return instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN;
+}
+
+// Points the jump at offset past the jumps it lands on. An unconditional
+// jump may turn into a loop or back. A conditional one only goes forward,
+// and goes on through a second OP_JUMP_IF_FALSE, which tests the same value.
+static void jump_thread(Chunk* chunk, int offset)
+{
+    Byte instruction = chunk->code[offset];
+    int conditional = instruction != OP_JUMP && instruction != OP_LOOP;
+    int target = chunk_jump_target(chunk, offset);
+    int next, i, distance;
+
+    for (i = 0; i < THREAD_MAX && target < chunk->count; i++) {
+        switch (chunk->code[target]) {
+        case OP_JUMP:
+            next = chunk_jump_target(chunk, target);
+            break;
+        case OP_LOOP:
+            next = conditional ? -1 : chunk_jump_target(chunk, target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            next = instruction == OP_JUMP_IF_FALSE ? chunk_jump_target(chunk, target) : -1;
+            break;
+        default:
+            next = -1;
+        }
+
+        if (next < 0 || (conditional && next <= offset)) {
+            break;
+        }
+        target = next;
+    }
+
+    if (!conditional) {
+        instruction = target >= offset + JUMP_LENGTH ? OP_JUMP : OP_LOOP;
+    }
+    distance = target - (offset + JUMP_LENGTH);
+    distance = distance < 0 ? -distance : distance;
+    if (distance > SHORT_MAX) {
+        return;
+    }
+
+    chunk->code[offset] = instruction;
+    chunk->code[offset + 1] = (distance >> 8) & 0xff;
+    chunk->code[offset + 2] = distance & 0xff;
+}
+
+// Marks the instructions control can reach from the start, and where the
+// jumps among them land.
+static void reachable_mark(Peephole* peephole)
+{
+    Chunk* chunk = peephole->chunk;
+    int* work = ALLOCATE(int, chunk->count);
+    int count = 0, offset, next, target;
+
+    peephole->reachable[0] = 1;
+    work[count++] = 0;
+    while (count > 0) {
+        offset = work[--count];
+        next = offset + chunk_instruction_length(chunk, offset);
+        target = chunk_jump_target(chunk, offset);
+        if (target >= 0 && target < chunk->count) {
+            peephole->targets[target] = 1;
+            if (!peephole->reachable[target]) {
+                peephole->reachable[target] = 1;
+                work[count++] = target;
+            }
+        }
+        if (!instruction_ends(chunk->code[offset]) && next < chunk->count && !peephole->reachable[next]) {
+            peephole->reachable[next] = 1;
+            work[count++] = next;
+        }
+    }
+
+    FREE_ARRAY(int, work, chunk->count);
+}
+
+// Whether no kept instruction lies between the jump at offset and its target.
+static int jump_empty(Peephole* peephole, int offset)
+{
+    Chunk* chunk = peephole->chunk;
+    int target = chunk_jump_target(chunk, offset);
+    int next;
+
+    if (target < offset) {
+        return 0;
+    }
+    for (next = offset + JUMP_LENGTH; next < target; next += chunk_instruction_length(chunk, next)) {
+        if (peephole->kept[next]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Decides which reachable instructions stay: a pure push and the pop right
+// after it go, unless a jump lands on the pop, and so do jumps to the next
+// instruction that stays.
+static void kept_mark(Peephole* peephole)
+{
+    Chunk* chunk = peephole->chunk;
+    int offset, next;
+
+    for (offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+        peephole->kept[offset] = peephole->reachable[offset];
+    }
+
+    for (offset = 0; offset < chunk->count; offset = next) {
+        next = offset + chunk_instruction_length(chunk, offset);
+        if (peephole->kept[offset] && instruction_pure(chunk->code[offset]) && next < chunk->count
+            && chunk->code[next] == OP_POP && !peephole->targets[next]) {
+            peephole->kept[offset] = 0;
+            peephole->kept[next] = 0;
+        }
+    }
+
+    for (offset = chunk->count - 1; offset >= 0; offset--) {
+        if (peephole->kept[offset] && (chunk->code[offset] == OP_JUMP || chunk->code[offset] == OP_JUMP_IF_FALSE)
+            && jump_empty(peephole, offset)) {
+            peephole->kept[offset] = 0;
+        }
+    }
+}
+
+// Copies the kept instructions down over the others and points the jumps
+// at where their targets moved.
+static void chunk_compact(Peephole* peephole)
+{
+    Chunk* chunk = peephole->chunk;
+    int* offsets = ALLOCATE(int, chunk->count + 1);
+    int count = 0, offset, length, target, distance;
+
+    for (offset = 0; offset < chunk->count; offset += length) {
+        length = chunk_instruction_length(chunk, offset);
+        offsets[offset] = count;
+        if (peephole->kept[offset]) {
+            count += length;
+        }
+    }
+    offsets[chunk->count] = count;
+
+    count = 0;
+    for (offset = 0; offset < chunk->count; offset += length) {
+        length = chunk_instruction_length(chunk, offset);
+        if (!peephole->kept[offset]) {
+            continue;
+        }
+
+        target = chunk_jump_target(chunk, offset);
+        memmove(chunk->code + count, chunk->code + offset, length);
+        memmove(chunk->lines + count, chunk->lines + offset, length * sizeof(int));
+        if (target >= 0) {
+            distance = offsets[target] - (count + length);
+            distance = distance < 0 ? -distance : distance;
+            chunk->code[count + length - 2] = (distance >> 8) & 0xff;
+            chunk->code[count + length - 1] = distance & 0xff;
+        }
+        count += length;
+    }
+
+    FREE_ARRAY(int, offsets, chunk->count + 1);
+    chunk->count = count;
+}
+
+void peephole_optimize(Chunk* chunk)
+{
+    Peephole peephole;
+    int count = chunk->count;
+    int offset;
+
+    if (count == 0) {
+        return;
+    }
+
+    for (offset = 0; offset < count; offset += chunk_instruction_length(chunk, offset)) {
+        if (chunk_jump_target(chunk, offset) >= 0) {
+            jump_thread(chunk, offset);
+        }
+    }
+
+    peephole.chunk = chunk;
+    peephole.reachable = ALLOCATE(Byte, count);
+    peephole.targets = ALLOCATE(Byte, count);
+    peephole.kept = ALLOCATE(Byte, count);
+    memset(peephole.reachable, 0, count);
+    memset(peephole.targets, 0, count);
+    memset(peephole.kept, 0, count);
+
+    reachable_mark(&peephole);
+    kept_mark(&peephole);
+    chunk_compact(&peephole);
+
+    FREE_ARRAY(Byte, peephole.reachable, count);
+    FREE_ARRAY(Byte, peephole.targets, count);
+    FREE_ARRAY(Byte, peephole.kept, count);
+}
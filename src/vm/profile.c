@@ -0,0 +1,201 @@
+#include "vm/profile.h"
+#include "vm/debug.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Counts of executed opcode sequences of length 1 to PROFILE_SEQUENCE_MAX.
+// A key packs the sequence length in its top byte and one opcode per lower
+// byte, so that an empty slot is the only entry with a zero key.
+typedef struct profile_entry {
+    unsigned int key;
+    unsigned long count;
+} ProfileEntry;
+
+static ProfileEntry entries[PROFILE_CAPACITY];
+static unsigned long instructions = 0;
+static unsigned int window = 0;
+static int windowLength = 0;
+
+#define SEQUENCE_KEY(length, opcodes) (((unsigned int)(length) << 24) | (opcodes))
+#define SEQUENCE_LENGTH(key) ((int)((key) >> 24))
+#define SEQUENCE_OPCODE(key, i) ((Byte)((key) >> (8 * (SEQUENCE_LENGTH(key) - 1 - (i)))))
+
+static void profile_count(unsigned int key, unsigned long count)
+{
+    unsigned int index = (key * 2654435761u) & (PROFILE_CAPACITY - 1);
+    int probes;
+
+    for (probes = 0; probes < PROFILE_CAPACITY; probes++) {
+        if (entries[index].key == key || entries[index].key == 0) {
+            entries[index].key = key;
+            entries[index].count += count;
+            return;
+        }
+        index = (index + 1) & (PROFILE_CAPACITY - 1);
+    }
+}
+
+void profile_instruction(Byte instruction)
+{
+    int length;
+
+    instructions++;
+    window = ((window << 8) | instruction) & 0xffffff;
+    if (windowLength < PROFILE_SEQUENCE_MAX) {
+        windowLength++;
+    }
+
+    for (length = 1; length <= windowLength; length++) {
+        profile_count(SEQUENCE_KEY(length, window & (0xffffffu >> (8 * (PROFILE_SEQUENCE_MAX - length)))), 1);
+    }
+}
+
+static int opcode_parse(const char* name, Byte* instruction)
+{
+    int i;
+    const char* candidate;
+
+    for (i = 0; i < BYTE_COUNT; i++) {
+        candidate = opcode_name((Byte)i);
+        if (candidate != NULL && strcmp(candidate, name) == 0) {
+            *instruction = (Byte)i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Lines are "<count> <opcode>..." plus one "instructions <count>" line.
+// Sequences naming opcodes this build does not know are dropped.
+static void profile_load(FILE* fp)
+{
+    char line[256];
+    char* field;
+    unsigned long count;
+    unsigned int opcodes;
+    int length;
+    Byte instruction;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        field = strtok(line, " \t\r\n");
+        if (field == NULL) {
+            continue;
+        }
+
+        if (strcmp(field, "instructions") == 0) {
+            field = strtok(NULL, " \t\r\n");
+            instructions += field != NULL ? strtoul(field, NULL, 10) : 0;
+            continue;
+        }
+
+        count = strtoul(field, NULL, 10);
+        opcodes = 0;
+        length = 0;
+        for (field = strtok(NULL, " \t\r\n"); field != NULL; field = strtok(NULL, " \t\r\n")) {
+            if (length == PROFILE_SEQUENCE_MAX || !opcode_parse(field, &instruction)) {
+                length = 0;
+                break;
+            }
+            opcodes = (opcodes << 8) | instruction;
+            length++;
+        }
+
+        if (length > 0) {
+            profile_count(SEQUENCE_KEY(length, opcodes), count);
+        }
+    }
+}
+
+static int entry_compare(const void* a, const void* b)
+{
+    const ProfileEntry* left = (const ProfileEntry*)a;
+    const ProfileEntry* right = (const ProfileEntry*)b;
+
+    if (SEQUENCE_LENGTH(left->key) != SEQUENCE_LENGTH(right->key)) {
+        return SEQUENCE_LENGTH(left->key) - SEQUENCE_LENGTH(right->key);
+    }
+
+    if (left->count != right->count) {
+        return left->count < right->count ? 1 : -1;
+    }
+
+    return left->key < right->key ? -1 : left->key > right->key;
+}
+
+static void entry_print(FILE* stream, ProfileEntry* entry)
+{
+    int i;
+
+    fprintf(stream, "%lu", entry->count);
+    for (i = 0; i < SEQUENCE_LENGTH(entry->key); i++) {
+        fprintf(stream, " %s", opcode_name(SEQUENCE_OPCODE(entry->key, i)));
+    }
+    fprintf(stream, "\n");
+}
+
+static void profile_report(FILE* report, ProfileEntry* sorted, int count)
+{
+    int i, length, shown = 0;
+
+    fprintf(report, "-- opcode profile: %lu instructions --\n", instructions);
+    for (length = 2; length <= PROFILE_SEQUENCE_MAX; length++) {
+        fprintf(report, "top sequences of %d:\n", length);
+        shown = 0;
+        for (i = 0; i < count && shown < PROFILE_REPORT_TOP; i++) {
+            if (SEQUENCE_LENGTH(sorted[i].key) != length) {
+                continue;
+            }
+            fprintf(report, "  %5.1f%%  ", instructions > 0 ? 100.0 * sorted[i].count / instructions : 0.0);
+            entry_print(report, &sorted[i]);
+            shown++;
+        }
+    }
+}
+
+// Merges this run's counts into the profile at path, so that running every
+// script of a corpus with the same path accumulates one profile, and reports
+// the most frequent sequences: the candidates for superinstructions.
+int profile_dump(const char* path, FILE* report)
+{
+    ProfileEntry* sorted = NULL;
+    FILE* fp = fopen(path, "r");
+    int i, count = 0;
+
+    if (fp != NULL) {
+        profile_load(fp);
+        fclose(fp);
+    }
+
+    sorted = (ProfileEntry*)malloc(sizeof(ProfileEntry) * PROFILE_CAPACITY);
+    if (sorted == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < PROFILE_CAPACITY; i++) {
+        if (entries[i].key != 0) {
+            sorted[count++] = entries[i];
+        }
+    }
+    qsort(sorted, count, sizeof(ProfileEntry), entry_compare);
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Cannot write opcode profile %s\n", path);
+        free(sorted);
+        return 0;
+    }
+
+    fprintf(fp, "instructions %lu\n", instructions);
+    for (i = 0; i < count; i++) {
+        entry_print(fp, &sorted[i]);
+    }
+    fclose(fp);
+
+    if (report != NULL) {
+        profile_report(report, sorted, count);
+    }
+
+    free(sorted);
+    return 1;
+}
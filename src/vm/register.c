@@ -0,0 +1,355 @@
+#include "vm/register.h"
+#include "mem.h"
+#include "vm/chunk.h"
+#include <string.h>
+
+// Straight-line runs of stack instructions are translated one expression at
+// a time. Locals, constants and intermediate results go on a symbolic stack
+// instead of the VM's, and each arithmetic instruction becomes one register
+// instruction that writes its result to the slot the stack VM would have
+// pushed it to. A run never contains a jump target, so the stack depth at
+// its start is known, and those temporary slots are past every live local.
+// The run ends by storing the result to a local, by comparing two operands
+// for a loop condition, or by pushing the result for whatever comes next.
+
+#define WINDOW_MAX 16
+// The longest register instruction.
+#define REGISTER_LENGTH 5
+
+typedef enum operand_kind {
+    OPERAND_SLOT,
+    OPERAND_CONSTANT,
+    // The result of an earlier instruction of the run, in its slot.
+    OPERAND_TEMPORARY
+} OperandKind;
+
+typedef struct operand {
+    OperandKind kind;
+    int index;
+} Operand;
+
+typedef struct window {
+    Operand stack[2 * WINDOW_MAX];
+    int depth;
+    Byte code[WINDOW_MAX * REGISTER_LENGTH];
+    int lines[WINDOW_MAX * REGISTER_LENGTH];
+    int count;
+    int instructions;
+    // Offset in code of the last arithmetic instruction, which wrote the
+    // temporary on top.
+    int last;
+    // The jump ending the run, if any: its offset in code and where it went
+    // in the stack code.
+    int jump;
+    int target;
+} Window;
+
+// A jump of the translated code and its target in the stack code.
+typedef struct jump {
+    int offset;
+    int length;
+    int target;
+} Jump;
+
+typedef struct translator {
+    Chunk* chunk;
+    int* depths;
+    Byte* targets;
+    // Where each instruction of the stack code starts in the translated code.
+    int* offsets;
+    Byte* code;
+    int* lines;
+    int count;
+    int capacity;
+    Jump* jumps;
+    int jumpCount;
+} Translator;
+
+static void window_push(Window* window, OperandKind kind, int index)
+{
+    window->stack[window->depth].kind = kind;
+    window->stack[window->depth].index = index;
+    window->depth++;
+}
+
+static void window_emit(Window* window, Byte byte, int line)
+{
+    window->code[window->count] = byte;
+    window->lines[window->count] = line;
+    window->count++;
+}
+
+// Replaces the stack instruction for op, whose operands are the top two
+// entries, with op's register form writing a temporary.
+static int window_arithmetic(Window* window, int base, Byte op, int line)
+{
+    Operand left, right;
+    int i, slot;
+
+    if (window->depth < 2) {
+        return 0;
+    }
+
+    right = window->stack[--window->depth];
+    left = window->stack[--window->depth];
+    slot = base + window->depth;
+    if (left.kind == OPERAND_CONSTANT || slot > BYTE_MAX) {
+        return 0;
+    }
+
+    // Concatenation pushes its operands over the temporaries.
+    if (op == OP_ADD_RR) {
+        for (i = 0; i < window->depth; i++) {
+            if (window->stack[i].kind == OPERAND_TEMPORARY) {
+                return 0;
+            }
+        }
+    }
+
+    window->last = window->count;
+    window_emit(window, op + (right.kind == OPERAND_CONSTANT), line);
+    window_emit(window, slot, line);
+    window_emit(window, left.index, line);
+    window_emit(window, right.index, line);
+    window->instructions++;
+    window_push(window, OPERAND_TEMPORARY, slot);
+    return 1;
+}
+
+static void window_store(Window* window, int slot, int line)
+{
+    Operand value = window->stack[0];
+
+    switch (value.kind) {
+    case OPERAND_TEMPORARY:
+        window->code[window->last + 1] = slot;
+        return;
+    case OPERAND_SLOT:
+        window_emit(window, OP_MOVE, line);
+        break;
+    case OPERAND_CONSTANT:
+        window_emit(window, OP_LOAD_CONSTANT, line);
+        break;
+    }
+    window_emit(window, slot, line);
+    window_emit(window, value.index, line);
+    window->instructions++;
+}
+
+static void window_jump(Window* window, int line)
+{
+    window->jump = window->count;
+    window_emit(window, OP_JUMP_IF_NOT_LESS_RR + (window->stack[1].kind == OPERAND_CONSTANT), line);
+    window_emit(window, window->stack[0].index, line);
+    window_emit(window, window->stack[1].index, line);
+    window_emit(window, 0, line);
+    window_emit(window, 0, line);
+    window->instructions++;
+}
+
+static Byte arithmetic_op(Byte instruction)
+{
+    switch (instruction) {
+    case OP_ADD:
+    case OP_ADD_LOCAL_CONSTANT:
+        return OP_ADD_RR;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return OP_SUBTRACT_RR;
+    case OP_MULTIPLY:
+        return OP_MULTIPLY_RR;
+    default:
+        return OP_DIVIDE_RR;
+    }
+}
+
+// Translates the run of instructions from start into window. Returns the
+// offset after the run, or -1 when it would not save any dispatches.
+static int window_translate(Translator* translator, int start, Window* window)
+{
+    Chunk* chunk = translator->chunk;
+    Byte* code = chunk->code;
+    int base = translator->depths[start];
+    int offset, length = 0, line, read = 0;
+
+    window->depth = 0;
+    window->count = 0;
+    window->instructions = 0;
+    window->last = -1;
+    window->jump = -1;
+    window->target = -1;
+    for (offset = start; offset < chunk->count && read < WINDOW_MAX; offset += length, read++) {
+        if (offset != start && translator->targets[offset]) {
+            break;
+        }
+
+        length = chunk_instruction_length(chunk, offset);
+        line = chunk->lines[offset];
+        switch (code[offset]) {
+        case OP_GET_LOCAL:
+            window_push(window, OPERAND_SLOT, code[offset + 1]);
+            continue;
+        case OP_GET_LOCAL2:
+            window_push(window, OPERAND_SLOT, code[offset + 1]);
+            window_push(window, OPERAND_SLOT, code[offset + 2]);
+            continue;
+        case OP_CONSTANT:
+            window_push(window, OPERAND_CONSTANT, code[offset + 1]);
+            continue;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            window_push(window, OPERAND_SLOT, code[offset + 1]);
+            window_push(window, OPERAND_CONSTANT, code[offset + 2]);
+            // Fall through.
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            if (!window_arithmetic(window, base, arithmetic_op(code[offset]), line)) {
+                return -1;
+            }
+            continue;
+        case OP_SET_LOCAL:
+            if (window->depth == 1 && offset + 2 < chunk->count && code[offset + 2] == OP_POP && !translator->targets[offset + 2]) {
+                window_store(window, code[offset + 1], line);
+                return window->instructions < read + 2 ? offset + 3 : -1;
+            }
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            if (window->depth == 2 && window->stack[0].kind != OPERAND_CONSTANT) {
+                window_jump(window, line);
+                window->target = chunk_jump_target(chunk, offset);
+                return window->instructions < read + 1 ? offset + length : -1;
+            }
+            break;
+        }
+        break;
+    }
+
+    // Whatever comes next takes the result from the stack, where it already
+    // is in its slot.
+    if (window->depth != 1 || window->stack[0].kind != OPERAND_TEMPORARY) {
+        return -1;
+    }
+    window_emit(window, OP_GET_LOCAL, window->lines[window->count - 1]);
+    window_emit(window, base, window->lines[window->count - 1]);
+    window->instructions++;
+    return window->instructions < read ? offset : -1;
+}
+
+static void translator_jump(Translator* translator, int offset, int length, int target)
+{
+    Jump* jump = &translator->jumps[translator->jumpCount++];
+    jump->offset = offset;
+    jump->length = length;
+    jump->target = target;
+}
+
+static void translator_copy(Translator* translator, const Byte* code, const int* lines, int count)
+{
+    memcpy(translator->code + translator->count, code, count);
+    memcpy(translator->lines + translator->count, lines, count * sizeof(int));
+    translator->count += count;
+}
+
+// Points the jumps at their targets in the translated code. Fails when a
+// jump no longer fits its offset.
+static int translator_link(Translator* translator)
+{
+    Jump* jump = NULL;
+    int i, distance;
+
+    for (i = 0; i < translator->jumpCount; i++) {
+        jump = &translator->jumps[i];
+        distance = translator->offsets[jump->target] - (jump->offset + jump->length);
+        // OP_LOOP jumps back.
+        distance = distance < 0 ? -distance : distance;
+        if (distance > SHORT_MAX) {
+            return 0;
+        }
+        translator->code[jump->offset + jump->length - 2] = (distance >> 8) & 0xff;
+        translator->code[jump->offset + jump->length - 1] = distance & 0xff;
+    }
+    return 1;
+}
+
+void register_translate(VmFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    Translator translator;
+    Window window;
+    int count = chunk->count;
+    int i, offset, length, target, end;
+
+    for (i = 0; i < chunk->constants.count; i++) {
+        if (IS_FUNCTION(chunk->constants.values[i])) {
+            register_translate(AS_FUNCTION(chunk->constants.values[i]));
+        }
+    }
+
+    if (chunk->count == 0) {
+        return;
+    }
+
+    // A run can come out longer than the stack code it replaces, though
+    // never by more than a register instruction per stack instruction.
+    translator.chunk = chunk;
+    translator.capacity = chunk->count * REGISTER_LENGTH;
+    translator.count = 0;
+    translator.jumpCount = 0;
+    translator.depths = ALLOCATE(int, chunk->count);
+    translator.targets = ALLOCATE(Byte, chunk->count + 1);
+    translator.offsets = ALLOCATE(int, chunk->count + 1);
+    translator.code = ALLOCATE(Byte, translator.capacity);
+    translator.lines = ALLOCATE(int, translator.capacity);
+    translator.jumps = ALLOCATE(Jump, chunk->count);
+
+    chunk_stack_depths(chunk, function->arity + 1, translator.depths);
+    memset(translator.targets, 0, chunk->count + 1);
+    for (offset = 0; offset < chunk->count; offset += length) {
+        length = chunk_instruction_length(chunk, offset);
+        target = chunk_jump_target(chunk, offset);
+        if (target >= 0 && target <= chunk->count) {
+            translator.targets[target] = 1;
+        }
+    }
+
+    for (offset = 0; offset < chunk->count; offset = end) {
+        translator.offsets[offset] = translator.count;
+        end = window_translate(&translator, offset, &window);
+        if (end >= 0) {
+            if (window.jump >= 0) {
+                translator_jump(&translator, translator.count + window.jump, REGISTER_LENGTH, window.target);
+            }
+            translator_copy(&translator, window.code, window.lines, window.count);
+            continue;
+        }
+
+        length = chunk_instruction_length(chunk, offset);
+        target = chunk_jump_target(chunk, offset);
+        if (target >= 0) {
+            translator_jump(&translator, translator.count, length, target);
+        }
+        translator_copy(&translator, chunk->code + offset, chunk->lines + offset, length);
+        end = offset + length;
+    }
+    translator.offsets[chunk->count] = translator.count;
+
+    if (translator_link(&translator)) {
+        FREE_ARRAY(Byte, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        chunk->code = ALLOCATE(Byte, translator.count);
+        chunk->lines = ALLOCATE(int, translator.count);
+        memcpy(chunk->code, translator.code, translator.count);
+        memcpy(chunk->lines, translator.lines, translator.count * sizeof(int));
+        chunk->count = translator.count;
+        chunk->capacity = translator.count;
+    }
+
+    FREE_ARRAY(int, translator.depths, count);
+    FREE_ARRAY(Byte, translator.targets, count + 1);
+    FREE_ARRAY(int, translator.offsets, count + 1);
+    FREE_ARRAY(Byte, translator.code, translator.capacity);
+    FREE_ARRAY(int, translator.lines, translator.capacity);
+    FREE_ARRAY(Jump, translator.jumps, count);
+}
@@ -0,0 +1,258 @@
+#include "vm/scanner.h"
+#include <ctype.h>
+#include <string.h>
+
+#define IS_IDENTIFIER_START(c) (isalpha((unsigned char)(c)) || (c) == '_')
+#define IS_IDENTIFIER_PART(c) (isalnum((unsigned char)(c)) || (c) == '_')
+#define IS_DIGIT(c) isdigit((unsigned char)(c))
+
+void scanner_init(Scanner* scanner, const char* source)
+{
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+    scanner->head = 0;
+    scanner->count = 0;
+}
+
+static ScanToken token_make(Scanner* scanner, TokenType type)
+{
+    ScanToken token;
+    token.type = type;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
+    return token;
+}
+
+static ScanToken token_error(Scanner* scanner, const char* message)
+{
+    ScanToken token;
+    token.type = TOKEN_ERROR;
+    token.start = message;
+    token.length = (int)strlen(message);
+    token.line = scanner->line;
+    return token;
+}
+
+static int scanner_match(Scanner* scanner, char expected)
+{
+    if (*scanner->current != expected) {
+        return 0;
+    }
+
+    scanner->current++;
+    return 1;
+}
+
+static void whitespace_skip(Scanner* scanner)
+{
+    for (;;) {
+        switch (*scanner->current) {
+        case ' ':
+        case '\r':
+        case '\t':
+            scanner->current++;
+            break;
+        case '\n':
+            scanner->line++;
+            scanner->current++;
+            break;
+        case '/':
+            if (scanner->current[1] != '/') {
+                return;
+            }
+            while (*scanner->current != '\n' && *scanner->current != 0) {
+                scanner->current++;
+            }
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+static TokenType keyword_check(Scanner* scanner, const char* keyword, TokenType type)
+{
+    size_t length = strlen(keyword);
+
+    if ((size_t)(scanner->current - scanner->start) == length && memcmp(scanner->start, keyword, length) == 0) {
+        return type;
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+static TokenType identifier_type(Scanner* scanner)
+{
+    switch (scanner->start[0]) {
+    case 'a':
+        return keyword_check(scanner, AND_KEY, TOKEN_AND);
+    case 'c':
+        return keyword_check(scanner, CLASS_KEY, TOKEN_CLASS);
+    case 'e':
+        return keyword_check(scanner, ELSE_KEY, TOKEN_ELSE);
+    case 'f':
+        if (keyword_check(scanner, FALSE_KEY, TOKEN_FALSE) == TOKEN_FALSE) {
+            return TOKEN_FALSE;
+        }
+        if (keyword_check(scanner, FOR_KEY, TOKEN_FOR) == TOKEN_FOR) {
+            return TOKEN_FOR;
+        }
+        return keyword_check(scanner, FUN_KEY, TOKEN_FUN);
+    case 'i':
+        return keyword_check(scanner, IF_KEY, TOKEN_IF);
+    case 'n':
+        return keyword_check(scanner, NIL_KEY, TOKEN_NIL);
+    case 'o':
+        return keyword_check(scanner, OR_KEY, TOKEN_OR);
+    case 'p':
+        return keyword_check(scanner, PRINT_KEY, TOKEN_PRINT);
+    case 'r':
+        return keyword_check(scanner, RETURN_KEY, TOKEN_RETURN);
+    case 's':
+        return keyword_check(scanner, SUPER_KEY, TOKEN_SUPER);
+    case 't':
+        if (keyword_check(scanner, THIS_KEY, TOKEN_THIS) == TOKEN_THIS) {
+            return TOKEN_THIS;
+        }
+        return keyword_check(scanner, TRUE_KEY, TOKEN_TRUE);
+    case 'v':
+        return keyword_check(scanner, VAR_KEY, TOKEN_VAR);
+    case 'w':
+        return keyword_check(scanner, WHILE_KEY, TOKEN_WHILE);
+    default:
+        return TOKEN_IDENTIFIER;
+    }
+}
+
+static ScanToken identifier_scan(Scanner* scanner)
+{
+    while (IS_IDENTIFIER_PART(*scanner->current)) {
+        scanner->current++;
+    }
+
+    return token_make(scanner, identifier_type(scanner));
+}
+
+static ScanToken number_scan(Scanner* scanner)
+{
+    while (IS_DIGIT(*scanner->current)) {
+        scanner->current++;
+    }
+
+    if (*scanner->current == '.' && IS_DIGIT(scanner->current[1])) {
+        scanner->current++;
+        while (IS_DIGIT(*scanner->current)) {
+            scanner->current++;
+        }
+    }
+
+    return token_make(scanner, TOKEN_NUMBER);
+}
+
+// The token of a string covers its contents only, without the quotes.
+static ScanToken string_scan(Scanner* scanner)
+{
+    ScanToken token;
+
+    while (*scanner->current != '"' && *scanner->current != 0) {
+        if (*scanner->current == '\n') {
+            scanner->line++;
+        }
+        scanner->current++;
+    }
+
+    if (*scanner->current == 0) {
+        return token_error(scanner, "Unterminated string.");
+    }
+
+    scanner->start++;
+    token = token_make(scanner, TOKEN_STRING);
+    scanner->current++;
+    return token;
+}
+
+static ScanToken token_scan(Scanner* scanner)
+{
+    char c;
+
+    whitespace_skip(scanner);
+    scanner->start = scanner->current;
+
+    if (*scanner->current == 0) {
+        return token_make(scanner, TOKEN_ENDOFFILE);
+    }
+
+    c = *scanner->current++;
+    if (IS_IDENTIFIER_START(c)) {
+        return identifier_scan(scanner);
+    }
+
+    if (IS_DIGIT(c)) {
+        return number_scan(scanner);
+    }
+
+    switch (c) {
+    case '(':
+        return token_make(scanner, TOKEN_LEFT_PAREN);
+    case ')':
+        return token_make(scanner, TOKEN_RIGHT_PAREN);
+    case '{':
+        return token_make(scanner, TOKEN_LEFT_BRACE);
+    case '}':
+        return token_make(scanner, TOKEN_RIGHT_BRACE);
+    case ',':
+        return token_make(scanner, TOKEN_COMMA);
+    case '.':
+        return token_make(scanner, TOKEN_DOT);
+    case '-':
+        return token_make(scanner, TOKEN_MINUS);
+    case '+':
+        return token_make(scanner, TOKEN_PLUS);
+    case ';':
+        return token_make(scanner, TOKEN_SEMICOLON);
+    case '*':
+        return token_make(scanner, TOKEN_STAR);
+    case '/':
+        return token_make(scanner, TOKEN_SLASH);
+    case '!':
+        return token_make(scanner, scanner_match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    case '=':
+        return token_make(scanner, scanner_match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    case '>':
+        return token_make(scanner, scanner_match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '<':
+        return token_make(scanner, scanner_match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    case '"':
+        return string_scan(scanner);
+    default:
+        return token_error(scanner, "Unexpected character.");
+    }
+}
+
+ScanToken* scanner_peek(Scanner* scanner, int distance)
+{
+    int index;
+
+    if (distance < 0 || distance >= SCANNER_LOOKAHEAD) {
+        return NULL;
+    }
+
+    while (scanner->count <= distance) {
+        index = (scanner->head + scanner->count) % SCANNER_LOOKAHEAD;
+        scanner->buffered[index] = token_scan(scanner);
+        scanner->count++;
+    }
+
+    return &scanner->buffered[(scanner->head + distance) % SCANNER_LOOKAHEAD];
+}
+
+ScanToken scanner_next(Scanner* scanner)
+{
+    ScanToken token = *scanner_peek(scanner, 0);
+
+    scanner->head = (scanner->head + 1) % SCANNER_LOOKAHEAD;
+    scanner->count--;
+    return token;
+}
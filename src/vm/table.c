@@ -1,167 +1,484 @@
 #include "vm/table.h"
 #include "mem.h"
+#include "vm/gc.h"
 #include "vm/value.h"
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_CONTROL(hash) ((Byte)((hash)&0x7f))
+#define IS_FULL(control) ((control) < 0x80)
+
+// A set bit i means that byte i of the group matched.
+typedef unsigned int GroupMask;
+
+#ifdef TABLE_SSE2
+static GroupMask group_match(const Byte* group, Byte control)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+}
+
+// Empty and deleted slots are the only control bytes with the high bit set.
+static GroupMask group_match_free(const Byte* group)
+{
+    return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+// Without SSE2 a group is matched as two 64-bit words, eight bytes at a time.
+#define SWAR_LOW ((uint64_t)0x0101010101010101)
+#define SWAR_HIGH ((uint64_t)0x8080808080808080)
+
+static uint64_t swar_load(const Byte* bytes)
+{
+    uint64_t word = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        word = (word << 8) | bytes[i];
+    }
+
+    return word;
+}
+
+// Gathers the high bit of every byte into one bit per byte.
+static GroupMask swar_mask(uint64_t high)
+{
+    return (GroupMask)(((high >> 7) * (uint64_t)0x0102040810204080) >> 56);
+}
+
+// May report a byte above a real match as well, which is harmless as every
+// candidate slot is checked against its key.
+static GroupMask group_match(const Byte* group, Byte control)
+{
+    uint64_t low = swar_load(group);
+    uint64_t high = swar_load(group + 8);
+
+    if (control == TABLE_CONTROL_EMPTY) {
+        // Exact, as it decides where a probe stops: only EMPTY has the high
+        // bit set and the next one clear.
+        return swar_mask(low & ~(low << 1) & SWAR_HIGH) | swar_mask(high & ~(high << 1) & SWAR_HIGH) << 8;
+    }
+
+    low ^= SWAR_LOW * control;
+    high ^= SWAR_LOW * control;
+    return swar_mask((low - SWAR_LOW) & ~low & SWAR_HIGH) | swar_mask((high - SWAR_LOW) & ~high & SWAR_HIGH) << 8;
+}
+
+static GroupMask group_match_free(const Byte* group)
+{
+    return swar_mask(swar_load(group) & SWAR_HIGH) | swar_mask(swar_load(group + 8) & SWAR_HIGH) << 8;
+}
+#endif
+
+static int mask_first(GroupMask mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// The string hash is wyhash (final version 4) folded to 32 bits: up to 16
+// bytes are read as two overlapping words, longer strings 16 or 48 bytes at
+// a time, and every step is one 64x64->128-bit multiply.
+static const uint64_t hashSecret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static void hash_multiply(uint64_t* a, uint64_t* b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t high = *a >> 32, low = (uint32_t)*a, bHigh = *b >> 32, bLow = (uint32_t)*b;
+    uint64_t hh = high * bHigh, hl = high * bLow, lh = low * bHigh, ll = low * bLow;
+    uint64_t t = ll + (hl << 32), carry = t < ll;
+    uint64_t lo = t + (lh << 32);
+
+    carry += lo < t;
+    *a = lo;
+    *b = hh + (hl >> 32) + (lh >> 32) + carry;
+#endif
+}
+
+static uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    hash_multiply(&a, &b);
+    return a ^ b;
+}
+
+// Unaligned native-endian loads; the hash is never stored outside the VM.
+static uint64_t hash_read64(const char* p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static uint64_t hash_read32(const char* p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// The seed, already mixed with the secret. vm_init() sets it before the
+// first string is hashed.
+static uint64_t hashSeed;
+
+void table_hash_seed(uint64_t seed)
+{
+    hashSeed = seed ^ hash_mix(seed ^ hashSecret[0], hashSecret[1]);
+}
+
+Hash table_hash(const char* chars, size_t length)
+{
+    const char* p = chars;
+    uint64_t seed = hashSeed, seed1, seed2, a, b, hash;
+    size_t i = length;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (hash_read32(p) << 32) | hash_read32(p + ((length >> 3) << 2));
+            b = (hash_read32(p + length - 4) << 32) | hash_read32(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = ((uint64_t)(Byte)p[0] << 16) | ((uint64_t)(Byte)p[length >> 1] << 8) | (Byte)p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            seed1 = seed2 = seed;
+            do {
+                seed = hash_mix(hash_read64(p) ^ hashSecret[1], hash_read64(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read64(p + 16) ^ hashSecret[2], hash_read64(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read64(p + 32) ^ hashSecret[3], hash_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ hashSecret[1], hash_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+
+    a ^= hashSecret[1];
+    b ^= seed;
+    hash_multiply(&a, &b);
+    hash = hash_mix(a ^ hashSecret[0] ^ length, b ^ hashSecret[1]);
+    return (Hash)(hash ^ (hash >> 32));
+}
 
 void table_init(Table* table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void table_free(Table* table)
 {
+    FREE_ARRAY(Byte, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table_init(table);
 }
 
-static Entry* find_entry(Entry* entries, int capacity, VmString* key)
+// Groups are probed quadratically (by triangular numbers of groups), which
+// visits every group once when their number is a power of two.
+#define PROBE_START(table, hash) ((int)(HASH_GROUP(hash) & ((table)->capacity - 1)) & ~(TABLE_GROUP_WIDTH - 1))
+#define PROBE_NEXT(table, group, step) (((group) + (step)*TABLE_GROUP_WIDTH) & ((table)->capacity - 1))
+
+static int find_entry(Table* table, VmString* key)
 {
-    Entry *tombstone = NULL, *entry = NULL;
-    int index = key->hash % capacity;
+    GroupMask mask;
+    int group = PROBE_START(table, key->hash), step, index;
+
+    for (step = 1; step <= table->capacity / TABLE_GROUP_WIDTH; step++) {
+        for (mask = group_match(table->control + group, HASH_CONTROL(key->hash)); mask != 0; mask &= mask - 1) {
+            index = group + mask_first(mask);
+            if (table->entries[index].key == key) {
+                return index;
+            }
+        }
 
-    for (;;) {
-        entry = &entries[index];
+        if (group_match(table->control + group, TABLE_CONTROL_EMPTY) != 0) {
+            return -1;
+        }
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
-            }
-        } else if (entry->key == key) {
-            return entry;
+        group = PROBE_NEXT(table, group, step);
+    }
+
+    return -1;
+}
+
+// The first empty or deleted slot on the probe sequence of hash. There is
+// always one as the load factor stays below one.
+static int find_free(Byte* control, int capacity, Hash hash)
+{
+    GroupMask mask;
+    int group = (int)(HASH_GROUP(hash) & (capacity - 1)) & ~(TABLE_GROUP_WIDTH - 1), step;
+
+    for (step = 1;; step++) {
+        mask = group_match_free(control + group);
+        if (mask != 0) {
+            return group + mask_first(mask);
         }
 
-        index = (index + 1) % capacity;
+        group = (group + step * TABLE_GROUP_WIDTH) & (capacity - 1);
     }
 }
 
 static void adjust_capacity(Table* table, int capacity)
 {
-    Entry* entries = (Entry*)alloc(capacity * sizeof(Entry));
-    Entry *entry = NULL, *dest = NULL;
-    int i;
+    // Both arrays are allocated before the table is read: the allocations may
+    // collect, and a collection prunes vm.strings.
+    Byte* control = ALLOCATE(Byte, capacity);
+    Entry* entries = ALLOCATE(Entry, capacity);
+    int i, index;
 
-    for (i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = nil_val();
-    }
+    memset(control, TABLE_CONTROL_EMPTY, capacity);
 
-    table->count = 0;
     for (i = 0; i < table->capacity; i++) {
-        entry = &table->entries[i];
-
-        if (entry->key == NULL) {
+        if (!IS_FULL(table->control[i])) {
             continue;
         }
 
-        dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        index = find_free(control, capacity, table->entries[i].hash);
+        control[index] = table->control[i];
+        entries[index] = table->entries[i];
     }
 
+    FREE_ARRAY(Byte, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
 }
 
 int table_set(Table* table, VmString* key, Value value)
 {
-    int isNewKey, capacity;
-    Entry* entry = NULL;
+    int index = table->capacity > 0 ? find_entry(table, key) : -1;
 
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+    if (index != -1) {
+        table->entries[index].value = value;
+        return 0;
     }
 
-    entry = find_entry(table->entries, table->capacity, key);
-    isNewKey = entry->key == NULL;
-    entry->key = key;
-    entry->value = value;
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // Mostly tombstones: rehash in place rather than grow.
+        adjust_capacity(table, table->count + 1 <= table->capacity * TABLE_MAX_LOAD / 2
+                ? table->capacity
+                : table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity * 2);
+    }
 
-    if (isNewKey) {
-        table->count++;
+    index = find_free(table->control, table->capacity, key->hash);
+    if (table->control[index] == TABLE_CONTROL_DELETED) {
+        table->tombstones--;
     }
 
-    return isNewKey;
+    table->control[index] = HASH_CONTROL(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->entries[index].hash = key->hash;
+    table->count++;
+    return 1;
 }
 
 void table_add_all(Table* from, Table* to)
 {
     int i;
-    Entry* entry = NULL;
 
     for (i = 0; i < from->capacity; i++) {
-        entry = &from->entries[i];
-        if (entry->key != NULL) {
-            table_set(to, entry->key, entry->value);
+        if (IS_FULL(from->control[i])) {
+            table_set(to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
 
 int table_get(Table* table, VmString* key, Value* value)
 {
-    Entry* entry = NULL;
+    int index;
 
-    if (table->entries == NULL) {
+    if (table->count == 0) {
         return 0;
     }
 
-    entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    index = find_entry(table, key);
+    if (index == -1) {
         return 0;
     }
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return 1;
 }
 
+static void slot_clear(Table* table, int index)
+{
+    int group = index & ~(TABLE_GROUP_WIDTH - 1);
+
+    // A probe stops at the first group holding an empty slot, so a slot in
+    // such a group can become empty again instead of a tombstone.
+    if (group_match(table->control + group, TABLE_CONTROL_EMPTY) != 0) {
+        table->control[index] = TABLE_CONTROL_EMPTY;
+    } else {
+        table->control[index] = TABLE_CONTROL_DELETED;
+        table->tombstones++;
+    }
+
+    table->entries[index].key = NULL;
+    table->entries[index].value = nil_val();
+    table->count--;
+}
+
 int table_delete(Table* table, VmString* key)
 {
-    Entry* entry = NULL;
+    int index;
+
     if (table->count == 0) {
         return 0;
     }
 
-    entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    index = find_entry(table, key);
+    if (index == -1) {
         return 0;
     }
 
-    entry->key = NULL;
-    entry->value = bool_val(1);
-
+    slot_clear(table, index);
     return 1;
 }
 
 VmString* table_find_string(Table* table, const char* chars, size_t length, Hash hash)
 {
-    unsigned int index;
+    GroupMask mask;
     Entry* entry = NULL;
+    int group, step;
 
-    if (table == NULL || table->entries == NULL) {
+    if (table == NULL || table->count == 0) {
         return NULL;
     }
 
-    index = hash % table->capacity;
-
-    for (;;) {
-        entry = &table->entries[index];
+    group = PROBE_START(table, hash);
+    for (step = 1; step <= table->capacity / TABLE_GROUP_WIDTH; step++) {
+        for (mask = group_match(table->control + group, HASH_CONTROL(hash)); mask != 0; mask &= mask - 1) {
+            entry = &table->entries[group + mask_first(mask)];
+            if (entry->hash == hash && entry->key->length == length && memcmp(entry->key->chars, chars, length) == 0) {
+                return entry->key;
+            }
+        }
 
-        if (entry->key == NULL) {
+        if (group_match(table->control + group, TABLE_CONTROL_EMPTY) != 0) {
             return NULL;
         }
 
-        if (entry->key->length == length && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+        group = PROBE_NEXT(table, group, step);
+    }
+
+    return NULL;
+}
+
+void table_mark(Table* table)
+{
+    int i;
+
+    for (i = 0; i < table->capacity; i++) {
+        if (IS_FULL(table->control[i])) {
+            gc_mark_object((VmObject*)table->entries[i].key);
+            gc_mark_value(table->entries[i].value);
+        }
+    }
+}
+
+void table_remove_white(Table* table)
+{
+    int i;
+
+    for (i = 0; i < table->capacity; i++) {
+        if (IS_FULL(table->control[i]) && !table->entries[i].key->object.isMarked) {
+            slot_clear(table, i);
+        }
+    }
+}
+
+static int hash_compare(const void* a, const void* b)
+{
+    Hash x = *(const Hash*)a, y = *(const Hash*)b;
+    return x < y ? -1 : x > y;
+}
+
+// How many groups a probe passes before the group of the entry at index.
+static int probe_distance(Table* table, int index)
+{
+    int group = PROBE_START(table, table->entries[index].hash), step;
+
+    for (step = 1; group != (index & ~(TABLE_GROUP_WIDTH - 1)); step++) {
+        group = PROBE_NEXT(table, group, step);
+    }
+
+    return step - 1;
+}
+
+void table_stats_print(Table* table, const char* name, FILE* stream)
+{
+    Hash* hashes = NULL;
+    long probes = 0;
+    int count = 0, displaced = 0, longest = 0, collisions = 0, matches = 0, i, j, group, distance, full;
+    double expectedCollisions, expectedMatches = 0;
+
+    // Not ALLOCATE: a collection now would prune the table being measured.
+    hashes = malloc(sizeof(Hash) * (table->count + 1));
+    for (group = 0; group < table->capacity; group += TABLE_GROUP_WIDTH) {
+        full = 0;
+        for (i = group; i < group + TABLE_GROUP_WIDTH; i++) {
+            if (!IS_FULL(table->control[i])) {
+                continue;
+            }
+
+            full++;
+            hashes[count++] = table->entries[i].hash;
+            distance = probe_distance(table, i);
+            displaced += distance > 0;
+            probes += distance;
+            longest = distance > longest ? distance : longest;
+            for (j = i + 1; j < group + TABLE_GROUP_WIDTH; j++) {
+                matches += table->control[j] == table->control[i];
+            }
         }
+        expectedMatches += full * (full - 1) / 2.0 / 128;
+    }
 
-        index = (index + 1) % table->capacity;
+    qsort(hashes, count, sizeof(Hash), hash_compare);
+    for (i = 1; i < count; i++) {
+        collisions += hashes[i] == hashes[i - 1];
     }
+    expectedCollisions = count * (count - 1.0) / 2 / 4294967296.0;
+    free(hashes);
+
+    fprintf(stream, "%s: %d keys in %d slots, %.1f%% full, %d tombstones\n",
+        name, count, table->capacity, table->capacity > 0 ? count * 100.0 / table->capacity : 0.0, table->tombstones);
+    fprintf(stream, "%s: %d keys outside their home group, %.3f extra groups probed per hit, %d at most\n",
+        name, displaced, count > 0 ? (double)probes / count : 0.0, longest);
+    fprintf(stream, "%s: %d full hash collisions (%.3f expected), %d control byte matches within a group (%.1f expected)\n",
+        name, collisions, expectedCollisions, matches, expectedMatches);
 }
@@ -0,0 +1,1307 @@
+#include "vm/trace.h"
+#include "vm/chunk.h"
+#include "vm/jit.h"
+#include "vm/vm.h"
+
+#ifdef VM_JIT
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// A tracing compiler for numeric loops. Once a loop header is hot, the
+// recorder runs the next iteration itself, like the interpreter would, and
+// writes down the path it takes as IR with the types it saw. Only numbers
+// and booleans are traced; anything else, a call included, ends the
+// recording and the loop stays in the interpreter.
+//
+// The IR is in SSA form. Constants, and the slots and globals the loop reads
+// before writing them, are loaded once above the loop with a guard on their
+// type, which makes every value inside the loop a known number: no other
+// type guards are needed, and values stay unboxed in xmm registers. Slots
+// and globals are written through on every store, so a side exit only has
+// to spill the values the trace holds on the Lox stack and name the
+// instruction the interpreter resumes from.
+
+#define TRACE_LENGTH_MAX 256
+#define TRACE_IR_MAX 512
+#define TRACE_STACK_MAX 32
+#define TRACE_GLOBALS_MAX 32
+#define TRACE_EXITS_MAX 64
+#define TRACE_SNAPSHOT_MAX (TRACE_EXITS_MAX * 8)
+#define TRACE_REGISTERS 16
+// Recordings of a loop before it is left to the interpreter, and the side
+// exits taken before a trace completes an iteration that make it record
+// again.
+#define TRACE_ATTEMPTS 4
+#define TRACE_HOT_EXIT 100
+
+typedef enum ir_op {
+    // Hoisted above the loop.
+    IR_CONSTANT,
+    IR_LOCAL,
+    IR_GLOBAL,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NEGATE,
+    // Keeps a hoisted value apart from the variable it is assigned to, whose
+    // register takes the new value at the back edge.
+    IR_COPY,
+    IR_STORE_LOCAL,
+    IR_STORE_GLOBAL,
+    // Side exits unless the comparison gives expected.
+    IR_GUARD_LESS,
+    IR_GUARD_GREATER,
+    IR_GUARD_EQUAL
+} IrOp;
+
+typedef struct ir {
+    Byte op;
+    Byte expected;
+    // The slot of loads and stores, the exit of guards.
+    Short slot;
+    int left;
+    int right;
+    Value value;
+} Ir;
+
+typedef enum trace_value_kind {
+    TRACED_NUMBER,
+    TRACED_BOOL,
+    // A comparison not guarded yet, which only the next OP_NOT or
+    // OP_JUMP_IF_FALSE may use.
+    TRACED_COMPARE
+} TraceValueKind;
+
+// A value on the Lox stack above the frame's values at the loop header:
+// a number in ref, or a boolean in truth. A comparison is truth when truth
+// is 1 and its negation otherwise.
+typedef struct trace_value {
+    Byte kind;
+    Byte truth;
+    Byte compare;
+    int ref;
+    int right;
+} TraceValue;
+
+typedef struct trace_global {
+    Short slot;
+    int ref;
+    int load;
+} TraceGlobal;
+
+typedef struct recorded_exit {
+    Byte* ip;
+    int start;
+    int depth;
+} RecordedExit;
+
+typedef struct recorder {
+    CallFrame* frame;
+    Byte* header;
+    int base;
+    Ir ir[TRACE_IR_MAX];
+    int irCount;
+    TraceValue stack[TRACE_STACK_MAX];
+    int depth;
+    // The current value and the value at the header of each slot below
+    // base, -1 until the trace uses it.
+    int locals[BYTE_COUNT];
+    int localLoads[BYTE_COUNT];
+    TraceGlobal globals[TRACE_GLOBALS_MAX];
+    int globalCount;
+    RecordedExit exits[TRACE_EXITS_MAX];
+    int exitCount;
+    TraceValue snapshots[TRACE_SNAPSHOT_MAX];
+    int snapshotCount;
+    Byte* visited[TRACE_LENGTH_MAX];
+    int length;
+} Recorder;
+
+typedef struct trace_exit {
+    Byte* ip;
+    // Values written above the frame's values at the header.
+    int depth;
+    // Times taken before the trace completed an iteration.
+    int early;
+} TraceExit;
+
+typedef struct trace {
+    Byte* code;
+    size_t size;
+    int base;
+    TraceExit* exits;
+} Trace;
+
+struct trace_loop {
+    struct trace_loop* next;
+    Byte* header;
+    // Back edges left before recording, 0 once the loop is given up.
+    int countdown;
+    int attempts;
+    Trace* trace;
+};
+
+// Returns the exit taken and how many iterations completed before it.
+typedef int (*TraceEntry)(Value* slots, Value* globals, long* iterations);
+
+static int ir_add(Recorder* recorder, IrOp op, int left, int right)
+{
+    Ir* ir = &recorder->ir[recorder->irCount];
+
+    memset(ir, 0, sizeof(Ir));
+    ir->op = (Byte)op;
+    ir->left = left;
+    ir->right = right;
+    return recorder->irCount++;
+}
+
+static int constant_ref(Recorder* recorder, Value value)
+{
+    int i, ref;
+
+    for (i = 0; i < recorder->irCount; i++) {
+        if (recorder->ir[i].op == IR_CONSTANT && recorder->ir[i].value == value) {
+            return i;
+        }
+    }
+
+    ref = ir_add(recorder, IR_CONSTANT, -1, -1);
+    recorder->ir[ref].value = value;
+    return ref;
+}
+
+// Loads are only recorded for numbers, and only before a store, so they
+// read what the slot held at the header.
+static int local_ref(Recorder* recorder, int slot)
+{
+    if (recorder->locals[slot] == -1) {
+        if (!IS_NUMBER(recorder->frame->slots[slot])) {
+            return -1;
+        }
+        recorder->locals[slot] = recorder->localLoads[slot] = ir_add(recorder, IR_LOCAL, -1, -1);
+        recorder->ir[recorder->locals[slot]].slot = (Short)slot;
+    }
+
+    return recorder->locals[slot];
+}
+
+static TraceGlobal* global_find(Recorder* recorder, int slot)
+{
+    TraceGlobal* global = NULL;
+    int i;
+
+    for (i = 0; i < recorder->globalCount; i++) {
+        if (recorder->globals[i].slot == slot) {
+            return &recorder->globals[i];
+        }
+    }
+
+    if (recorder->globalCount == TRACE_GLOBALS_MAX) {
+        return NULL;
+    }
+
+    global = &recorder->globals[recorder->globalCount++];
+    global->slot = (Short)slot;
+    global->ref = global->load = -1;
+    return global;
+}
+
+static int global_ref(Recorder* recorder, int slot)
+{
+    TraceGlobal* global = global_find(recorder, slot);
+
+    if (global == NULL) {
+        return -1;
+    }
+
+    if (global->ref == -1) {
+        if (!IS_NUMBER(vm.globalValues.values[slot])) {
+            return -1;
+        }
+        global->ref = global->load = ir_add(recorder, IR_GLOBAL, -1, -1);
+        recorder->ir[global->ref].slot = (Short)slot;
+    }
+
+    return global->ref;
+}
+
+static void number_push(Recorder* recorder, int ref)
+{
+    TraceValue* entry = &recorder->stack[recorder->depth++];
+
+    entry->kind = TRACED_NUMBER;
+    entry->ref = ref;
+}
+
+static void bool_push(Recorder* recorder, int truth)
+{
+    TraceValue* entry = &recorder->stack[recorder->depth++];
+
+    entry->kind = TRACED_BOOL;
+    entry->truth = (Byte)truth;
+}
+
+static TraceValue* entry_peek(Recorder* recorder, int distance)
+{
+    return &recorder->stack[recorder->depth - 1 - distance];
+}
+
+static int local_push(Recorder* recorder, int slot)
+{
+    int ref;
+
+    if (slot >= recorder->base) {
+        recorder->stack[recorder->depth] = recorder->stack[slot - recorder->base];
+        recorder->depth++;
+        return 1;
+    }
+
+    ref = local_ref(recorder, slot);
+    if (ref == -1) {
+        return 0;
+    }
+
+    number_push(recorder, ref);
+    return 1;
+}
+
+// A variable assigned a value hoisted for another one gets a copy, so that
+// moving values into variables' registers at the back edge never
+// overwrites a value that is still to be moved.
+static int stored_ref(Recorder* recorder, int ref, int load)
+{
+    Byte op = recorder->ir[ref].op;
+
+    if ((op == IR_LOCAL || op == IR_GLOBAL) && ref != load) {
+        return ir_add(recorder, IR_COPY, ref, -1);
+    }
+
+    return ref;
+}
+
+static int local_store(Recorder* recorder, int slot)
+{
+    TraceValue* top = entry_peek(recorder, 0);
+    int ref;
+
+    if (slot >= recorder->base) {
+        recorder->stack[slot - recorder->base] = *top;
+        return 1;
+    }
+
+    if (top->kind != TRACED_NUMBER) {
+        return 0;
+    }
+
+    ref = stored_ref(recorder, top->ref, recorder->localLoads[slot]);
+    recorder->ir[ir_add(recorder, IR_STORE_LOCAL, ref, -1)].slot = (Short)slot;
+    recorder->locals[slot] = ref;
+    return 1;
+}
+
+static int global_store(Recorder* recorder, int slot)
+{
+    TraceValue* top = entry_peek(recorder, 0);
+    TraceGlobal* global = global_find(recorder, slot);
+    int ref;
+
+    if (global == NULL || top->kind != TRACED_NUMBER) {
+        return 0;
+    }
+
+    ref = stored_ref(recorder, top->ref, global->load);
+    recorder->ir[ir_add(recorder, IR_STORE_GLOBAL, ref, -1)].slot = (Short)slot;
+    global->ref = ref;
+    return 1;
+}
+
+static int arithmetic_record(Recorder* recorder, IrOp op)
+{
+    TraceValue* left = entry_peek(recorder, 1);
+    TraceValue* right = entry_peek(recorder, 0);
+
+    if (left->kind != TRACED_NUMBER || right->kind != TRACED_NUMBER) {
+        return 0;
+    }
+
+    left->ref = ir_add(recorder, op, left->ref, right->ref);
+    recorder->depth--;
+    return 1;
+}
+
+static VmNumber arithmetic(IrOp op, VmNumber left, VmNumber right)
+{
+    switch (op) {
+    case IR_ADD:
+        return left + right;
+    case IR_SUBTRACT:
+        return left - right;
+    case IR_MULTIPLY:
+        return left * right;
+    default:
+        return left / right;
+    }
+}
+
+static int compare_record(Recorder* recorder, IrOp op)
+{
+    TraceValue* left = entry_peek(recorder, 1);
+    TraceValue* right = entry_peek(recorder, 0);
+
+    if (left->kind == TRACED_NUMBER && right->kind == TRACED_NUMBER) {
+        left->kind = TRACED_COMPARE;
+        left->compare = (Byte)op;
+        left->truth = 1;
+        left->right = right->ref;
+    } else if (op == IR_GUARD_EQUAL && left->kind == TRACED_BOOL && right->kind == TRACED_BOOL) {
+        left->truth = left->truth == right->truth;
+    } else if (op == IR_GUARD_EQUAL) {
+        // A number never equals a boolean.
+        left->kind = TRACED_BOOL;
+        left->truth = 0;
+    } else {
+        return 0;
+    }
+
+    recorder->depth--;
+    return 1;
+}
+
+// The exit resumes at ip with the stack as recorded so far.
+static int exit_add(Recorder* recorder, Byte* ip)
+{
+    RecordedExit* exit = &recorder->exits[recorder->exitCount];
+
+    if (recorder->exitCount == TRACE_EXITS_MAX || recorder->snapshotCount + recorder->depth > TRACE_SNAPSHOT_MAX) {
+        return -1;
+    }
+
+    exit->ip = ip;
+    exit->start = recorder->snapshotCount;
+    exit->depth = recorder->depth;
+    memcpy(&recorder->snapshots[exit->start], recorder->stack, sizeof(TraceValue) * recorder->depth);
+    recorder->snapshotCount += recorder->depth;
+    return recorder->exitCount++;
+}
+
+static int guard_add(Recorder* recorder, IrOp op, int left, int right, int expected, Byte* ip)
+{
+    int exit = exit_add(recorder, ip), guard;
+
+    if (exit == -1) {
+        return -1;
+    }
+
+    guard = ir_add(recorder, op, left, right);
+    recorder->ir[guard].expected = (Byte)expected;
+    recorder->ir[guard].slot = (Short)exit;
+    return exit;
+}
+
+static int visited(Recorder* recorder, Byte* ip)
+{
+    int i;
+
+    for (i = 0; i < recorder->length; i++) {
+        if (recorder->visited[i] == ip) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// The values an instruction reads from the stack, which must have been
+// pushed since the header: a path that leaves the loop may pop further.
+static int operands(Byte instruction)
+{
+    switch (instruction) {
+    case OP_POP:
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_JUMP_IF_FALSE:
+        return 1;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+#define OPERAND_SHORT(ip) ((Short)(((ip)[1] << 8) | (ip)[2]))
+
+// Runs instructions from the header and records them until control is back
+// at the header. Each instruction is checked before it changes anything, so
+// giving up leaves the frame's ip and vm.stackTop at one the interpreter
+// can run.
+static int trace_record(Recorder* recorder)
+{
+    CallFrame* frame = recorder->frame;
+    Value* slots = frame->slots;
+    Value* constants = frame->function->chunk.constants.values;
+    Byte* ip = recorder->header;
+    TraceValue* top = NULL;
+    Value value;
+    IrOp op;
+    int ref, exit, truth;
+
+    for (;;) {
+        if (recorder->length == TRACE_LENGTH_MAX || recorder->irCount > TRACE_IR_MAX - 4
+            || recorder->depth > TRACE_STACK_MAX - 2 || recorder->depth < operands(*ip) || visited(recorder, ip)) {
+            break;
+        }
+        recorder->visited[recorder->length++] = ip;
+        top = recorder->depth > 0 ? entry_peek(recorder, 0) : NULL;
+        if (top != NULL && top->kind == TRACED_COMPARE && *ip != OP_NOT && *ip != OP_JUMP_IF_FALSE) {
+            break;
+        }
+
+        switch (*ip) {
+        case OP_CONSTANT:
+            value = constants[ip[1]];
+            if (!IS_NUMBER(value)) {
+                goto abort;
+            }
+            number_push(recorder, constant_ref(recorder, value));
+            *vm.stackTop++ = value;
+            ip += 2;
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            bool_push(recorder, *ip == OP_TRUE);
+            *vm.stackTop++ = bool_val(*ip == OP_TRUE);
+            ip++;
+            break;
+        case OP_POP:
+            recorder->depth--;
+            vm.stackTop--;
+            ip++;
+            break;
+        case OP_GET_LOCAL:
+            if (!local_push(recorder, ip[1])) {
+                goto abort;
+            }
+            *vm.stackTop++ = slots[ip[1]];
+            ip += 2;
+            break;
+        case OP_GET_LOCAL2:
+            if (!local_push(recorder, ip[1]) || !local_push(recorder, ip[2])) {
+                goto abort;
+            }
+            vm.stackTop[0] = slots[ip[1]];
+            vm.stackTop[1] = slots[ip[2]];
+            vm.stackTop += 2;
+            ip += 3;
+            break;
+        case OP_SET_LOCAL:
+            if (!local_store(recorder, ip[1])) {
+                goto abort;
+            }
+            slots[ip[1]] = vm.stackTop[-1];
+            ip += 2;
+            break;
+        case OP_GET_GLOBAL:
+            ref = global_ref(recorder, OPERAND_SHORT(ip));
+            if (ref == -1) {
+                goto abort;
+            }
+            number_push(recorder, ref);
+            *vm.stackTop++ = vm.globalValues.values[OPERAND_SHORT(ip)];
+            ip += 3;
+            break;
+        case OP_SET_GLOBAL:
+            if (IS_UNDEFINED(vm.globalValues.values[OPERAND_SHORT(ip)]) || !global_store(recorder, OPERAND_SHORT(ip))) {
+                goto abort;
+            }
+            vm.globalValues.values[OPERAND_SHORT(ip)] = vm.stackTop[-1];
+            ip += 3;
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            op = *ip == OP_ADD || *ip == OP_ADD_NUM   ? IR_ADD
+                : *ip == OP_SUBTRACT || *ip == OP_SUBTRACT_NUM ? IR_SUBTRACT
+                : *ip == OP_MULTIPLY || *ip == OP_MULTIPLY_NUM ? IR_MULTIPLY
+                                                               : IR_DIVIDE;
+            if (!arithmetic_record(recorder, op)) {
+                goto abort;
+            }
+            vm.stackTop[-2] = number_val(arithmetic(op, AS_NUMBER(vm.stackTop[-2]), AS_NUMBER(vm.stackTop[-1])));
+            vm.stackTop--;
+            ip++;
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            value = constants[ip[2]];
+            op = *ip == OP_ADD_LOCAL_CONSTANT ? IR_ADD : IR_SUBTRACT;
+            if (!IS_NUMBER(value) || !local_push(recorder, ip[1])) {
+                goto abort;
+            }
+            number_push(recorder, constant_ref(recorder, value));
+            if (!arithmetic_record(recorder, op)) {
+                goto abort;
+            }
+            *vm.stackTop++ = number_val(arithmetic(op, AS_NUMBER(slots[ip[1]]), AS_NUMBER(value)));
+            ip += 3;
+            break;
+        case OP_NEGATE:
+            if (top->kind != TRACED_NUMBER) {
+                goto abort;
+            }
+            top->ref = ir_add(recorder, IR_NEGATE, top->ref, constant_ref(recorder, VALUE_SIGN_BIT));
+            vm.stackTop[-1] = number_val(-AS_NUMBER(vm.stackTop[-1]));
+            ip++;
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_EQUAL:
+            op = *ip == OP_EQUAL ? IR_GUARD_EQUAL : *ip == OP_LESS || *ip == OP_LESS_NUM ? IR_GUARD_LESS : IR_GUARD_GREATER;
+            if (!compare_record(recorder, op)) {
+                goto abort;
+            }
+            truth = op == IR_GUARD_EQUAL ? values_equal(vm.stackTop[-2], vm.stackTop[-1])
+                : op == IR_GUARD_LESS    ? AS_NUMBER(vm.stackTop[-2]) < AS_NUMBER(vm.stackTop[-1])
+                                         : AS_NUMBER(vm.stackTop[-2]) > AS_NUMBER(vm.stackTop[-1]);
+            vm.stackTop[-2] = bool_val(truth);
+            vm.stackTop--;
+            ip++;
+            break;
+        case OP_NOT:
+            // Only numbers and booleans are traced, and numbers are truthy.
+            top->truth = top->kind == TRACED_NUMBER ? 0 : !top->truth;
+            top->kind = top->kind == TRACED_NUMBER ? TRACED_BOOL : top->kind;
+            vm.stackTop[-1] = bool_val(vm.stackTop[-1] == bool_val(0));
+            ip++;
+            break;
+        case OP_JUMP_IF_FALSE:
+            truth = vm.stackTop[-1] != bool_val(0);
+            if (top->kind == TRACED_COMPARE) {
+                // The exit resumes at the jump with what the comparison gave
+                // instead.
+                exit = guard_add(recorder, (IrOp)top->compare, top->ref, top->right, top->truth ? truth : !truth, ip);
+                if (exit == -1) {
+                    goto abort;
+                }
+                recorder->snapshots[recorder->exits[exit].start + recorder->depth - 1].kind = TRACED_BOOL;
+                recorder->snapshots[recorder->exits[exit].start + recorder->depth - 1].truth = (Byte)!truth;
+                top->kind = TRACED_BOOL;
+                top->truth = (Byte)truth;
+            }
+            ip += truth ? 3 : 3 + OPERAND_SHORT(ip);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            if (entry_peek(recorder, 1)->kind != TRACED_NUMBER || top->kind != TRACED_NUMBER) {
+                goto abort;
+            }
+            truth = AS_NUMBER(vm.stackTop[-2]) < AS_NUMBER(vm.stackTop[-1]);
+            if (guard_add(recorder, IR_GUARD_LESS, entry_peek(recorder, 1)->ref, top->ref, truth, ip) == -1) {
+                goto abort;
+            }
+            recorder->depth -= 2;
+            vm.stackTop -= 2;
+            ip += truth ? 3 : 3 + OPERAND_SHORT(ip);
+            break;
+        case OP_JUMP:
+            ip += 3 + OPERAND_SHORT(ip);
+            break;
+        case OP_LOOP:
+            ip += 3 - OPERAND_SHORT(ip);
+            if (ip == recorder->header && recorder->depth == 0) {
+                frame->ip = ip;
+                return 1;
+            }
+            break;
+        default:
+            goto abort;
+        }
+    }
+
+abort:
+    frame->ip = ip;
+    return 0;
+}
+
+#undef OPERAND_SHORT
+
+typedef struct code_buffer {
+    Byte* code;
+    size_t count;
+    size_t capacity;
+    int failed;
+} CodeBuffer;
+
+typedef struct exit_jump {
+    size_t position;
+    int exit;
+} ExitJump;
+
+static void emit_byte(CodeBuffer* buffer, Byte byte)
+{
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    Byte* code = NULL;
+
+    if (buffer->failed) {
+        return;
+    }
+
+    if (buffer->count == buffer->capacity) {
+        code = (Byte*)realloc(buffer->code, capacity);
+        if (code == NULL) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->code = code;
+        buffer->capacity = capacity;
+    }
+
+    buffer->code[buffer->count++] = byte;
+}
+
+static void emit_bytes(CodeBuffer* buffer, const Byte* bytes, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        emit_byte(buffer, bytes[i]);
+    }
+}
+
+static void emit_32(CodeBuffer* buffer, uint32_t value)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        emit_byte(buffer, (Byte)(value >> (i * 8)));
+    }
+}
+
+static void emit_64(CodeBuffer* buffer, uint64_t value)
+{
+    emit_32(buffer, (uint32_t)value);
+    emit_32(buffer, (uint32_t)(value >> 32));
+}
+
+// An SSE2 instruction between two xmm registers.
+static void emit_sse(CodeBuffer* buffer, Byte prefix, Byte opcode, int reg, int rm)
+{
+    emit_byte(buffer, prefix);
+    if (reg >= 8 || rm >= 8) {
+        emit_byte(buffer, 0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    }
+    emit_byte(buffer, 0x0f);
+    emit_byte(buffer, opcode);
+    emit_byte(buffer, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+#define SSE_MOVAPD 0x66, 0x28
+#define SSE_ADDSD 0xf2, 0x58
+#define SSE_SUBSD 0xf2, 0x5c
+#define SSE_MULSD 0xf2, 0x59
+#define SSE_DIVSD 0xf2, 0x5e
+#define SSE_XORPD 0x66, 0x57
+#define SSE_UCOMISD 0x66, 0x2e
+
+// Base registers of the arguments: slots in rdi, globals in rsi.
+#define BASE_SLOTS 7
+#define BASE_GLOBALS 6
+
+// movsd [base + displacement], xmm
+static void emit_store(CodeBuffer* buffer, int base, int displacement, int xmm)
+{
+    emit_byte(buffer, 0xf2);
+    if (xmm >= 8) {
+        emit_byte(buffer, 0x44);
+    }
+    emit_byte(buffer, 0x0f);
+    emit_byte(buffer, 0x11);
+    emit_byte(buffer, 0x80 | (xmm & 7) << 3 | base);
+    emit_32(buffer, (uint32_t)displacement);
+}
+
+// movq xmm, rax
+static void emit_from_rax(CodeBuffer* buffer, int xmm)
+{
+    emit_byte(buffer, 0x66);
+    emit_byte(buffer, 0x48 | (xmm >= 8 ? 4 : 0));
+    emit_byte(buffer, 0x0f);
+    emit_byte(buffer, 0x6e);
+    emit_byte(buffer, 0xc0 | (xmm & 7) << 3);
+}
+
+// mov rax, imm64
+static void emit_rax(CodeBuffer* buffer, uint64_t value)
+{
+    emit_byte(buffer, 0x48);
+    emit_byte(buffer, 0xb8);
+    emit_64(buffer, value);
+}
+
+// Jumps to an exit stub; the displacement is patched once the stubs are
+// emitted.
+static int emit_exit_jump(CodeBuffer* buffer, Byte condition, int exit, ExitJump* jumps, int* jumpCount)
+{
+    if (*jumpCount == TRACE_IR_MAX * 2) {
+        return 0;
+    }
+
+    emit_byte(buffer, 0x0f);
+    emit_byte(buffer, condition);
+    jumps[*jumpCount].position = buffer->count;
+    jumps[*jumpCount].exit = exit;
+    (*jumpCount)++;
+    emit_32(buffer, 0);
+    return 1;
+}
+
+#define JCC_JE 0x84
+#define JCC_JNE 0x85
+#define JCC_JBE 0x86
+#define JCC_JA 0x87
+#define JCC_JP 0x8a
+
+typedef struct trace_compiler {
+    Recorder* recorder;
+    CodeBuffer buffer;
+    int lastUse[TRACE_IR_MAX];
+    // The register of each value, and the value in each register.
+    int registers[TRACE_IR_MAX];
+    int values[TRACE_REGISTERS];
+    ExitJump jumps[TRACE_IR_MAX * 2];
+    int jumpCount;
+} TraceCompiler;
+
+static int hoisted(const Ir* ir)
+{
+    return ir->op == IR_CONSTANT || ir->op == IR_LOCAL || ir->op == IR_GLOBAL;
+}
+
+static void use(TraceCompiler* compiler, int ref, int at)
+{
+    if (ref != -1 && compiler->lastUse[ref] < at) {
+        compiler->lastUse[ref] = at;
+    }
+}
+
+// The values moved into variables' registers at the back edge live to the
+// end of the loop; snapshots use values at their guard.
+static void liveness(TraceCompiler* compiler)
+{
+    Recorder* recorder = compiler->recorder;
+    RecordedExit* exit = NULL;
+    Ir* ir = NULL;
+    int i, j;
+
+    for (i = 0; i < recorder->irCount; i++) {
+        compiler->lastUse[i] = -1;
+    }
+
+    for (i = 0; i < recorder->irCount; i++) {
+        ir = &recorder->ir[i];
+        if (hoisted(ir)) {
+            continue;
+        }
+        use(compiler, ir->left, i);
+        use(compiler, ir->right, i);
+        if (ir->op >= IR_GUARD_LESS) {
+            exit = &recorder->exits[ir->slot];
+            for (j = 0; j < exit->depth; j++) {
+                if (recorder->snapshots[exit->start + j].kind == TRACED_NUMBER) {
+                    use(compiler, recorder->snapshots[exit->start + j].ref, i);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < BYTE_COUNT; i++) {
+        if (recorder->localLoads[i] != -1 && recorder->locals[i] != recorder->localLoads[i]) {
+            use(compiler, recorder->locals[i], recorder->irCount);
+        }
+    }
+    for (i = 0; i < recorder->globalCount; i++) {
+        if (recorder->globals[i].load != -1 && recorder->globals[i].ref != recorder->globals[i].load) {
+            use(compiler, recorder->globals[i].ref, recorder->irCount);
+        }
+    }
+}
+
+static int register_take(TraceCompiler* compiler, int ref)
+{
+    int i;
+
+    for (i = 0; i < TRACE_REGISTERS; i++) {
+        if (compiler->values[i] == -1) {
+            compiler->values[i] = ref;
+            compiler->registers[ref] = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Frees the registers of the values used for the last time at ir.
+static void registers_release(TraceCompiler* compiler, int at)
+{
+    Recorder* recorder = compiler->recorder;
+    int i, ref;
+
+    for (i = 0; i < TRACE_REGISTERS; i++) {
+        ref = compiler->values[i];
+        if (ref != -1 && !hoisted(&recorder->ir[ref]) && compiler->lastUse[ref] <= at) {
+            compiler->values[i] = -1;
+        }
+    }
+}
+
+// Loads what the loop reads from outside into registers, leaving through
+// exit 0 when a variable does not hold a number any more.
+static int preheader_emit(TraceCompiler* compiler)
+{
+    static const Byte numberGuard[] = {
+        0x48, 0x89, 0xc1,  // mov     rcx, rax
+        0x4c, 0x21, 0xc1,  // and     rcx, r8
+        0x4c, 0x39, 0xc1,  // cmp     rcx, r8
+    };
+    CodeBuffer* buffer = &compiler->buffer;
+    Recorder* recorder = compiler->recorder;
+    Ir* ir = NULL;
+    int i;
+
+    emit_bytes(buffer, (const Byte[]) { 0x45, 0x31, 0xc9 }, 3);  // xor     r9d, r9d
+    emit_bytes(buffer, (const Byte[]) { 0x49, 0xb8 }, 2);        // mov     r8, QNAN
+    emit_64(buffer, VALUE_QNAN);
+    for (i = 0; i < recorder->irCount; i++) {
+        ir = &recorder->ir[i];
+        if (!hoisted(ir) || compiler->lastUse[i] == -1) {
+            continue;
+        }
+        if (!register_take(compiler, i)) {
+            return 0;
+        }
+        if (ir->op == IR_CONSTANT) {
+            emit_rax(buffer, ir->value);
+        } else {
+            // mov rax, [base + slot * 8]
+            emit_bytes(buffer, (const Byte[]) { 0x48, 0x8b }, 2);
+            emit_byte(buffer, 0x80 | (ir->op == IR_LOCAL ? BASE_SLOTS : BASE_GLOBALS));
+            emit_32(buffer, (uint32_t)(ir->slot * sizeof(Value)));
+            emit_bytes(buffer, numberGuard, sizeof(numberGuard));
+            if (!emit_exit_jump(buffer, JCC_JE, 0, compiler->jumps, &compiler->jumpCount)) {
+                return 0;
+            }
+        }
+        emit_from_rax(buffer, compiler->registers[i]);
+    }
+
+    return 1;
+}
+
+static int guard_emit(TraceCompiler* compiler, const Ir* ir)
+{
+    CodeBuffer* buffer = &compiler->buffer;
+    int left = compiler->registers[ir->left], right = compiler->registers[ir->right];
+    int exit = ir->slot;
+
+    switch (ir->op) {
+    case IR_GUARD_LESS:
+        // left < right is right above left, which is false for NaNs.
+        emit_sse(buffer, SSE_UCOMISD, right, left);
+        return emit_exit_jump(buffer, ir->expected ? JCC_JBE : JCC_JA, exit, compiler->jumps, &compiler->jumpCount);
+    case IR_GUARD_GREATER:
+        emit_sse(buffer, SSE_UCOMISD, left, right);
+        return emit_exit_jump(buffer, ir->expected ? JCC_JBE : JCC_JA, exit, compiler->jumps, &compiler->jumpCount);
+    default:
+        // Equal is ZF without PF, which NaNs set.
+        emit_sse(buffer, SSE_UCOMISD, left, right);
+        if (ir->expected) {
+            return emit_exit_jump(buffer, JCC_JNE, exit, compiler->jumps, &compiler->jumpCount)
+                && emit_exit_jump(buffer, JCC_JP, exit, compiler->jumps, &compiler->jumpCount);
+        }
+        emit_bytes(buffer, (const Byte[]) { 0x7a, 0x06 }, 2);  // jp      over the je
+        return emit_exit_jump(buffer, JCC_JE, exit, compiler->jumps, &compiler->jumpCount);
+    }
+}
+
+static int body_emit(TraceCompiler* compiler)
+{
+    CodeBuffer* buffer = &compiler->buffer;
+    Recorder* recorder = compiler->recorder;
+    Ir* ir = NULL;
+    int i, target, left;
+
+    for (i = 0; i < recorder->irCount; i++) {
+        ir = &recorder->ir[i];
+        if (hoisted(ir)) {
+            continue;
+        }
+        left = compiler->registers[ir->left];
+        switch (ir->op) {
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_NEGATE:
+        case IR_COPY:
+            // Values nobody uses are not computed.
+            if (compiler->lastUse[i] == -1) {
+                break;
+            }
+            if (!register_take(compiler, i)) {
+                return 0;
+            }
+            target = compiler->registers[i];
+            emit_sse(buffer, SSE_MOVAPD, target, left);
+            if (ir->op == IR_ADD) {
+                emit_sse(buffer, SSE_ADDSD, target, compiler->registers[ir->right]);
+            } else if (ir->op == IR_SUBTRACT) {
+                emit_sse(buffer, SSE_SUBSD, target, compiler->registers[ir->right]);
+            } else if (ir->op == IR_MULTIPLY) {
+                emit_sse(buffer, SSE_MULSD, target, compiler->registers[ir->right]);
+            } else if (ir->op == IR_DIVIDE) {
+                emit_sse(buffer, SSE_DIVSD, target, compiler->registers[ir->right]);
+            } else if (ir->op == IR_NEGATE) {
+                emit_sse(buffer, SSE_XORPD, target, compiler->registers[ir->right]);
+            }
+            break;
+        case IR_STORE_LOCAL:
+            emit_store(buffer, BASE_SLOTS, (int)(ir->slot * sizeof(Value)), left);
+            break;
+        case IR_STORE_GLOBAL:
+            emit_store(buffer, BASE_GLOBALS, (int)(ir->slot * sizeof(Value)), left);
+            break;
+        default:
+            if (!guard_emit(compiler, ir)) {
+                return 0;
+            }
+            break;
+        }
+        registers_release(compiler, i);
+    }
+
+    return 1;
+}
+
+// The loop's variables take their new values for the next iteration. None
+// of the values moved is in a variable's register, see stored_ref.
+static void back_edge_emit(TraceCompiler* compiler)
+{
+    CodeBuffer* buffer = &compiler->buffer;
+    Recorder* recorder = compiler->recorder;
+    TraceGlobal* global = NULL;
+    int i;
+
+    for (i = 0; i < BYTE_COUNT; i++) {
+        if (recorder->localLoads[i] != -1 && recorder->locals[i] != recorder->localLoads[i]
+            && compiler->lastUse[recorder->localLoads[i]] != -1) {
+            emit_sse(buffer, SSE_MOVAPD, compiler->registers[recorder->localLoads[i]], compiler->registers[recorder->locals[i]]);
+        }
+    }
+    for (i = 0; i < recorder->globalCount; i++) {
+        global = &recorder->globals[i];
+        if (global->load != -1 && global->ref != global->load && compiler->lastUse[global->load] != -1) {
+            emit_sse(buffer, SSE_MOVAPD, compiler->registers[global->load], compiler->registers[global->ref]);
+        }
+    }
+}
+
+// Each exit writes its snapshot above the frame's values at the header and
+// returns its index, with the iterations completed stored through rdx.
+static void exits_emit(TraceCompiler* compiler, size_t* stubs)
+{
+    CodeBuffer* buffer = &compiler->buffer;
+    Recorder* recorder = compiler->recorder;
+    RecordedExit* exit = NULL;
+    TraceValue* entry = NULL;
+    size_t tail = 0;
+    int i, j, displacement;
+
+    for (i = 0; i < recorder->exitCount; i++) {
+        exit = &recorder->exits[i];
+        stubs[i] = buffer->count;
+        for (j = 0; j < exit->depth; j++) {
+            entry = &recorder->snapshots[exit->start + j];
+            displacement = (int)((recorder->base + j) * sizeof(Value));
+            if (entry->kind == TRACED_NUMBER) {
+                emit_store(buffer, BASE_SLOTS, displacement, compiler->registers[entry->ref]);
+            } else {
+                emit_rax(buffer, bool_val(entry->truth));
+                // mov [rdi + displacement], rax
+                emit_bytes(buffer, (const Byte[]) { 0x48, 0x89, 0x87 }, 3);
+                emit_32(buffer, (uint32_t)displacement);
+            }
+        }
+        emit_byte(buffer, 0xb8);  // mov     eax, exit
+        emit_32(buffer, (uint32_t)i);
+        if (i == 0) {
+            tail = buffer->count;
+            emit_bytes(buffer, (const Byte[]) { 0x4c, 0x89, 0x0a }, 3);  // mov     [rdx], r9
+            emit_byte(buffer, 0xc3);                                     // ret
+        } else {
+            emit_byte(buffer, 0xe9);  // jmp     tail
+            emit_32(buffer, (uint32_t)((int32_t)tail - (int32_t)(buffer->count + 4)));
+        }
+    }
+}
+
+static void patch_32(Byte* at, int32_t value)
+{
+    memcpy(at, &value, sizeof(value));
+}
+
+static Trace* trace_compile(Recorder* recorder)
+{
+    TraceCompiler* compiler = (TraceCompiler*)malloc(sizeof(TraceCompiler));
+    CodeBuffer* buffer = NULL;
+    Trace* trace = NULL;
+    size_t* stubs = NULL;
+    size_t loop = 0;
+    int i, ok;
+
+    if (compiler == NULL) {
+        return NULL;
+    }
+
+    memset(compiler, 0, sizeof(TraceCompiler));
+    compiler->recorder = recorder;
+    buffer = &compiler->buffer;
+    for (i = 0; i < TRACE_REGISTERS; i++) {
+        compiler->values[i] = -1;
+    }
+    liveness(compiler);
+
+    ok = preheader_emit(compiler);
+    loop = buffer->count;
+    ok = ok && body_emit(compiler);
+    if (ok) {
+        back_edge_emit(compiler);
+        emit_bytes(buffer, (const Byte[]) { 0x49, 0x83, 0xc1, 0x01 }, 4);  // add     r9, 1
+        emit_byte(buffer, 0xe9);                                           // jmp     loop
+        emit_32(buffer, (uint32_t)((int32_t)loop - (int32_t)(buffer->count + 4)));
+        stubs = (size_t*)malloc(sizeof(size_t) * recorder->exitCount);
+        ok = stubs != NULL;
+    }
+    if (ok) {
+        exits_emit(compiler, stubs);
+        ok = !buffer->failed;
+    }
+    for (i = 0; ok && i < compiler->jumpCount; i++) {
+        patch_32(buffer->code + compiler->jumps[i].position,
+            (int32_t)stubs[compiler->jumps[i].exit] - (int32_t)(compiler->jumps[i].position + 4));
+    }
+
+    trace = ok ? (Trace*)malloc(sizeof(Trace)) : NULL;
+    if (trace != NULL) {
+        trace->size = buffer->count;
+        trace->base = recorder->base;
+        trace->exits = (TraceExit*)malloc(sizeof(TraceExit) * recorder->exitCount);
+        trace->code = trace->exits != NULL ? jit_install(buffer->code, buffer->count) : NULL;
+        if (trace->code == NULL) {
+            free(trace->exits);
+            free(trace);
+            trace = NULL;
+        }
+    }
+    for (i = 0; trace != NULL && i < recorder->exitCount; i++) {
+        trace->exits[i].ip = recorder->exits[i].ip;
+        trace->exits[i].depth = recorder->exits[i].depth;
+        trace->exits[i].early = 0;
+    }
+
+    free(stubs);
+    free(buffer->code);
+    free(compiler);
+    return trace;
+}
+
+static void trace_discard(TraceLoop* loop)
+{
+    if (loop->trace == NULL) {
+        return;
+    }
+
+    munmap(loop->trace->code, loop->trace->size);
+    free(loop->trace->exits);
+    free(loop->trace);
+    loop->trace = NULL;
+}
+
+static TraceLoop* loop_find(VmFunction* function, Byte* header)
+{
+    TraceLoop* loop = NULL;
+
+    for (loop = function->loops; loop != NULL; loop = loop->next) {
+        if (loop->header == header) {
+            return loop;
+        }
+    }
+
+    loop = (TraceLoop*)malloc(sizeof(TraceLoop));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->next = function->loops;
+    loop->header = header;
+    loop->countdown = vm.traceThreshold;
+    loop->attempts = TRACE_ATTEMPTS;
+    loop->trace = NULL;
+    function->loops = loop;
+    return loop;
+}
+
+// Counts the different headers of the function's OP_LOOPs.
+static int loops_count(Chunk* chunk)
+{
+    int offset, other, target, count = 0;
+
+    for (offset = 0; offset < chunk->count; offset += chunk_instruction_length(chunk, offset)) {
+        if (chunk->code[offset] != OP_LOOP) {
+            continue;
+        }
+        target = offset + 3 - ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        count++;
+        for (other = 0; other < offset; other += chunk_instruction_length(chunk, other)) {
+            if (chunk->code[other] == OP_LOOP && other + 3 - ((chunk->code[other + 1] << 8) | chunk->code[other + 2]) == target) {
+                count--;
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+static void loop_record(TraceLoop* loop, CallFrame* frame)
+{
+    Recorder* recorder = (Recorder*)malloc(sizeof(Recorder));
+    int i;
+
+    loop->attempts--;
+    if (recorder != NULL) {
+        recorder->frame = frame;
+        recorder->header = frame->ip;
+        recorder->base = (int)(vm.stackTop - frame->slots);
+        recorder->irCount = 0;
+        recorder->depth = 0;
+        recorder->globalCount = 0;
+        recorder->exitCount = 0;
+        recorder->snapshotCount = 0;
+        recorder->length = 0;
+        for (i = 0; i < BYTE_COUNT; i++) {
+            recorder->locals[i] = recorder->localLoads[i] = -1;
+        }
+        // Exit 0 leaves before the first iteration.
+        exit_add(recorder, frame->ip);
+        if (trace_record(recorder)) {
+            loop->trace = trace_compile(recorder);
+        }
+    }
+
+    if (loop->trace != NULL) {
+        vm.traceStats.compiled++;
+    } else {
+        // Tries again later, less and less often.
+        vm.traceStats.aborted++;
+        loop->countdown = loop->attempts > 0 ? vm.traceThreshold << (TRACE_ATTEMPTS - loop->attempts) : 0;
+        // The interpreter stops calling in once every loop is given up.
+        frame->function->traceableLoops -= loop->countdown == 0;
+    }
+    free(recorder);
+}
+
+static void trace_run(TraceLoop* loop, CallFrame* frame)
+{
+    Trace* trace = loop->trace;
+    TraceEntry entry = (TraceEntry)(uintptr_t)trace->code;
+    TraceExit* exit = NULL;
+    long iterations = 0;
+
+    exit = &trace->exits[entry(frame->slots, vm.globalValues.values, &iterations)];
+    vm.stackTop = frame->slots + trace->base + exit->depth;
+    frame->ip = exit->ip;
+    vm.traceStats.exits++;
+    vm.traceStats.iterations += iterations;
+
+    // A guard failing on every entry, such as a branch that went the other
+    // way once the loop was traced, is better recorded again.
+    if (iterations == 0 && ++exit->early == TRACE_HOT_EXIT && loop->attempts > 0) {
+        trace_discard(loop);
+        loop->countdown = 1;
+    }
+}
+
+void trace_loop(CallFrame* frame)
+{
+    TraceLoop* loop = NULL;
+
+    if (frame->function->traceableLoops == -1) {
+        frame->function->traceableLoops = loops_count(&frame->function->chunk);
+    }
+
+    loop = loop_find(frame->function, frame->ip);
+    if (loop == NULL) {
+        return;
+    }
+
+    if (loop->trace == NULL) {
+        if (loop->countdown == 0 || --loop->countdown > 0) {
+            return;
+        }
+        loop_record(loop, frame);
+        // Recording ran an iteration; the trace starts from the header.
+        if (loop->trace == NULL || frame->ip != loop->header) {
+            return;
+        }
+    }
+
+    trace_run(loop, frame);
+}
+
+void trace_free(VmFunction* function)
+{
+    TraceLoop* loop = function->loops;
+    TraceLoop* next = NULL;
+
+    while (loop != NULL) {
+        next = loop->next;
+        trace_discard(loop);
+        free(loop);
+        loop = next;
+    }
+
+    function->loops = NULL;
+}
+#endif
+
+void trace_stats_print(FILE* stream)
+{
+    TraceStats* stats = &vm.traceStats;
+
+    fprintf(stream, "trace: %d compiled, %d aborted, %ld side exits, %ld loop iterations in traces\n",
+        stats->compiled, stats->aborted, stats->exits, stats->iterations);
+}
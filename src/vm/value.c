@@ -1,41 +1,13 @@
 #include "vm/value.h"
 #include "mem.h"
+#include "vm/compiler.h"
+#include "vm/jit.h"
+#include "vm/object.h"
+#include "vm/trace.h"
 #include "vm/vm.h"
 #include <stdio.h>
 #include <string.h>
 
-Value bool_val(VmBoolean boolean)
-{
-    Value v;
-    v.type = VAL_BOOL;
-    v.as.boolean = boolean;
-    return v;
-}
-
-Value nil_val()
-{
-    Value v;
-    v.type = VAL_NIL;
-    v.as.number = 0;
-    return v;
-}
-
-Value number_val(VmNumber number)
-{
-    Value v;
-    v.type = VAL_NUMBER;
-    v.as.number = number;
-    return v;
-}
-
-Value object_val(VmObject* object)
-{
-    Value v;
-    v.type = VAL_OBJECT;
-    v.as.object = object;
-    return v;
-}
-
 void value_array_init(ValueArray* array)
 {
     array->count = 0;
@@ -61,25 +33,33 @@ void value_array_free(ValueArray* array)
     value_array_init(array);
 }
 
+// Interned strings, like other objects, are equal only to themselves. Loose
+// strings and ropes are equal to the string with the same characters.
 int object_equal(Value a, Value b)
 {
-    VmString *s1 = NULL, *s2 = NULL;
-    if (AS_OBJECT(a)->type != AS_OBJECT(b)->type) {
-        return 0;
+    if (AS_OBJECT(a) == AS_OBJECT(b)) {
+        return 1;
     }
 
-    switch (AS_OBJECT(a)->type) {
-    case OBJECT_STRING:
-        s1 = AS_STRING(a);
-        s2 = AS_STRING(b);
-        return s1 == s2;
+    if (!IS_STRING(a) || !IS_STRING(b) || (OBJECT_TYPE(a) == OBJECT_STRING && OBJECT_TYPE(b) == OBJECT_STRING)) {
+        return 0;
     }
-
-    return 0;
+    return vmstring_equal(AS_STRING(a), AS_STRING(b));
 }
 
 int values_equal(Value a, Value b)
 {
+#ifdef VALUE_NAN_BOXING
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+
+    if (IS_OBJECT(a) && IS_OBJECT(b)) {
+        return object_equal(a, b);
+    }
+
+    return a == b;
+#else
     if (a.type != b.type) {
         return 0;
     }
@@ -90,12 +70,14 @@ int values_equal(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_NIL:
+    case VAL_UNDEFINED:
         return 1;
     case VAL_OBJECT:
         return object_equal(a, b);
     }
 
     return 0;
+#endif
 }
 
 static void object_print(Value value)
@@ -104,7 +86,9 @@ static void object_print(Value value)
 
     switch (object->type) {
     case OBJECT_STRING:
-        printf("%s", AS_CSTRING(value));
+    case OBJECT_LOOSE_STRING:
+    case OBJECT_ROPE:
+        printf("%s", vmstring_flatten(AS_STRING(value))->chars);
         break;
     case OBJECT_FUNCTION:
         if (AS_FUNCTION(value)->name != NULL) {
@@ -116,51 +100,93 @@ static void object_print(Value value)
     case OBJECT_NATIVE:
         printf("<native fn>");
         break;
+    case OBJECT_CLOSURE:
+        printf("<fn %s>", AS_CLOSURE(value)->function->name->chars);
+        break;
+    case OBJECT_UPVALUE:
+        printf("upvalue");
+        break;
+    case OBJECT_CLASS:
+        printf("<class %s>", AS_CLASS(value)->name->chars);
+        break;
+    case OBJECT_INSTANCE:
+        printf("<instance %s>", AS_INSTANCE(value)->shape->klass->name->chars);
+        break;
+    case OBJECT_BOUND_METHOD:
+        object_print(AS_BOUND_METHOD(value)->method);
+        break;
+    case OBJECT_SHAPE:
+        printf("shape");
+        break;
     }
 }
 
 void value_print(Value value)
 {
-    switch (value.type) {
-    case VAL_NUMBER:
+    if (IS_NUMBER(value)) {
         printf("%g", AS_NUMBER(value));
-        break;
-    case VAL_BOOL:
+    } else if (IS_BOOL(value)) {
         printf(AS_BOOL(value) ? "true" : "false");
-        break;
-    case VAL_NIL:
+    } else if (IS_NIL(value)) {
         printf("nil");
-        break;
-    case VAL_OBJECT:
+    } else if (IS_OBJECT(value)) {
         object_print(value);
-        break;
     }
 }
 
-static void vmstring_free(VmString* string)
-{
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(VmString, string);
-}
-
-static void object_free(VmObject* object)
+void object_free(VmObject* object)
 {
     VmString* string = NULL;
     VmFunction* function = NULL;
+    VmClosure* closure = NULL;
+    VmInstance* instance = NULL;
     switch (object->type) {
     case OBJECT_STRING:
+    case OBJECT_LOOSE_STRING:
         string = (VmString*)object;
-        vmstring_free(string);
+        reallocate(string, VMSTRING_SIZE(string->length), 0);
+        break;
+    case OBJECT_ROPE:
+        FREE(VmRope, object);
         break;
     case OBJECT_FUNCTION:
         function = (VmFunction*)object;
         chunk_free(&function->chunk);
+        FREE_ARRAY(InlineCache, function->caches, function->cacheCount);
+        FREE_ARRAY(CallCache, function->callCaches, function->callCacheCount);
+#ifdef VM_JIT
+        jit_free(function);
+        trace_free(function);
+#endif
         //vmstring_free(function->name);
         FREE(VmFunction, function);
         break;
     case OBJECT_NATIVE:
         FREE(VmNative, object);
         break;
+    case OBJECT_CLOSURE:
+        closure = (VmClosure*)object;
+        FREE_ARRAY(Value, closure->captures, closure->captureCount);
+        FREE(VmClosure, closure);
+        break;
+    case OBJECT_UPVALUE:
+        FREE(VmUpvalue, object);
+        break;
+    case OBJECT_CLASS:
+        table_free(&((VmClass*)object)->methods);
+        FREE(VmClass, object);
+        break;
+    case OBJECT_INSTANCE:
+        instance = (VmInstance*)object;
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+        FREE(VmInstance, instance);
+        break;
+    case OBJECT_BOUND_METHOD:
+        FREE(VmBoundMethod, object);
+        break;
+    case OBJECT_SHAPE:
+        FREE(VmShape, object);
+        break;
     }
 }
 
@@ -172,4 +198,5 @@ void objects_free()
         object_free(object);
         object = next;
     }
+    vm.objects = NULL;
 }
@@ -1,10 +1,19 @@
 #include "vm/vm.h"
+#include "vm/cache.h"
 #include "vm/compiler.h"
 #include "vm/debug.h"
+#include "vm/jit.h"
+#include "vm/object.h"
+#include "vm/profile.h"
+#include "vm/register.h"
 #include "vm/table.h"
+#include "vm/trace.h"
 #include "vm/value.h"
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -17,15 +26,16 @@ static void vm_stack_reset()
 {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
+    vm.openUpvalues = NULL;
 }
 
-static void vm_stack_push(Value value)
+void vm_stack_push(Value value)
 {
     *vm.stackTop = value;
     vm.stackTop++;
 }
 
-static Value vm_stack_pop()
+Value vm_stack_pop()
 {
     return *--vm.stackTop;
 }
@@ -35,6 +45,8 @@ static Value vm_stack_peek(int distance)
     return vm.stackTop[-1 - distance];
 }
 
+#define TRACE_FRAMES 16
+
 static void runtime_error(const char* format, ...)
 {
 
@@ -47,6 +59,11 @@ static void runtime_error(const char* format, ...)
     va_end(args);
     fputs("\n", stderr);
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        // Deep traces keep their innermost and outermost frames.
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
         frame = &vm.frames[i];
         function = frame->function;
         // -1 because the IP is sitting on the next instruction to be
@@ -67,47 +84,242 @@ static VmBoolean is_falsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Concatenations at least this long are made ropes, so that appending to a
+// string in a loop does not copy it every time round.
+#define ROPE_LENGTH_MIN 64
+
 static void vmstring_concatenate()
 {
-    VmString* b = AS_STRING(vm_stack_pop());
-    VmString* a = AS_STRING(vm_stack_pop());
+    // Operands stay on the stack until the result exists so that a collection
+    // triggered by the allocation below still sees them.
+    VmString* b = AS_STRING(vm_stack_peek(0));
+    VmString* a = AS_STRING(vm_stack_peek(1));
     VmString* result = NULL;
-    size_t length = a->length + b->length;
-    char* chars = (char*)alloc(length + 1);
-
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = 0;
+    size_t length = (size_t)a->length + b->length;
 
-    result = vmstring_take(chars, length);
+    // Ropes are never shorter, so both operands have their characters.
+    if (length >= ROPE_LENGTH_MIN) {
+        result = vmrope_new(a, b);
+    } else {
+        result = vmstring_alloc(length);
+        memcpy(result->chars, a->chars, a->length);
+        memcpy(result->chars + a->length, b->chars, b->length);
+        result = vmstring_loose(result);
+    }
+    vm_stack_pop();
+    vm_stack_pop();
     vm_stack_push(object_val((VmObject*)result));
 }
 
-static int call(VmFunction* function, int argCount)
+// Joins the count strings on top of the stack. A run of strings shorter than
+// a rope is copied into one string, sized and interned once; longer strings
+// and ropes are joined to the runs as ropes.
+static void vmstring_concatenate_n(int count)
+{
+    Value* operands = vm.stackTop - count;
+    VmString *string = NULL, *joined = NULL;
+    size_t length;
+    int i, j, k, pieces = 0;
+
+    // The pieces replace the operands from the bottom, which keeps those not
+    // joined yet on the stack.
+    for (i = 0; i < count; i = j) {
+        length = AS_STRING(operands[i])->length;
+        j = i + 1;
+        while (length < ROPE_LENGTH_MIN && j < count && AS_STRING(operands[j])->length < ROPE_LENGTH_MIN) {
+            length += AS_STRING(operands[j])->length;
+            j++;
+        }
+        if (j == i + 1) {
+            operands[pieces++] = operands[i];
+            continue;
+        }
+
+        joined = vmstring_alloc(length);
+        length = 0;
+        for (k = i; k < j; k++) {
+            string = AS_STRING(operands[k]);
+            memcpy(joined->chars + length, string->chars, string->length);
+            length += string->length;
+        }
+        operands[pieces++] = object_val((VmObject*)vmstring_loose(joined));
+    }
+
+    for (i = 1; i < pieces; i++) {
+        operands[0] = object_val((VmObject*)vmrope_new(AS_STRING(operands[0]), AS_STRING(operands[i])));
+    }
+    vm.stackTop = operands + 1;
+}
+
+// Adds the count values on top of the stack from the left, as the chain of
+// OP_ADD that OP_CONCAT_N stands for would. Fails on operands of the wrong
+// types.
+static int values_concatenate(int count)
+{
+    Value* operands = vm.stackTop - count;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!IS_STRING(operands[i])) {
+            break;
+        }
+    }
+    if (i == count) {
+        vmstring_concatenate_n(count);
+        return 1;
+    }
+
+    for (i = 1; i < count; i++) {
+        if (IS_NUMBER(operands[0]) && IS_NUMBER(operands[i])) {
+            operands[0] = number_val(AS_NUMBER(operands[0]) + AS_NUMBER(operands[i]));
+        } else if (IS_STRING(operands[0]) && IS_STRING(operands[i])) {
+            vm_stack_push(operands[0]);
+            vm_stack_push(operands[i]);
+            vmstring_concatenate();
+            operands[0] = vm_stack_pop();
+        } else {
+            return 0;
+        }
+    }
+    vm.stackTop = operands + 1;
+    return 1;
+}
+
+static void frames_grow()
+{
+    int capacity = vm.frameCapacity * 2;
+    CallFrame* frames = NULL;
+
+    if (capacity > vm.maxFrames) {
+        capacity = vm.maxFrames;
+    }
+
+    frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+        fprintf(stderr, "Out of memory: cannot grow the VM call frames.\n");
+        exit(70);
+    }
+
+    vm.frames = frames;
+    vm.frameCapacity = capacity;
+}
+
+// Moves the stack to a larger block and points the frames, the open
+// upvalues and the stack top into it.
+static void stack_grow(int needed)
+{
+    int capacity = vm.stackCapacity, i;
+    Value* stack = NULL;
+    VmUpvalue* upvalue = NULL;
+
+    while (capacity < needed) {
+        capacity = capacity > vm.maxStack / 2 ? vm.maxStack : capacity * 2;
+    }
+
+    stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) {
+        fprintf(stderr, "Out of memory: cannot grow the VM stack.\n");
+        exit(70);
+    }
+
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+    for (i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+}
+
+// Makes room for the values of a frame of function whose slots start at
+// base. Calls are the only place the stack grows, which is why pushes do not
+// check.
+static int stack_reserve(Value* base, VmFunction* function)
+{
+    int needed = (int)(base - vm.stack) + function->maxStack + STACK_SLACK;
+
+    if (needed <= vm.stackCapacity) {
+        return 1;
+    }
+
+    if (needed > vm.maxStack) {
+        runtime_error("Stack overflow.");
+        return 0;
+    }
+
+    stack_grow(needed);
+    return 1;
+}
+
+// Makes room for one more frame, of function whose callee and arguments are
+// on top of the stack.
+static int frame_reserve(VmFunction* function, int argCount)
+{
+    if (vm.frameCount == vm.frameCapacity) {
+        if (vm.frameCount == vm.maxFrames) {
+            runtime_error("Stack overflow.");
+            return 0;
+        }
+        frames_grow();
+    }
+
+    return stack_reserve(vm.stackTop - argCount - 1, function);
+}
+
+static int call(VmFunction* function, VmClosure* closure, int argCount)
 {
     if (argCount != function->arity) {
         runtime_error("Expected %d arguments but got %d.", function->arity, argCount);
         return 0;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtime_error("Stack overflow.");
+    if (!frame_reserve(function, argCount)) {
         return 0;
     }
 
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->function = function;
+    frame->closure = closure;
     frame->ip = function->chunk.code;
 
     frame->slots = vm.stackTop - argCount - 1;
     return 1;
 }
 
+int vm_global_slot(VmString* name)
+{
+    Value slot;
+    int index;
+
+    if (table_get(&vm.globals, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    if (vm.globalValues.count == GLOBALS_MAX) {
+        return -1;
+    }
+
+    vm_stack_push(object_val((VmObject*)name));
+    index = vm.globalValues.count;
+    value_array_write(&vm.globalValues, undefined_val());
+    value_array_write(&vm.globalNames, object_val((VmObject*)name));
+    table_set(&vm.globals, name, number_val(index));
+    vm_stack_pop();
+    return index;
+}
+
 static void native_define(const char* name, NativeFn function)
 {
+    int slot;
     vm_stack_push(object_val((VmObject*)vmstring_copy(name, (int)strlen(name))));
     vm_stack_push(object_val((VmObject*)vmnative_new(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    slot = vm_global_slot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     vm_stack_pop();
     vm_stack_pop();
 }
@@ -115,19 +327,40 @@ static void native_define(const char* name, NativeFn function)
 int value_call(Value callable, int argCount)
 {
     NativeFn native;
-    Value result;
+    VmClass* klass;
+    VmBoundMethod* bound;
 
     if (IS_OBJECT(callable)) {
         switch (OBJECT_TYPE(callable)) {
         case OBJECT_FUNCTION:
-            return call(AS_FUNCTION(callable), argCount);
+            return call(AS_FUNCTION(callable), NULL, argCount);
+
+        case OBJECT_CLOSURE:
+            return call(AS_CLOSURE(callable)->function, AS_CLOSURE(callable), argCount);
 
         case OBJECT_NATIVE:
+            // The result replaces the callee in its slot.
             native = AS_NATIVE(callable);
-            result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            vm_stack_push(result);
+            vm.stackTop[-argCount - 1] = native(argCount, vm.stackTop - argCount);
+            vm.stackTop -= argCount;
             return 1;
+
+        case OBJECT_CLASS:
+            klass = AS_CLASS(callable);
+            vm.stackTop[-argCount - 1] = object_val((VmObject*)vminstance_new(klass));
+            if (!IS_NIL(klass->initializer)) {
+                return value_call(klass->initializer, argCount);
+            }
+            if (argCount != 0) {
+                runtime_error("Expected 0 arguments but got %d.", argCount);
+                return 0;
+            }
+            return 1;
+
+        case OBJECT_BOUND_METHOD:
+            bound = AS_BOUND_METHOD(callable);
+            vm.stackTop[-argCount - 1] = bound->receiver;
+            return value_call(bound->method, argCount);
         default:
             // Non-callable object type.
             break;
@@ -138,216 +371,1378 @@ int value_call(Value callable, int argCount)
     return 0;
 }
 
+// Returns the upvalue for a stack slot, reusing the open one if another
+// closure already shares the slot.
+static VmUpvalue* upvalue_capture(Value* slot)
+{
+    VmUpvalue *previous = NULL, *upvalue = vm.openUpvalues, *created = NULL;
+
+    while (upvalue != NULL && upvalue->location > slot) {
+        previous = upvalue;
+        upvalue = upvalue->next;
+    }
+
+    if (upvalue != NULL && upvalue->location == slot) {
+        return upvalue;
+    }
+
+    created = vmupvalue_new(slot);
+    created->next = upvalue;
+    if (previous == NULL) {
+        vm.openUpvalues = created;
+    } else {
+        previous->next = created;
+    }
+
+    return created;
+}
+
+// Moves the variables of every open upvalue at or above last off the stack.
+static void upvalues_close(Value* last)
+{
+    VmUpvalue* upvalue = NULL;
+
+    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
+        upvalue = vm.openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm.openUpvalues = upvalue->next;
+    }
+}
+
+// Whether callee is a function or closure that takes argCount arguments.
+static int callee_accepts(Value callee, int argCount)
+{
+    if (IS_FUNCTION(callee)) {
+        return AS_FUNCTION(callee)->arity == argCount;
+    }
+
+    return IS_CLOSURE(callee) && AS_CLOSURE(callee)->function->arity == argCount;
+}
+
+// Moves the callee and arguments of a call in tail position over the
+// frame's slots and starts function in the frame.
+static int frame_reuse(CallFrame* frame, VmFunction* function, VmClosure* closure, int argCount)
+{
+    if (vm.openUpvalues != NULL) {
+        upvalues_close(frame->slots);
+    }
+
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    if (!stack_reserve(frame->slots, function)) {
+        return 0;
+    }
+
+    frame->function = function;
+    frame->closure = closure;
+    frame->ip = function->chunk.code;
+    return 1;
+}
+
+// Remembers a callee that passed the call checks at a call site. Only functions,
+// closures and natives are cached; other callees take value_call every time.
+static void call_cache_update(CallCache* cache, Value callee)
+{
+    switch (OBJECT_TYPE(callee)) {
+    case OBJECT_FUNCTION:
+        cache->function = AS_FUNCTION(callee);
+        cache->closure = NULL;
+        break;
+    case OBJECT_CLOSURE:
+        cache->function = AS_CLOSURE(callee)->function;
+        cache->closure = AS_CLOSURE(callee);
+        break;
+    case OBJECT_NATIVE:
+        cache->function = NULL;
+        cache->native = AS_NATIVE(callee);
+        break;
+    default:
+        return;
+    }
+
+    cache->callee = AS_OBJECT(callee);
+}
+
+static void inline_cache_add(InlineCache* cache, const InlineCacheEntry* entry)
+{
+    if (cache->count < INLINE_CACHE_ENTRIES) {
+        cache->entries[cache->count++] = *entry;
+    }
+}
+
+// Finds what name means on instances of shape: a field or a method of the
+// class. Returns 0 when it is neither.
+static int property_lookup(InlineCache* cache, VmShape* shape, VmString* name, InlineCacheEntry* found)
+{
+    int i;
+
+    for (i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            *found = cache->entries[i];
+            return 1;
+        }
+    }
+
+    found->shape = shape;
+    found->transition = shape;
+    found->index = shape_field_index(shape, name);
+    found->method = nil_val();
+    if (found->index == -1 && !table_get(&shape->klass->methods, name, &found->method)) {
+        return 0;
+    }
+
+    inline_cache_add(cache, found);
+    return 1;
+}
+
+// Finds the field slot that a store to name writes on instances of shape,
+// and the shape the instance has afterwards.
+static void property_store_lookup(InlineCache* cache, VmShape* shape, VmString* name, InlineCacheEntry* found)
+{
+    int i;
+
+    for (i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            *found = cache->entries[i];
+            return;
+        }
+    }
+
+    found->shape = shape;
+    found->transition = shape;
+    found->index = shape_field_index(shape, name);
+    found->method = nil_val();
+    if (found->index == -1) {
+        found->transition = shape_transition(shape, name);
+        found->index = found->transition->fieldCount - 1;
+    }
+
+    inline_cache_add(cache, found);
+}
+
+static int method_bind(VmClass* klass, VmString* name)
+{
+    Value method;
+    VmBoundMethod* bound;
+
+    if (!table_get(&klass->methods, name, &method)) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return 0;
+    }
+
+    bound = vmboundmethod_new(vm_stack_peek(0), method);
+    vm.stackTop[-1] = object_val((VmObject*)bound);
+    return 1;
+}
+
+static int method_invoke(VmClass* klass, VmString* name, int argCount)
+{
+    Value method;
+
+    if (!table_get(&klass->methods, name, &method)) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return 0;
+    }
+
+    return value_call(method, argCount);
+}
+
+// Replaces the instance on top of the stack with its property name.
+static int property_get(InlineCache* cache, VmString* name)
+{
+    VmInstance* instance;
+    InlineCacheEntry entry;
+
+    if (!IS_INSTANCE(vm_stack_peek(0))) {
+        runtime_error("Only instances have properties.");
+        return 0;
+    }
+
+    instance = AS_INSTANCE(vm_stack_peek(0));
+    if (!property_lookup(cache, instance->shape, name, &entry)) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return 0;
+    }
+
+    if (entry.index != -1) {
+        vm.stackTop[-1] = instance->fields[entry.index];
+    } else {
+        vm.stackTop[-1] = object_val((VmObject*)vmboundmethod_new(vm_stack_peek(0), entry.method));
+    }
+    return 1;
+}
+
+// Stores the value on top of the stack in property name of the instance
+// under it, and leaves the value in the instance's place.
+static int property_set(InlineCache* cache, VmString* name)
+{
+    VmInstance* instance;
+    InlineCacheEntry entry;
+
+    if (!IS_INSTANCE(vm_stack_peek(1))) {
+        runtime_error("Only instances have fields.");
+        return 0;
+    }
+
+    instance = AS_INSTANCE(vm_stack_peek(1));
+    property_store_lookup(cache, instance->shape, name, &entry);
+    if (entry.transition != instance->shape) {
+        instance_fields_reserve(instance, entry.transition->fieldCount);
+        instance->shape = entry.transition;
+    }
+    instance->fields[entry.index] = vm_stack_peek(0);
+    vm.stackTop[-2] = vm.stackTop[-1];
+    vm.stackTop--;
+    return 1;
+}
+
+// Calls property name of the instance under the arguments.
+static int property_invoke(InlineCache* cache, VmString* name, int argCount)
+{
+    VmInstance* instance;
+    InlineCacheEntry entry;
+
+    if (!IS_INSTANCE(vm_stack_peek(argCount))) {
+        runtime_error("Only instances have methods.");
+        return 0;
+    }
+
+    instance = AS_INSTANCE(vm_stack_peek(argCount));
+    if (!property_lookup(cache, instance->shape, name, &entry)) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return 0;
+    }
+
+    // A field holding a function is called like any other value.
+    if (entry.index != -1) {
+        entry.method = instance->fields[entry.index];
+        vm.stackTop[-argCount - 1] = entry.method;
+    }
+    return value_call(entry.method, argCount);
+}
+
+// Pushes a closure of the function constant at ip, filled from the capture
+// pairs that follow it, and returns the address past them.
+static Byte* closure_create(CallFrame* frame, Byte* ip)
+{
+    VmClosure* closure = vmclosure_new(AS_FUNCTION(frame->function->chunk.constants.values[*ip++]));
+    Byte mode, index;
+    int i;
+
+    // The closure is pushed before it is filled so that capturing, which may
+    // allocate, cannot collect it.
+    vm_stack_push(object_val((VmObject*)closure));
+    for (i = 0; i < closure->captureCount; i++) {
+        mode = *ip++;
+        index = *ip++;
+        if (mode == CAPTURE_VALUE) {
+            closure->captures[i] = frame->slots[index];
+        } else if (mode == CAPTURE_SHARED) {
+            closure->captures[i] = object_val((VmObject*)upvalue_capture(frame->slots + index));
+        } else {
+            closure->captures[i] = frame->closure->captures[index];
+        }
+    }
+
+    return ip;
+}
+
 static Value native_clock(int argCount, Value* args)
 {
     return number_val((double)clock() / CLOCKS_PER_SEC);
 }
 
+#ifdef VM_JIT
+// Helpers for generated code. Each leaves frame->ip past its instruction, as
+// the interpreter would, before anything that can report an error or call.
+#define JIT_SHORT(ip) ((Short)(((ip)[0] << 8) | (ip)[1]))
+#define JIT_STRING(frame, index) AS_STRING((frame)->function->chunk.constants.values[(index)])
+
+static void jit_ip_skip(CallFrame* frame, Byte* ip)
+{
+    frame->ip = ip + chunk_instruction_length(&frame->function->chunk, (int)(ip - frame->function->chunk.code));
+}
+
+// The stencils handle numbers; what reaches these is an error, or strings.
+static int jit_add(CallFrame* frame, Byte* ip)
+{
+    jit_ip_skip(frame, ip);
+    if (IS_STRING(vm_stack_peek(0)) && IS_STRING(vm_stack_peek(1))) {
+        vmstring_concatenate();
+        return JIT_NEXT;
+    }
+
+    runtime_error("Operands must be two numbers or two strings.");
+    return JIT_ERROR;
+}
+
+static int jit_concatenate(CallFrame* frame, Byte* ip)
+{
+    jit_ip_skip(frame, ip);
+    if (values_concatenate(ip[1])) {
+        return JIT_NEXT;
+    }
+
+    runtime_error("Operands must be two numbers or two strings.");
+    return JIT_ERROR;
+}
+
+// The stencil compares numbers and identical values itself.
+static int jit_equal(CallFrame* frame, Byte* ip)
+{
+    Value right, left;
+
+    jit_ip_skip(frame, ip);
+    right = vm_stack_pop();
+    left = vm_stack_pop();
+    vm_stack_push(bool_val(values_equal(left, right)));
+    return JIT_NEXT;
+}
+
+static int jit_numbers_error(CallFrame* frame, Byte* ip)
+{
+    jit_ip_skip(frame, ip);
+    runtime_error("Operands must be numbers.");
+    return JIT_ERROR;
+}
+
+static int jit_negate_error(CallFrame* frame, Byte* ip)
+{
+    jit_ip_skip(frame, ip);
+    runtime_error("OPerand must be a number");
+    return JIT_ERROR;
+}
+
+static int jit_get_global_error(CallFrame* frame, Byte* ip)
+{
+    jit_ip_skip(frame, ip);
+    runtime_error("Undefined variable at '%s'", AS_CSTRING(vm.globalNames.values[JIT_SHORT(ip + 1)]));
+    return JIT_ERROR;
+}
+
+static int jit_set_global_error(CallFrame* frame, Byte* ip)
+{
+    jit_ip_skip(frame, ip);
+    runtime_error("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[JIT_SHORT(ip + 1)]));
+    return JIT_ERROR;
+}
+
+static int jit_define_global(CallFrame* frame, Byte* ip)
+{
+    vm.globalValues.values[JIT_SHORT(ip + 1)] = vm_stack_pop();
+    return JIT_NEXT;
+}
+
+static int jit_print(CallFrame* frame, Byte* ip)
+{
+    value_print(vm_stack_pop());
+    printf("\n");
+    return JIT_NEXT;
+}
+
+static int jit_return(CallFrame* frame, Byte* ip)
+{
+    Value result = vm_stack_pop();
+
+    frame->ip = ip + 1;
+    if (vm.openUpvalues != NULL) {
+        upvalues_close(frame->slots);
+    }
+
+    vm.frameCount--;
+    if (vm.frameCount == 0) {
+        return JIT_DONE;
+    }
+
+    vm.stackTop = frame->slots;
+    vm_stack_push(result);
+    return JIT_FRAME;
+}
+
+// OP_CALL and OP_TAIL_CALL. Only natives and classes without an initializer
+// finish in the caller's frame.
+static int jit_call(CallFrame* frame, Byte* ip)
+{
+    int argCount = ip[1], frameCount = vm.frameCount;
+    CallCache* cache = &frame->function->callCaches[JIT_SHORT(ip + 2)];
+    Value callee = vm_stack_peek(argCount);
+
+    frame->ip = ip + 4;
+    if (!IS_OBJECT(callee) || AS_OBJECT(callee) != cache->callee) {
+        if (*ip != OP_TAIL_CALL || !callee_accepts(callee, argCount)) {
+            if (!value_call(callee, argCount)) {
+                return JIT_ERROR;
+            }
+            call_cache_update(cache, callee);
+            return vm.frameCount == frameCount ? JIT_NEXT : JIT_FRAME;
+        }
+        call_cache_update(cache, callee);
+    }
+
+    if (cache->function == NULL) {
+        vm.stackTop[-argCount - 1] = cache->native(argCount, vm.stackTop - argCount);
+        vm.stackTop -= argCount;
+        return JIT_NEXT;
+    }
+
+    if (*ip == OP_TAIL_CALL) {
+        return frame_reuse(frame, cache->function, cache->closure, argCount) ? JIT_FRAME : JIT_ERROR;
+    }
+
+    return call(cache->function, cache->closure, argCount) ? JIT_FRAME : JIT_ERROR;
+}
+
+static int jit_closure(CallFrame* frame, Byte* ip)
+{
+    frame->ip = closure_create(frame, ip + 1);
+    return JIT_NEXT;
+}
+
+static int jit_get_upvalue(CallFrame* frame, Byte* ip)
+{
+    Value value = frame->closure->captures[ip[1]];
+
+    if (IS_UPVALUE(value)) {
+        value = *AS_UPVALUE(value)->location;
+    }
+    vm_stack_push(value);
+    return JIT_NEXT;
+}
+
+static int jit_set_upvalue(CallFrame* frame, Byte* ip)
+{
+    *AS_UPVALUE(frame->closure->captures[ip[1]])->location = vm_stack_peek(0);
+    return JIT_NEXT;
+}
+
+static int jit_close_upvalue(CallFrame* frame, Byte* ip)
+{
+    upvalues_close(vm.stackTop - 1);
+    vm_stack_pop();
+    return JIT_NEXT;
+}
+
+static int jit_get_property(CallFrame* frame, Byte* ip)
+{
+    frame->ip = ip + 4;
+    return property_get(&frame->function->caches[JIT_SHORT(ip + 2)], JIT_STRING(frame, ip[1])) ? JIT_NEXT : JIT_ERROR;
+}
+
+static int jit_set_property(CallFrame* frame, Byte* ip)
+{
+    frame->ip = ip + 4;
+    return property_set(&frame->function->caches[JIT_SHORT(ip + 2)], JIT_STRING(frame, ip[1])) ? JIT_NEXT : JIT_ERROR;
+}
+
+static int jit_invoke(CallFrame* frame, Byte* ip)
+{
+    int frameCount = vm.frameCount;
+
+    frame->ip = ip + 5;
+    if (!property_invoke(&frame->function->caches[JIT_SHORT(ip + 3)], JIT_STRING(frame, ip[1]), ip[2])) {
+        return JIT_ERROR;
+    }
+    return vm.frameCount == frameCount ? JIT_NEXT : JIT_FRAME;
+}
+
+static int jit_get_super(CallFrame* frame, Byte* ip)
+{
+    frame->ip = ip + 2;
+    return method_bind(AS_CLASS(vm_stack_pop()), JIT_STRING(frame, ip[1])) ? JIT_NEXT : JIT_ERROR;
+}
+
+static int jit_super_invoke(CallFrame* frame, Byte* ip)
+{
+    int frameCount = vm.frameCount;
+
+    frame->ip = ip + 3;
+    if (!method_invoke(AS_CLASS(vm_stack_pop()), JIT_STRING(frame, ip[1]), ip[2])) {
+        return JIT_ERROR;
+    }
+    return vm.frameCount == frameCount ? JIT_NEXT : JIT_FRAME;
+}
+
+#undef JIT_SHORT
+#undef JIT_STRING
+
+// Class declarations run once and are left to the interpreter, together with
+// the functions that contain them.
+const JitHelper jitHelpers[BYTE_COUNT] = {
+    [OP_RETURN] = jit_return,
+    [OP_NEGATE] = jit_negate_error,
+    [OP_ADD] = jit_add,
+    [OP_EQUAL] = jit_equal,
+    [OP_SUBTRACT] = jit_numbers_error,
+    [OP_MULTIPLY] = jit_numbers_error,
+    [OP_DIVIDE] = jit_numbers_error,
+    [OP_GREATER] = jit_numbers_error,
+    [OP_LESS] = jit_numbers_error,
+    [OP_JUMP_IF_NOT_LESS] = jit_numbers_error,
+    [OP_CONCAT_N] = jit_concatenate,
+    [OP_PRINT] = jit_print,
+    [OP_DEFINE_GLOBAL] = jit_define_global,
+    [OP_GET_GLOBAL] = jit_get_global_error,
+    [OP_SET_GLOBAL] = jit_set_global_error,
+    [OP_CALL] = jit_call,
+    [OP_TAIL_CALL] = jit_call,
+    [OP_CLOSURE] = jit_closure,
+    [OP_GET_UPVALUE] = jit_get_upvalue,
+    [OP_SET_UPVALUE] = jit_set_upvalue,
+    [OP_CLOSE_UPVALUE] = jit_close_upvalue,
+    [OP_GET_PROPERTY] = jit_get_property,
+    [OP_SET_PROPERTY] = jit_set_property,
+    [OP_INVOKE] = jit_invoke,
+    [OP_GET_SUPER] = jit_get_super,
+    [OP_SUPER_INVOKE] = jit_super_invoke,
+};
+#endif
+
+#ifdef DEBUG_EXECUTION_TRACE
+static void vm_trace(CallFrame* frame)
+{
+    Value* slot = NULL;
+    printf("    ");
+    for (slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        value_print(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    chunk_disassemble_instruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+}
+#define VM_TRACE() (frame->ip = ip, vm_trace(frame))
+#else
+#define VM_TRACE()
+#endif
+
+// Calls, returns and loop back edges switch to generated code once the
+// function of the frame on top has some, compiling it after it has run
+// often enough.
+#ifdef VM_JIT
+#define JIT_READY(function) \
+    ((function)->jit != NULL || ((function)->jitCountdown > 0 && --(function)->jitCountdown == 0 && jit_compile(function)))
+#define JIT_ENTER()                           \
+    do {                                      \
+        if (JIT_READY(frame->function)) {     \
+            goto jit_enter;                   \
+        }                                     \
+    } while (0)
+// Back edges run the loop's trace, if --trace compiled one, which leaves the
+// frame's ip wherever it gave up.
+#define TRACE_ENTER()                 \
+    do {                              \
+        if (frame->function->traceableLoops != 0 && vm.traceThreshold != 0) { \
+            STORE_FRAME();            \
+            trace_loop(frame);        \
+            ip = frame->ip;           \
+        }                             \
+    } while (0)
+#else
+#define JIT_ENTER()
+#define TRACE_ENTER()
+#endif
+
+#ifdef VM_PROFILE_OPCODES
+#define VM_PROFILE() profile_instruction(*ip)
+#else
+#define VM_PROFILE()
+#endif
+
+// Dispatch is either a plain switch (portable) or direct threading through a
+// jump table of label addresses (GCC/Clang labels-as-values), where every
+// handler ends with its own indirect jump to the next handler.
+#ifdef VM_COMPUTED_GOTO
+#define VM_DISPATCH()                                     \
+    do {                                                  \
+        VM_TRACE();                                       \
+        VM_PROFILE();                                     \
+        goto* dispatchTable[instruction = READ_BYTE()];   \
+    } while (0)
+#define VM_CASE(opcode) label_##opcode
+#define VM_NEXT() VM_DISPATCH()
+#define VM_DEFAULT() label_unknown
+#else
+#define VM_CASE(opcode) case opcode
+#define VM_NEXT() break
+#define VM_DEFAULT() default
+#endif
+
 static VmInterpretResult vm_run()
 {
+    // The current frame's ip, slots and constants are kept in locals. ip is
+    // written back to the frame before anything that reads it from there: a
+    // call, which resumes from it, and a runtime error, which reports its line.
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (Short)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+    Byte* ip = frame->ip;
+    Value* slots = frame->slots;
+    Value* constants = frame->function->chunk.constants.values;
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (Short)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                         \
+    do {                                                     \
+        frame = &vm.frames[vm.frameCount - 1];               \
+        ip = frame->ip;                                      \
+        slots = frame->slots;                                \
+        constants = frame->function->chunk.constants.values; \
+    } while (0)
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                                            \
+#define GLOBAL_NAME(slot) (AS_STRING(vm.globalNames.values[(slot)])->chars)
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+#define BINARY_OP(valueType, op, quickened)                                 \
     do {                                                                    \
         if (!IS_NUMBER(vm_stack_peek(0)) || !IS_NUMBER(vm_stack_peek(1))) { \
+            STORE_FRAME();                                                  \
             runtime_error("Operands must be numbers.");                     \
             return INTERPRET_RUNTIME_ERROR;                                 \
         }                                                                   \
+        QUICKEN(quickened);                                                 \
         right = AS_NUMBER(vm_stack_pop());                                  \
         left = AS_NUMBER(vm_stack_pop());                                   \
         vm_stack_push(valueType(left op right));                            \
     } while (0)
+// A failed guard deoptimizes: the instruction goes back to its generic form
+// and is executed again from the same ip.
+#define BINARY_OP_NUMBER(valueType, op, generic)                                         \
+    do {                                                                                 \
+        if (IS_NUMBER(vm.stackTop[-1]) && IS_NUMBER(vm.stackTop[-2])) {                  \
+            vm.stackTop[-2] = valueType(AS_NUMBER(vm.stackTop[-2]) op AS_NUMBER(vm.stackTop[-1])); \
+            vm.stackTop--;                                                               \
+        } else {                                                                         \
+            QUICKEN(generic);                                                            \
+            ip--;                                                                 \
+        }                                                                                \
+    } while (0)
+// Register instructions read their operands in place: ip[0] is the
+// destination slot, ip[1] the left operand's slot and right the other operand.
+#define REGISTER_OP(op, right)                                                     \
+    do {                                                                           \
+        leftValue = slots[ip[1]];                                                  \
+        rightValue = (right);                                                      \
+        if (!IS_NUMBER(leftValue) || !IS_NUMBER(rightValue)) {                     \
+            ip += 3;                                                               \
+            STORE_FRAME();                                                         \
+            runtime_error("Operands must be numbers.");                            \
+            return INTERPRET_RUNTIME_ERROR;                                        \
+        }                                                                          \
+        slots[ip[0]] = number_val(AS_NUMBER(leftValue) op AS_NUMBER(rightValue));  \
+        ip += 3;                                                                   \
+    } while (0)
+// Concatenation pushes its operands at stackTop, where no temporary of the
+// register code is live, so that they stay rooted while it allocates.
+#define REGISTER_ADD(right)                                                        \
+    do {                                                                           \
+        leftValue = slots[ip[1]];                                                  \
+        rightValue = (right);                                                      \
+        slot = ip[0];                                                              \
+        ip += 3;                                                                   \
+        if (IS_NUMBER(leftValue) && IS_NUMBER(rightValue)) {                       \
+            slots[slot] = number_val(AS_NUMBER(leftValue) + AS_NUMBER(rightValue)); \
+        } else if (IS_STRING(leftValue) && IS_STRING(rightValue)) {                \
+            vm_stack_push(leftValue);                                              \
+            vm_stack_push(rightValue);                                             \
+            vmstring_concatenate();                                                \
+            slots[slot] = vm_stack_pop();                                          \
+        } else {                                                                   \
+            STORE_FRAME();                                                         \
+            runtime_error("Operands must be two numbers or two strings.");         \
+            return INTERPRET_RUNTIME_ERROR;                                        \
+        }                                                                          \
+    } while (0)
+#define REGISTER_JUMP_IF_NOT_LESS(right)                                           \
+    do {                                                                           \
+        leftValue = slots[ip[0]];                                                  \
+        rightValue = (right);                                                      \
+        offset = (Short)((ip[2] << 8) | ip[3]);                                    \
+        ip += 4;                                                                   \
+        if (!IS_NUMBER(leftValue) || !IS_NUMBER(rightValue)) {                     \
+            STORE_FRAME();                                                         \
+            runtime_error("Operands must be numbers.");                            \
+            return INTERPRET_RUNTIME_ERROR;                                        \
+        }                                                                          \
+        if (!(AS_NUMBER(leftValue) < AS_NUMBER(rightValue))) {                     \
+            ip += offset;                                                          \
+        }                                                                          \
+    } while (0)
 
-    Short offset;
+    Short offset, slot;
     Byte instruction, argCount;
-    Value arbitraryValue, leftValue, rightValue, *slot = NULL;
+    Value arbitraryValue, leftValue, rightValue;
     VmNumber left, right;
-    VmString* name = NULL;
+    VmClass* klass;
+    VmString* name;
+    InlineCache* cache;
+    CallCache* callCache;
+#ifdef VM_JIT
+    JitStatus jitStatus;
+#endif
+#ifdef VM_COMPUTED_GOTO
+    static void* dispatchTable[BYTE_COUNT] = {
+        [0 ... BYTE_MAX] = &&label_unknown,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_POP] = &&label_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_CLASS] = &&label_OP_CLASS,
+        [OP_INHERIT] = &&label_OP_INHERIT,
+        [OP_METHOD] = &&label_OP_METHOD,
+        [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+        [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+        [OP_ADD_STR] = &&label_OP_ADD_STR,
+        [OP_SUBTRACT_NUM] = &&label_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&label_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&label_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM] = &&label_OP_GREATER_NUM,
+        [OP_LESS_NUM] = &&label_OP_LESS_NUM,
+        [OP_GET_LOCAL2] = &&label_OP_GET_LOCAL2,
+        [OP_ADD_LOCAL_CONSTANT] = &&label_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT] = &&label_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_JUMP_IF_NOT_LESS] = &&label_OP_JUMP_IF_NOT_LESS,
+        [OP_CONCAT_N] = &&label_OP_CONCAT_N,
+        [OP_MOVE] = &&label_OP_MOVE,
+        [OP_LOAD_CONSTANT] = &&label_OP_LOAD_CONSTANT,
+        [OP_ADD_RR] = &&label_OP_ADD_RR,
+        [OP_ADD_RK] = &&label_OP_ADD_RK,
+        [OP_SUBTRACT_RR] = &&label_OP_SUBTRACT_RR,
+        [OP_SUBTRACT_RK] = &&label_OP_SUBTRACT_RK,
+        [OP_MULTIPLY_RR] = &&label_OP_MULTIPLY_RR,
+        [OP_MULTIPLY_RK] = &&label_OP_MULTIPLY_RK,
+        [OP_DIVIDE_RR] = &&label_OP_DIVIDE_RR,
+        [OP_DIVIDE_RK] = &&label_OP_DIVIDE_RK,
+        [OP_JUMP_IF_NOT_LESS_RR] = &&label_OP_JUMP_IF_NOT_LESS_RR,
+        [OP_JUMP_IF_NOT_LESS_RK] = &&label_OP_JUMP_IF_NOT_LESS_RK,
+    };
+#endif
 
+#ifdef VM_COMPUTED_GOTO
+    VM_DISPATCH();
+#else
     for (;;) {
-#ifdef DEBUG_EXECUTION_TRACE
-        printf("    ");
-        for (slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            value_print(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        chunk_disassemble_instruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
+        VM_TRACE();
+        VM_PROFILE();
+        switch (instruction = READ_BYTE())
 #endif
-        switch (instruction = READ_BYTE()) {
-        case OP_CONSTANT:
+    {
+        VM_CASE(OP_CONSTANT):
             arbitraryValue = READ_CONSTANT();
             vm_stack_push(arbitraryValue);
-            value_print(arbitraryValue);
-            printf("\n");
-            break;
-        case OP_NOT:
+            VM_NEXT();
+        VM_CASE(OP_NOT):
             arbitraryValue = vm_stack_pop();
             vm_stack_push(bool_val(is_falsey(arbitraryValue)));
-            break;
-        case OP_NEGATE:
+            VM_NEXT();
+        VM_CASE(OP_NEGATE):
             if (!IS_NUMBER(vm_stack_peek(0))) {
+                STORE_FRAME();
                 runtime_error("OPerand must be a number");
                 return INTERPRET_RUNTIME_ERROR;
             }
             arbitraryValue = vm_stack_pop();
             vm_stack_push(number_val(-AS_NUMBER(arbitraryValue)));
-            break;
-        case OP_ADD:
+            VM_NEXT();
+        VM_CASE(OP_ADD):
             if (IS_STRING(vm_stack_peek(0)) && IS_STRING(vm_stack_peek(1))) {
+                QUICKEN(OP_ADD_STR);
                 vmstring_concatenate();
             } else if (IS_NUMBER(vm_stack_peek(0)) && IS_NUMBER(vm_stack_peek(1))) {
+                QUICKEN(OP_ADD_NUM);
                 right = AS_NUMBER(vm_stack_pop());
                 left = AS_NUMBER(vm_stack_pop());
                 vm_stack_push(number_val(left + right));
             } else {
+                STORE_FRAME();
                 runtime_error("Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
-        case OP_SUBTRACT:
-            BINARY_OP(number_val, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(number_val, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(number_val, /);
-            break;
-        case OP_NIL:
+            VM_NEXT();
+        VM_CASE(OP_SUBTRACT):
+            BINARY_OP(number_val, -, OP_SUBTRACT_NUM);
+            VM_NEXT();
+        VM_CASE(OP_MULTIPLY):
+            BINARY_OP(number_val, *, OP_MULTIPLY_NUM);
+            VM_NEXT();
+        VM_CASE(OP_DIVIDE):
+            BINARY_OP(number_val, /, OP_DIVIDE_NUM);
+            VM_NEXT();
+        VM_CASE(OP_NIL):
             vm_stack_push(nil_val());
-            break;
-        case OP_TRUE:
+            VM_NEXT();
+        VM_CASE(OP_TRUE):
             vm_stack_push(bool_val(1));
-            break;
-        case OP_FALSE:
+            VM_NEXT();
+        VM_CASE(OP_FALSE):
             vm_stack_push(bool_val(0));
-            break;
-        case OP_EQUAL:
+            VM_NEXT();
+        VM_CASE(OP_EQUAL):
             rightValue = vm_stack_pop();
             leftValue = vm_stack_pop();
             vm_stack_push(bool_val(values_equal(leftValue, rightValue)));
-            break;
-        case OP_GREATER:
-            BINARY_OP(bool_val, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(bool_val, <);
-            break;
-        case OP_RETURN:
+            VM_NEXT();
+        VM_CASE(OP_GREATER):
+            BINARY_OP(bool_val, >, OP_GREATER_NUM);
+            VM_NEXT();
+        VM_CASE(OP_LESS):
+            BINARY_OP(bool_val, <, OP_LESS_NUM);
+            VM_NEXT();
+        VM_CASE(OP_RETURN):
             arbitraryValue = vm_stack_pop();
+            if (vm.openUpvalues != NULL) {
+                upvalues_close(slots);
+            }
 
             vm.frameCount--;
             if (vm.frameCount == 0) {
                 return INTERPRET_OK;
             }
 
-            vm.stackTop = frame->slots;
+            vm.stackTop = slots;
             vm_stack_push(arbitraryValue);
 
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        case OP_PRINT:
+            LOAD_FRAME();
+            JIT_ENTER();
+            VM_NEXT();
+        VM_CASE(OP_PRINT):
             arbitraryValue = vm_stack_pop();
             value_print(arbitraryValue);
             printf("\n");
-            break;
-        case OP_POP:
+            VM_NEXT();
+        VM_CASE(OP_POP):
             vm_stack_pop();
-            break;
-        case OP_DEFINE_GLOBAL:
-            name = READ_STRING();
-            arbitraryValue = vm_stack_peek(0);
-            table_set(&vm.globals, name, arbitraryValue);
+            VM_NEXT();
+        VM_CASE(OP_DEFINE_GLOBAL):
+            slot = READ_SHORT();
+            vm.globalValues.values[slot] = vm_stack_peek(0);
             vm_stack_pop();
-            break;
-        case OP_GET_GLOBAL:
-            name = READ_STRING();
-            if (!table_get(&vm.globals, name, &arbitraryValue)) {
-                runtime_error("Undefined variable at '%s'", name->chars);
+            VM_NEXT();
+        VM_CASE(OP_GET_GLOBAL):
+            slot = READ_SHORT();
+            arbitraryValue = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(arbitraryValue)) {
+                STORE_FRAME();
+                runtime_error("Undefined variable at '%s'", GLOBAL_NAME(slot));
                 return INTERPRET_RUNTIME_ERROR;
             }
             vm_stack_push(arbitraryValue);
-            break;
-        case OP_SET_GLOBAL:
-            name = READ_STRING();
-            if (table_set(&vm.globals, name, vm_stack_peek(0))) {
-                runtime_error("Undefined variable '%s'.", name->chars);
+            VM_NEXT();
+        VM_CASE(OP_SET_GLOBAL):
+            slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                STORE_FRAME();
+                runtime_error("Undefined variable '%s'.", GLOBAL_NAME(slot));
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
-        case OP_GET_LOCAL:
+            vm.globalValues.values[slot] = vm_stack_peek(0);
+            VM_NEXT();
+        VM_CASE(OP_GET_LOCAL):
             instruction = READ_BYTE();
-            vm_stack_push(frame->slots[instruction]);
-            break;
-        case OP_SET_LOCAL:
+            vm_stack_push(slots[instruction]);
+            VM_NEXT();
+        VM_CASE(OP_SET_LOCAL):
             instruction = READ_BYTE();
-            frame->slots[instruction] = vm_stack_peek(0);
-            break;
-        case OP_JUMP_IF_FALSE:
+            slots[instruction] = vm_stack_peek(0);
+            VM_NEXT();
+        VM_CASE(OP_JUMP_IF_FALSE):
             offset = READ_SHORT();
             if (is_falsey(vm_stack_peek(0))) {
-                frame->ip += offset;
+                ip += offset;
             }
-            break;
-        case OP_JUMP:
+            VM_NEXT();
+        VM_CASE(OP_JUMP):
             offset = READ_SHORT();
-            frame->ip += offset;
-            break;
-        case OP_LOOP:
+            ip += offset;
+            VM_NEXT();
+        VM_CASE(OP_LOOP):
             offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
-        case OP_CALL:
+            ip -= offset;
+            TRACE_ENTER();
+            JIT_ENTER();
+            VM_NEXT();
+        VM_CASE(OP_TAIL_CALL):
+        VM_CASE(OP_CALL):
             argCount = READ_BYTE();
-            if (!value_call(vm_stack_peek(argCount), argCount)) {
+            callCache = &frame->function->callCaches[READ_SHORT()];
+            arbitraryValue = vm_stack_peek(argCount);
+            STORE_FRAME();
+            if (!IS_OBJECT(arbitraryValue) || AS_OBJECT(arbitraryValue) != callCache->callee) {
+                // Only a tail call that will reuse the frame skips value_call.
+                if (instruction != OP_TAIL_CALL || !callee_accepts(arbitraryValue, argCount)) {
+                    if (!value_call(arbitraryValue, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    call_cache_update(callCache, arbitraryValue);
+                    LOAD_FRAME();
+                    JIT_ENTER();
+                    VM_NEXT();
+                }
+                call_cache_update(callCache, arbitraryValue);
+            }
+
+            // The callee took this many arguments the last time.
+            if (callCache->function == NULL) {
+                vm.stackTop[-argCount - 1] = callCache->native(argCount, vm.stackTop - argCount);
+                vm.stackTop -= argCount;
+            } else if (instruction == OP_TAIL_CALL) {
+                // The callee and its arguments replace the frame's slots, so
+                // tail recursion runs in constant space.
+                if (!frame_reuse(frame, callCache->function, callCache->closure, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                JIT_ENTER();
+            } else {
+                if (!frame_reserve(callCache->function, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount++];
+                frame->function = callCache->function;
+                frame->closure = callCache->closure;
+                frame->slots = slots = vm.stackTop - argCount - 1;
+                ip = callCache->function->chunk.code;
+                constants = callCache->function->chunk.constants.values;
+                JIT_ENTER();
+            }
+            VM_NEXT();
+        VM_CASE(OP_CLOSURE):
+            ip = closure_create(frame, ip);
+            VM_NEXT();
+        VM_CASE(OP_GET_UPVALUE):
+            arbitraryValue = frame->closure->captures[READ_BYTE()];
+            if (IS_UPVALUE(arbitraryValue)) {
+                arbitraryValue = *AS_UPVALUE(arbitraryValue)->location;
+            }
+            vm_stack_push(arbitraryValue);
+            VM_NEXT();
+        VM_CASE(OP_SET_UPVALUE):
+            // Assigned captures are always shared.
+            *AS_UPVALUE(frame->closure->captures[READ_BYTE()])->location = vm_stack_peek(0);
+            VM_NEXT();
+        VM_CASE(OP_CLOSE_UPVALUE):
+            upvalues_close(vm.stackTop - 1);
+            vm_stack_pop();
+            VM_NEXT();
+        VM_CASE(OP_CLASS):
+            vm_stack_push(object_val((VmObject*)vmclass_new(READ_STRING())));
+            VM_NEXT();
+        VM_CASE(OP_INHERIT):
+            if (!IS_CLASS(vm_stack_peek(1))) {
+                STORE_FRAME();
+                runtime_error("Superclass must be a class.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        default:
+            klass = AS_CLASS(vm_stack_peek(0));
+            table_add_all(&AS_CLASS(vm_stack_peek(1))->methods, &klass->methods);
+            klass->initializer = AS_CLASS(vm_stack_peek(1))->initializer;
+            vm_stack_pop();
+            VM_NEXT();
+        VM_CASE(OP_METHOD):
+            name = READ_STRING();
+            klass = AS_CLASS(vm_stack_peek(1));
+            table_set(&klass->methods, name, vm_stack_peek(0));
+            if (name == vm.initString) {
+                klass->initializer = vm_stack_peek(0);
+            }
+            vm_stack_pop();
+            VM_NEXT();
+        VM_CASE(OP_GET_PROPERTY):
+            name = READ_STRING();
+            cache = &frame->function->caches[READ_SHORT()];
+            STORE_FRAME();
+            if (!property_get(cache, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_NEXT();
+        VM_CASE(OP_SET_PROPERTY):
+            name = READ_STRING();
+            cache = &frame->function->caches[READ_SHORT()];
+            STORE_FRAME();
+            if (!property_set(cache, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_NEXT();
+        VM_CASE(OP_INVOKE):
+            name = READ_STRING();
+            argCount = READ_BYTE();
+            cache = &frame->function->caches[READ_SHORT()];
+            STORE_FRAME();
+            if (!property_invoke(cache, name, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            VM_NEXT();
+        VM_CASE(OP_GET_SUPER):
+            name = READ_STRING();
+            klass = AS_CLASS(vm_stack_pop());
+            STORE_FRAME();
+            if (!method_bind(klass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_NEXT();
+        VM_CASE(OP_SUPER_INVOKE):
+            name = READ_STRING();
+            argCount = READ_BYTE();
+            klass = AS_CLASS(vm_stack_pop());
+            STORE_FRAME();
+            if (!method_invoke(klass, name, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            VM_NEXT();
+        VM_CASE(OP_ADD_NUM):
+            BINARY_OP_NUMBER(number_val, +, OP_ADD);
+            VM_NEXT();
+        VM_CASE(OP_ADD_STR):
+            if (IS_STRING(vm_stack_peek(0)) && IS_STRING(vm_stack_peek(1))) {
+                vmstring_concatenate();
+            } else {
+                QUICKEN(OP_ADD);
+                ip--;
+            }
+            VM_NEXT();
+        VM_CASE(OP_SUBTRACT_NUM):
+            BINARY_OP_NUMBER(number_val, -, OP_SUBTRACT);
+            VM_NEXT();
+        VM_CASE(OP_MULTIPLY_NUM):
+            BINARY_OP_NUMBER(number_val, *, OP_MULTIPLY);
+            VM_NEXT();
+        VM_CASE(OP_DIVIDE_NUM):
+            BINARY_OP_NUMBER(number_val, /, OP_DIVIDE);
+            VM_NEXT();
+        VM_CASE(OP_GREATER_NUM):
+            BINARY_OP_NUMBER(bool_val, >, OP_GREATER);
+            VM_NEXT();
+        VM_CASE(OP_LESS_NUM):
+            BINARY_OP_NUMBER(bool_val, <, OP_LESS);
+            VM_NEXT();
+        VM_CASE(OP_GET_LOCAL2):
+            vm.stackTop[0] = slots[ip[0]];
+            vm.stackTop[1] = slots[ip[1]];
+            vm.stackTop += 2;
+            ip += 2;
+            VM_NEXT();
+        VM_CASE(OP_ADD_LOCAL_CONSTANT):
+            leftValue = slots[READ_BYTE()];
+            rightValue = READ_CONSTANT();
+            if (IS_NUMBER(leftValue) && IS_NUMBER(rightValue)) {
+                vm_stack_push(number_val(AS_NUMBER(leftValue) + AS_NUMBER(rightValue)));
+            } else if (IS_STRING(leftValue) && IS_STRING(rightValue)) {
+                vm_stack_push(leftValue);
+                vm_stack_push(rightValue);
+                vmstring_concatenate();
+            } else {
+                STORE_FRAME();
+                runtime_error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_NEXT();
+        VM_CASE(OP_SUBTRACT_LOCAL_CONSTANT):
+            leftValue = slots[READ_BYTE()];
+            rightValue = READ_CONSTANT();
+            if (!IS_NUMBER(leftValue) || !IS_NUMBER(rightValue)) {
+                STORE_FRAME();
+                runtime_error("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm_stack_push(number_val(AS_NUMBER(leftValue) - AS_NUMBER(rightValue)));
+            VM_NEXT();
+        VM_CASE(OP_JUMP_IF_NOT_LESS):
+            offset = READ_SHORT();
+            if (!IS_NUMBER(vm.stackTop[-1]) || !IS_NUMBER(vm.stackTop[-2])) {
+                STORE_FRAME();
+                runtime_error("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!(AS_NUMBER(vm.stackTop[-2]) < AS_NUMBER(vm.stackTop[-1]))) {
+                ip += offset;
+            }
+            vm.stackTop -= 2;
+            VM_NEXT();
+        VM_CASE(OP_CONCAT_N):
+            argCount = READ_BYTE();
+            if (!values_concatenate(argCount)) {
+                STORE_FRAME();
+                runtime_error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_NEXT();
+        VM_CASE(OP_MOVE):
+            slots[ip[0]] = slots[ip[1]];
+            ip += 2;
+            VM_NEXT();
+        VM_CASE(OP_LOAD_CONSTANT):
+            slots[ip[0]] = constants[ip[1]];
+            ip += 2;
+            VM_NEXT();
+        VM_CASE(OP_ADD_RR):
+            REGISTER_ADD(slots[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_ADD_RK):
+            REGISTER_ADD(constants[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_SUBTRACT_RR):
+            REGISTER_OP(-, slots[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_SUBTRACT_RK):
+            REGISTER_OP(-, constants[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_MULTIPLY_RR):
+            REGISTER_OP(*, slots[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_MULTIPLY_RK):
+            REGISTER_OP(*, constants[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_DIVIDE_RR):
+            REGISTER_OP(/, slots[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_DIVIDE_RK):
+            REGISTER_OP(/, constants[ip[2]]);
+            VM_NEXT();
+        VM_CASE(OP_JUMP_IF_NOT_LESS_RR):
+            REGISTER_JUMP_IF_NOT_LESS(slots[ip[1]]);
+            VM_NEXT();
+        VM_CASE(OP_JUMP_IF_NOT_LESS_RK):
+            REGISTER_JUMP_IF_NOT_LESS(constants[ip[1]]);
+            VM_NEXT();
+#ifdef VM_JIT
+        jit_enter:
+            // Generated code returns whenever the frame on top changes. The
+            // interpreter takes over at the first frame without code.
+            STORE_FRAME();
+            do {
+                jitStatus = jit_run(frame);
+                if (jitStatus == JIT_DONE) {
+                    return INTERPRET_OK;
+                }
+                if (jitStatus == JIT_ERROR) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+            } while (JIT_READY(frame->function));
+            LOAD_FRAME();
+            VM_NEXT();
+#endif
+        VM_DEFAULT():
             return INTERPRET_COMPILE_ERROR;
-        }
     }
+#ifndef VM_COMPUTED_GOTO
+    }
+#endif
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_STRING
+#undef GLOBAL_NAME
 #undef BINARY_OP
+#undef BINARY_OP_NUMBER
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef REGISTER_JUMP_IF_NOT_LESS
+#undef QUICKEN
+#undef STORE_FRAME
+#undef LOAD_FRAME
+}
+
+static int limit(size_t configured, int fallback)
+{
+    return configured == 0 ? fallback : configured > INT_MAX / 2 ? INT_MAX / 2 : (int)configured;
+}
+
+// Allocates the initial stack and frames. Less than what was allocated may
+// be usable when a limit is below the initial size; pushes made before any
+// call, such as while compiling, still have the whole block.
+static void vm_limits_init(const VmConfig* config)
+{
+    vm.maxFrames = limit(config != NULL ? config->maxFrames : 0, FRAMES_MAX_DEFAULT);
+    vm.maxStack = limit(config != NULL ? config->maxStack : 0, STACK_MAX_DEFAULT);
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    if (vm.frames == NULL || vm.stack == NULL) {
+        fprintf(stderr, "Out of memory: cannot allocate the VM stack.\n");
+        exit(70);
+    }
+    vm.frameCapacity = vm.maxFrames < FRAMES_INITIAL ? vm.maxFrames : FRAMES_INITIAL;
+    vm.stackCapacity = vm.maxStack < STACK_INITIAL ? vm.maxStack : STACK_INITIAL;
+}
+
+// Differs between runs by the time and by where the stack was placed.
+static uint64_t hash_seed_random()
+{
+    uint64_t seed = (uint64_t)time(NULL);
+
+    seed = seed * 6364136223846793005ull + (uint64_t)clock();
+    seed = seed * 6364136223846793005ull + (uint64_t)(uintptr_t)&seed;
+    return seed;
 }
 
-void vm_init()
+void vm_init(const VmConfig* config)
 {
     vm.objects = NULL;
+    vm.bytesAllocated = 0;
+    vm.nextGC = GC_INITIAL_THRESHOLD;
+    vm.maxHeap = config != NULL ? config->maxHeap : 0;
+    vm.printGcStats = config != NULL ? config->gcStats : 0;
+    vm.opcodeProfile = config != NULL ? config->opcodeProfile : NULL;
+    vm.bytecodeCache = config == NULL || !config->noBytecodeCache;
+    vm.jitThreshold = config != NULL ? config->jitThreshold : 0;
+    vm.traceThreshold = config != NULL ? config->traceThreshold : 0;
+    vm.printTraceStats = config != NULL ? config->traceStats : 0;
+    vm.registerMode = config != NULL && config->registerMode;
+    vm.dumpPeephole = config != NULL && config->dumpPeephole;
+    vm.printStringStats = config != NULL && config->stringStats;
+    memset(&vm.traceStats, 0, sizeof(TraceStats));
+#ifndef VM_JIT
+    if (vm.jitThreshold != 0 || vm.traceThreshold != 0) {
+        fprintf(stderr, "No JIT: built without LOX_JIT, or not for x86-64 Linux with LOX_NAN_BOXING.\n");
+        vm.jitThreshold = 0;
+        vm.traceThreshold = 0;
+    }
+#endif
+    if (vm.maxHeap != 0 && vm.nextGC > vm.maxHeap) {
+        vm.nextGC = vm.maxHeap;
+    }
+    vm.grayCount = 0;
+    vm.grayCapacity = 0;
+    vm.grayStack = NULL;
+    memset(&vm.gcStats, 0, sizeof(GcStats));
+    vm.gcStats.startTime = (double)clock() / CLOCKS_PER_SEC;
+    vm_limits_init(config);
     vm_stack_reset();
+    vm.initString = NULL;
+    table_hash_seed(config != NULL && config->randomHashSeed ? hash_seed_random() : 0);
     table_init(&vm.strings);
     table_init(&vm.globals);
+    value_array_init(&vm.globalValues);
+    value_array_init(&vm.globalNames);
+    vm.initString = vmstring_copy("init", 4);
     native_define("clock", native_clock);
 }
 
 void vm_free()
 {
+    if (vm.printGcStats) {
+        gc_stats_print(stderr);
+    }
+
+    if (vm.printTraceStats) {
+        trace_stats_print(stderr);
+    }
+
+    if (vm.printStringStats) {
+        table_stats_print(&vm.strings, "strings", stderr);
+    }
+
+    if (vm.opcodeProfile != NULL) {
+#ifdef VM_PROFILE_OPCODES
+        profile_dump(vm.opcodeProfile, stderr);
+#else
+        fprintf(stderr, "No opcode profile written: built without LOX_PROFILE_OPCODES.\n");
+#endif
+    }
+
     vm_stack_reset();
-    objects_free();
     table_free(&vm.strings);
     table_free(&vm.globals);
+    value_array_free(&vm.globalValues);
+    value_array_free(&vm.globalNames);
+    vm.initString = NULL;
+    objects_free();
+    free(vm.frames);
+    free(vm.stack);
+    vm.frames = NULL;
+    vm.stack = NULL;
+    free(vm.grayStack);
+    vm.grayStack = NULL;
+    vm.grayCapacity = 0;
 }
 
-VmInterpretResult vm_interpret(const char* code)
+static VmInterpretResult vm_execute(VmFunction* function)
 {
-    VmFunction* function = compile(code);
-    CallFrame* frame = NULL;
-
     if (function == NULL) {
         return INTERPRET_COMPILE_ERROR;
     }
 
     vm_stack_push(object_val((VmObject*)function));
+    if (vm.registerMode) {
+        register_translate(function);
+    }
     value_call(object_val((VmObject*)function), 0);
 
     return vm_run();
 }
+
+VmInterpretResult vm_interpret(const char* code)
+{
+    return vm_execute(compile(code));
+}
+
+// Runs a script from its .loxc cache when the cache matches the source, and
+// otherwise compiles it and refreshes the cache.
+VmInterpretResult vm_interpret_file(const char* path, const char* code)
+{
+    char* cachePath = vm.bytecodeCache ? cache_path(path) : NULL;
+    size_t length = strlen(code);
+    VmFunction* function = cachePath != NULL ? cache_load(cachePath, code, length) : NULL;
+
+    if (function == NULL) {
+        function = compile(code);
+        if (function != NULL && cachePath != NULL) {
+            cache_write(cachePath, function, code, length);
+        }
+    }
+
+    free(cachePath);
+    return vm_execute(function);
+}
+
+VmInterpretResult vm_compile_file(const char* path, const char* code)
+{
+    char* cachePath = cache_path(path);
+    VmFunction* function = compile(code);
+    VmInterpretResult result = INTERPRET_COMPILE_ERROR;
+
+    if (function != NULL && cachePath != NULL) {
+        if (cache_write(cachePath, function, code, strlen(code))) {
+            result = INTERPRET_OK;
+        } else {
+            fprintf(stderr, "Cannot write %s\n", cachePath);
+            result = INTERPRET_RUNTIME_ERROR;
+        }
+    }
+
+    free(cachePath);
+    return result;
+}
@@ -0,0 +1,49 @@
+# Runs LOX on SCRIPT and compares what it prints, after the version line,
+# with the `// expect: ` comments in SCRIPT, in order. A script with an
+# `// expect runtime error: ` comment must fail with that message instead,
+# and with exactly the stack trace in its `// expect trace: ` comments, if
+# it has any. An `// args: ` comment passes options to LOX.
+file(STRINGS "${SCRIPT}" lines)
+set(expected "")
+set(expected_error "")
+set(expected_trace "")
+set(args "")
+foreach(line IN LISTS lines)
+	if(line MATCHES "// expect: (.*)$")
+		set(expected "${expected}${CMAKE_MATCH_1}\n")
+	elseif(line MATCHES "// expect runtime error: (.*)$")
+		set(expected_error "${CMAKE_MATCH_1}")
+	elseif(line MATCHES "// expect trace: (.*)$")
+		set(expected_trace "${expected_trace}${CMAKE_MATCH_1}\n")
+	elseif(line MATCHES "// args: (.*)$")
+		separate_arguments(args UNIX_COMMAND "${CMAKE_MATCH_1}")
+	endif()
+endforeach()
+
+# lox waits for a key press after running a file.
+file(WRITE "${CMAKE_CURRENT_BINARY_DIR}/lox_test_input" "\n")
+execute_process(
+	COMMAND "${LOX}" --no-cache ${args} "${SCRIPT}"
+	INPUT_FILE "${CMAKE_CURRENT_BINARY_DIR}/lox_test_input"
+	OUTPUT_VARIABLE output
+	ERROR_VARIABLE errors
+	RESULT_VARIABLE result
+)
+string(FIND "${output}" "\n" header)
+math(EXPR header "${header} + 1")
+string(SUBSTRING "${output}" ${header} -1 output)
+
+if(expected_error)
+	string(FIND "${errors}" "${expected_error}\n" found)
+	if(NOT result EQUAL 70 OR found EQUAL -1)
+		message(FATAL_ERROR "${SCRIPT} exited with ${result}\n${errors}instead of failing with\n${expected_error}")
+	endif()
+	if(expected_trace AND NOT errors STREQUAL "${expected_error}\n${expected_trace}")
+		message(FATAL_ERROR "${SCRIPT} reported\n${errors}instead of\n${expected_error}\n${expected_trace}")
+	endif()
+elseif(NOT result EQUAL 0)
+	message(FATAL_ERROR "${SCRIPT} exited with ${result}\n${errors}")
+endif()
+if(NOT output STREQUAL expected)
+	message(FATAL_ERROR "${SCRIPT} printed\n${output}instead of\n${expected}")
+endif()